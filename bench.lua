@@ -0,0 +1,204 @@
+-- 性能测试：按协议生成数据，统计每次操作的耗时，吞吐量，lua分配的内存和GC次数
+-- 用法：lua bench.lua [--json 结果文件] [--time 每项的秒数] [--cflags 编译参数] [名称过滤]
+-- 数据由固定的随机种子生成，同一台机器上的结果可以直接对比
+local tars = require "tars_wrapper"
+
+local options = {time = 0.5}
+do
+    local i = 1
+    while i <= #arg do
+        if arg[i] == "--json" then
+            options.json, i = arg[i + 1], i + 2
+        elseif arg[i] == "--time" then
+            options.time, i = tonumber(arg[i + 1]), i + 2
+        elseif arg[i] == "--cflags" then
+            options.cflags, i = arg[i + 1], i + 2
+        else
+            options.filter, i = arg[i], i + 1
+        end
+    end
+end
+
+-- 嵌套的层数
+local DEPTH = 8
+
+-- 生成协议，嵌套的结构体按层数逐层生成
+local function schema()
+    local lines = {[[
+struct TSmall {
+    0 require int iId;
+    1 optional string sName;
+    2 optional long iWhen;
+    3 optional bool bFlag;
+    4 optional short nLevel;
+    5 optional unsigned int uScore;
+};
+
+struct TBigMap {
+    0 optional map<int, TSmall> mItems;
+};
+
+struct TStrings {
+    0 optional vector<string> vItems;
+};
+
+struct TInts {
+    0 optional vector<long> vItems;
+};
+
+struct TBlob {
+    0 optional int iId;
+    1 optional vector<byte> vData;
+    2 optional string sText;
+};
+]]}
+    lines[#lines + 1] = "struct TDeep0 {\n    0 optional int iId;\n    1 optional string sName;\n};\n"
+    for i = 1, DEPTH do
+        lines[#lines + 1] = string.format(
+            "struct TDeep%d {\n    0 optional int iId;\n    1 optional TDeep%d stChild;\n    2 optional vector<TDeep%d> vChildren;\n};\n",
+            i, i - 1, i - 1)
+    end
+    return table.concat(lines, "\n")
+end
+
+local context = tars.parse(schema())
+
+-- 固定种子，保证每次生成的数据一样
+math.randomseed(20240601)
+local random = math.random
+
+local function word(n)
+    local t = {}
+    for i = 1, n do
+        t[i] = string.char(random(97, 122))
+    end
+    return table.concat(t)
+end
+
+local function small(i)
+    return {
+        iId = i, sName = word(12), iWhen = random(1, 1 << 40), bFlag = i % 2 == 0,
+        nLevel = random(-1000, 1000), uScore = random(0, 1 << 31),
+    }
+end
+
+local function deep(level)
+    if level == 0 then
+        return {iId = random(1, 1000), sName = word(8)}
+    end
+    return {iId = level, stChild = deep(level - 1), vChildren = {deep(level - 1)}}
+end
+
+local function list(n, f)
+    local t = {}
+    for i = 1, n do
+        t[i] = f(i)
+    end
+    return t
+end
+
+-- 测试的数据，每项是结构体名称和对象
+local workloads = {
+    {"small", "TSmall", small(1)},
+    {"deep", "TDeep" .. DEPTH, deep(DEPTH)},
+    {"bigmap", "TBigMap", {mItems = list(2000, small)}},
+    {"strings", "TStrings", {vItems = list(2000, function() return word(random(4, 64)) end)}},
+    {"ints", "TInts", {vItems = list(10000, function() return random(-(1 << 50), 1 << 50) end)}},
+}
+
+local cases = {}
+for _, w in ipairs(workloads) do
+    local name, struct, obj = w[1], w[2], w[3]
+    local data = context:encodeStruct(struct, obj)
+    cases[#cases + 1] = {name .. ".encode", #data, function() return context:encodeStruct(struct, obj) end}
+    cases[#cases + 1] = {name .. ".decode", #data, function() return context:decodeStruct(struct, data) end}
+end
+
+-- base64和压缩的路径，压缩用重复度高的文本
+do
+    local blob = {iId = 1, vData = word(4096), sText = ("tars benchmark "):rep(4096)}
+    local data = context:encodeStruct("TBlob", blob)
+    local b64 = context:encode("TBlob", blob)
+    local zipped = context:encodeZip("TBlob", blob)
+    cases[#cases + 1] = {"base64.encode", #data, function() return context:encode("TBlob", blob) end}
+    cases[#cases + 1] = {"base64.decode", #data, function() return context:decode("TBlob", b64) end}
+    cases[#cases + 1] = {"zip.encode", #data, function() return context:encodeZip("TBlob", blob) end}
+    cases[#cases + 1] = {"unzip.decode", #data, function() return context:unzipDecode("TBlob", zipped) end}
+end
+
+-- GC次数：对象被回收时计数，再创建一个新的哨兵，每轮回收都会触发一次
+local gc_count = 0
+local function sentinel()
+    setmetatable({}, {__gc = function()
+        gc_count = gc_count + 1
+        sentinel()
+    end})
+end
+sentinel()
+
+local clock = os.clock
+
+local function measure(f)
+    -- 预热，同时估算单次的耗时
+    local n, start = 1, clock()
+    repeat
+        for _ = 1, n do
+            f()
+        end
+        n = n * 2
+    until clock() - start > 0.05
+    n = math.max(1, math.floor(n * options.time / 0.1))
+
+    -- 停掉GC统计分配的字节数，大的数据只取少量样本，避免占用太多内存
+    local samples = math.min(n, 32)
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local before = collectgarbage("count")
+    for _ = 1, samples do
+        f()
+    end
+    local alloc = (collectgarbage("count") - before) * 1024 / samples
+    collectgarbage("restart")
+
+    -- 正常运行统计耗时和GC次数
+    collectgarbage("collect")
+    local steps = gc_count
+    start = clock()
+    for _ = 1, n do
+        f()
+    end
+    local elapsed = clock() - start
+    return n, elapsed, alloc, (gc_count - steps) / n
+end
+
+-- 库的编译参数和实际加载的路径，不同编译参数的结果不能直接对比
+local cflags = options.cflags or "unknown"
+local module = package.searchpath("tars", package.cpath) or "unknown"
+print(string.format("module: %s, cflags: %s", module, cflags))
+
+local results = {}
+print(string.format("%-16s %10s %12s %10s %14s %12s", "name", "ops", "ns/op", "MB/s", "alloc B/op", "gc/op"))
+for _, c in ipairs(cases) do
+    local name, bytes, f = c[1], c[2], c[3]
+    if not options.filter or name:find(options.filter, 1, true) then
+        local n, elapsed, alloc, steps = measure(f)
+        local ns = elapsed * 1e9 / n
+        local mbs = bytes * n / elapsed / (1024 * 1024)
+        results[#results + 1] = {name = name, bytes = bytes, ops = n, ns = ns, mbs = mbs, alloc = alloc, gc = steps}
+        print(string.format("%-16s %10d %12.1f %10.2f %14.1f %12.6f", name, n, ns, mbs, alloc, steps))
+    end
+end
+
+-- 机器可读的结果，每项一行json，方便和之前的结果对比
+if options.json then
+    local function quote(s)
+        return '"' .. s:gsub('[\\"]', '\\%0') .. '"'
+    end
+    local f = assert(io.open(options.json, "w"))
+    for _, r in ipairs(results) do
+        f:write(string.format(
+            '{"name": "%s", "bytes": %d, "ops": %d, "ns_per_op": %.1f, "mb_per_s": %.3f, "alloc_bytes_per_op": %.1f, "gc_per_op": %.6f, "cflags": %s, "module": %s}\n',
+            r.name, r.bytes, r.ops, r.ns, r.mbs, r.alloc, r.gc, quote(cflags), quote(module)))
+    end
+    f:close()
+end
@@ -3,15 +3,23 @@
 #include "lualib.h"
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "portable_endian.h"
 
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <zlib.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TARS_BASE64_SIMD
+#include <immintrin.h>
+#endif
+
 // 编码中使用的字段类型
 #define TarsHeadeChar 0
 #define TarsHeadeShort 1
@@ -50,49 +58,214 @@
 // #define VERB(...) fprintf(stdout, __VA_ARGS__), fputc('\n', stdout)
 #define VERB(...)
 
+// 编码用的持久缓存，跨调用保留扩容后的容量，只在显式释放时归还内存
+// 只有最外层的调用能用，编码时的分配可能触发__gc，里面再编码的嵌套调用使用自己的缓存
+struct wb_arena {
+    char* s;
+    size_t cap;
+
+    size_t grows;  // 扩容次数
+    size_t peak;   // 单次编码的最大长度
+    size_t uses;   // 编码次数
+
+    bool busy;       // 最外层的调用正在执行，由arena_call设置和清除
+    bool taken;      // 缓存已经被某个write_buffer占用
+    bool spilled;    // 嵌套的调用在注册表上挂了自己的缓存
+    bool inflating;  // 默认的解压器已经被占用
+    bool deflating;  // 默认的压缩器已经被占用
+};
+
 struct write_buffer {
     char* s;
     size_t n;
     size_t cap;
 
     lua_State* L;
+    struct wb_arena* A;  // 超出栈上缓存后使用的持久缓存，为NULL时使用自己的缓存
+
+    // 输出的去处，设置之后写满就交给它处理，而不是扩容，例如边编码边压缩
+    void (*flush)(struct write_buffer* B, const char* s, size_t n);
+    void* ud;
 
     char buf[LUAL_BUFFERSIZE];  // 堆栈上的缓存
 };
 
 static void* wb = &wb;
+static const void* wb_spills = &wb_spills;
+
+static int wb_arena_gc(lua_State* L)
+{
+    struct wb_arena* A = (struct wb_arena*)lua_touserdata(L, 1);
+    free(A->s);
+    A->s = NULL, A->cap = 0;
+    return 0;
+}
+
+// 取得虚拟机的编码缓存，不存在则创建并挂在注册表上
+// 同一个虚拟机同时只能有一个write_buffer使用它
+static struct wb_arena* wb_arena(lua_State* L)
+{
+    struct wb_arena* A = NULL;
+    if (LUA_TUSERDATA == lua_rawgetp(L, LUA_REGISTRYINDEX, wb)) {
+        A = (struct wb_arena*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return A;
+    }
+    lua_pop(L, 1);
+    A = (struct wb_arena*)lua_newuserdata(L, sizeof(struct wb_arena));
+    memset(A, 0, sizeof(struct wb_arena));
+    lua_newtable(L);
+    lua_pushcfunction(L, wb_arena_gc), lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, wb);
+    return A;
+}
+
+// 用保护模式执行最外层的调用，结束或者出错时都归还持久缓存和占用的默认解压器、压缩器
+// 嵌套的调用直接执行，上值1是真正的函数，上值2是闭包自己，保护模式调用它，报错时还能查到函数名
+static int arena_call(lua_State* L)
+{
+    lua_CFunction f = lua_tocfunction(L, lua_upvalueindex(1));
+    struct wb_arena* A = wb_arena(L);
+    if (A->busy) {
+        return f(L);
+    }
+    A->busy = true;
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_insert(L, 1);
+    int status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    A->busy = false, A->taken = false;
+    A->inflating = false, A->deflating = false;
+    if (A->spilled) {
+        lua_pushnil(L), lua_rawsetp(L, LUA_REGISTRYINDEX, wb_spills);
+        A->spilled = false;
+    }
+    if (LUA_OK != status) {
+        lua_error(L);
+    }
+    return lua_gettop(L);
+}
 
-static void wb_free(struct write_buffer* B)
+// 把库里的函数换成经过arena_call的闭包，表在栈顶
+static void arena_wrap(lua_State* L, const char** names)
 {
-    if (LUA_TUSERDATA == lua_rawgetp(B->L, LUA_REGISTRYINDEX, wb)) {
-        lua_pushnil(B->L);
-        lua_rawsetp(B->L, LUA_REGISTRYINDEX, wb);
+    for (; *names; ++names) {
+        lua_getfield(L, -1, *names);
+        lua_pushnil(L);
+        lua_pushcclosure(L, arena_call, 2);
+        lua_pushvalue(L, -1), lua_setupvalue(L, -2, 2);
+        lua_setfield(L, -2, *names);
     }
-    lua_pop(B->L, 1);
 }
 
 static void wb_init(struct write_buffer* B, lua_State* L)
 {
-    B->s = B->buf;
-    B->n = 0, B->cap = sizeof(B->buf);
+    struct wb_arena* A = wb_arena(L);
     B->L = L;
-    wb_free(B);
+    A->uses += 1;
+    if (A->busy && !A->taken) {
+        A->taken = true;
+        B->A = A;
+    }
+    else {
+        B->A = NULL;  // 嵌套的调用，持久缓存正在被外层使用
+    }
+    if (B->A && A->cap > sizeof(B->buf)) {
+        // 直接使用之前扩容过的缓存
+        B->s = A->s, B->cap = A->cap;
+    }
+    else {
+        B->s = B->buf, B->cap = sizeof(B->buf);
+    }
+    B->n = 0;
+    B->flush = NULL, B->ud = NULL;
 }
 
-static void wb_addlstr(struct write_buffer* B, const char* s, size_t l)
+// 嵌套调用的缓存是userdata，挂在注册表的表上，最外层的调用结束时一起释放
+static void wb_spill(struct write_buffer* B, size_t cap)
+{
+    lua_State* L = B->L;
+    luaL_checkstack(L, 3, NULL);
+    char* s = (char*)lua_newuserdata(L, cap);
+    memcpy(s, B->s, B->n);
+    if (LUA_TTABLE != lua_rawgetp(L, LUA_REGISTRYINDEX, wb_spills)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1), lua_rawsetp(L, LUA_REGISTRYINDEX, wb_spills);
+    }
+    wb_arena(L)->spilled = true;
+    lua_insert(L, -2);
+    lua_rawsetp(L, -2, B);
+    lua_pop(L, 1);
+    B->s = s, B->cap = cap;
+}
+
+static void wb_grow(struct write_buffer* B, size_t sz)
+{
+    struct wb_arena* A = B->A;
+    size_t cap = B->cap;
+    while (cap < sz) {
+        cap = cap * 3 / 2 + 1;
+    }
+    if (NULL == A) {
+        wb_spill(B, cap);
+        return;
+    }
+    if (A->cap < cap) {
+        char* s = NULL;
+        if (B->s == A->s) {
+            s = (char*)realloc(A->s, cap);  // 保留已经写入的内容
+        }
+        else {
+            free(A->s), A->s = NULL, A->cap = 0;
+            s = (char*)malloc(cap);
+        }
+        if (NULL == s) {
+            luaL_error(B->L, "write buffer out of memory, require %d", (int)cap);
+        }
+        A->s = s, A->cap = cap;
+        A->grows += 1;
+    }
+    if (B->s != A->s) {
+        // 从栈上的缓存搬到持久缓存
+        memcpy(A->s, B->s, B->n);
+    }
+    B->s = A->s, B->cap = A->cap;
+}
+
+// 把已经写入的内容交给flush处理
+static inline void wb_flush(struct write_buffer* B)
+{
+    if (B->n > 0) {
+        B->flush(B, B->s, B->n);
+        B->n = 0;
+    }
+}
+
+// 预留sz个字节，返回可以写入的位置，写入后由调用者增加n
+static inline char* wb_reserve(struct write_buffer* B, size_t sz)
 {
-    bool changed = false;
-    while (B->cap < B->n + l) {
-        B->cap = B->cap * 3 / 2 + 1;
-        changed = true;
+    if (B->cap < B->n + sz) {
+        if (B->flush) {
+            wb_flush(B);
+        }
+        if (B->cap < B->n + sz) {
+            wb_grow(B, B->n + sz);
+        }
     }
-    if (changed) {
-        char* ud = (char*)lua_newuserdata(B->L, B->cap * sizeof(char));
-        lua_rawsetp(B->L, LUA_REGISTRYINDEX, wb);
-        memcpy(ud, B->s, B->n);
-        B->s = ud;
+    return B->s + B->n;
+}
+
+static void wb_addlstr(struct write_buffer* B, const char* s, size_t l)
+{
+    if (B->flush && B->cap < B->n + l) {
+        wb_flush(B);
+        if (B->cap < l) {
+            B->flush(B, s, l);  // 放不下的长字符串直接交给flush
+            return;
+        }
     }
-    memcpy(B->s + B->n, s, l);
+    memcpy(wb_reserve(B, l), s, l);
     B->n += l;
 }
 
@@ -101,10 +274,19 @@ static void wb_addchar(struct write_buffer* B, char c)
     wb_addlstr(B, &c, 1);
 }
 
+// 回填大端的4字节整数，用于先占位后写入的长度
+static inline void wb_patch_be32(struct write_buffer* B, size_t offset, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(B->s + offset, &v, sizeof v);
+}
+
 static void wb_pushresult(struct write_buffer* B, lua_State* L)
 {
+    if (B->A && B->A->peak < B->n) {
+        B->A->peak = B->n;
+    }
     lua_pushlstring(L, B->s, B->n);
-    wb_free(B);
 }
 
 // 默认值联合体
@@ -123,12 +305,77 @@ struct tars_field {
     union default_value def;
 };
 
+// 结构体的描述
+struct tars_struct {
+    uint32_t first;      // 第一个字段的下标
+    uint32_t n;          // 字段数量
+    bool sorted;         // 字段是否按序号升序声明
+    uint8_t index[256];  // 序号 => 字段相对first的下标
+};
+
+#define STRUCT_NO_FIELD 0xFF
+
+struct tars_shared;
+
 // 所有类型的上下文
+// 字段数组之后依次存放结构体描述数组，以及每个字段所属结构体的下标
+// 元表里存字段名称和结构体的标识符，共享上下文的句柄在访问时才从共享内存取出，所以名称要用lua_geti查询
 struct tars_context {
-    size_t n;
+    size_t n;                    // 字段数量
+    size_t nstruct;              // 结构体数量
+    struct tars_shared* shared;  // 不为NULL时是共享上下文的句柄，字段数据在共享的上下文里
     struct tars_field fields[0];
 };
 
+static inline struct tars_struct* context_structs(struct tars_context* context)
+{
+    return (struct tars_struct*)(context->fields + context->n);
+}
+
+static inline uint32_t* context_owners(struct tars_context* context)
+{
+    return (uint32_t*)(context_structs(context) + context->nstruct);
+}
+
+// 上下文占用的内存大小
+static inline size_t context_size(size_t n, size_t nstruct)
+{
+    return sizeof(struct tars_context) + n * sizeof(struct tars_field) + nstruct * sizeof(struct tars_struct) +
+           n * sizeof(uint32_t);
+}
+
+// 通过结构体id查询描述，id无效返回NULL
+static inline struct tars_struct* context_struct(struct tars_context* context, uint32_t id)
+{
+    size_t first = id - LUATARS_TYPE_MAX;
+    if (id < LUATARS_TYPE_MAX || first >= context->n) {
+        return NULL;
+    }
+    struct tars_struct* st = context_structs(context) + context_owners(context)[first];
+    return st->first == first ? st : NULL;
+}
+
+static struct tars_struct* check_struct(lua_State* L, struct tars_context* context, uint32_t id)
+{
+    struct tars_struct* st = context_struct(context, id);
+    if (NULL == st) {
+        luaL_error(L, "[C] invalid struct, id = %d", (int)id);
+    }
+    return st;
+}
+
+static struct tars_context* shared_context(struct tars_shared* shared);
+
+// 取得栈上的上下文，共享上下文的句柄返回共享的上下文
+static struct tars_context* check_context(lua_State* L, int idx)
+{
+    struct tars_context* context = (struct tars_context*)lua_touserdata(L, idx);
+    if (NULL == context) {
+        luaL_error(L, "context expected, got '%s'", luaL_typename(L, idx));
+    }
+    return NULL == context->shared ? context : shared_context(context->shared);
+}
+
 #define _ENUM_CASE(Enum, Len)       \
     case (Enum):                    \
         if (Len) {                  \
@@ -164,6 +411,86 @@ static const char* _tars_type_name(uint8_t type, size_t* len)
 // 列表、字典元表的id
 static const void *list_mt = &list_mt, *map_mt = &map_mt;
 
+// 校验userdata的元表是注册表里mt位置的元表
+static void* check_object(lua_State* L, int idx, const void* mt, const char* name)
+{
+    void* p = lua_touserdata(L, idx);
+    bool valid = false;
+    if (NULL != p && lua_getmetatable(L, idx)) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, mt);
+        valid = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    if (!valid) {
+        luaL_error(L, "%s expected, got '%s'", name, luaL_typename(L, idx));
+    }
+    return p;
+}
+
+// 库自己创建的userdata的元表集合，弱键，上下文的元表在创建上下文时加入
+static const void* object_mts = &object_mts;
+
+// 把idx位置的元表加入集合
+static void mark_object_mt(lua_State* L, int idx)
+{
+    idx = lua_absindex(L, idx);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, object_mts);
+    lua_pushvalue(L, idx);
+    lua_pushboolean(L, true);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+// 是否是库自己创建的userdata，例如上下文、解码器、压缩器，这些内存不能当作数据
+static bool is_object(lua_State* L, int idx)
+{
+    if (!lua_getmetatable(L, idx)) {
+        return false;
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, object_mts);
+    lua_insert(L, -2);
+    bool found = LUA_TNIL != lua_rawget(L, -2);
+    lua_pop(L, 2);
+    return found;
+}
+
+// 大字符串的切片，指向源数据里的内容，不复制，附加值引用源数据保证内存有效
+struct tars_slice {
+    const char* s;
+    size_t n;
+};
+
+// 切片元表的id，虚拟机的切片阈值也用它作为注册表的键
+static const void* slice_mt = &slice_mt;
+static const void* slice_threshold = &slice_threshold;
+
+// 创建切片，owner位置的值是源数据，可以是字符串，userdata或者另一个切片
+static void slice_new(lua_State* L, const char* s, size_t n, int owner)
+{
+    owner = lua_absindex(L, owner);
+    struct tars_slice* slice = (struct tars_slice*)lua_newuserdata(L, sizeof(struct tars_slice));
+    slice->s = s, slice->n = n;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, slice_mt), lua_setmetatable(L, -2);
+    lua_pushvalue(L, owner), lua_setuservalue(L, -2);
+}
+
+// idx位置是切片时返回内容，否则返回NULL
+static const char* test_slice(lua_State* L, int idx, size_t* n)
+{
+    if (LUA_TUSERDATA != lua_type(L, idx) || !lua_getmetatable(L, idx)) {
+        return NULL;
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, slice_mt);
+    bool valid = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (!valid) {
+        return NULL;
+    }
+    struct tars_slice* slice = (struct tars_slice*)lua_touserdata(L, idx);
+    *n = slice->n;
+    return slice->s;
+}
+
 static inline void write_header(  // 写入头部
     struct write_buffer* B,
     uint8_t tag,
@@ -238,6 +565,55 @@ static inline void write_int64(  // 写入长整形
     }
 }
 
+static inline void write_string_header(  // 写入字符串的头部和长度
+    struct write_buffer* B,
+    uint8_t tag,
+    size_t sz)
+{
+    if (sz > 255) {
+        // 写入整形长度
+        write_header(B, tag, TarsHeadeString4);
+        uint32_t sz1 = htobe32(sz);
+        wb_addlstr(B, (const char*)&sz1, sizeof sz1);
+    }
+    else {
+        // 写入字节长度
+        write_header(B, tag, TarsHeadeString1);
+        wb_addchar(B, (uint8_t)sz);
+    }
+}
+
+static inline void write_string(  // 写入字符串，长度由调用者检查
+    struct write_buffer* B,
+    uint8_t tag,
+    const char* s,
+    size_t sz)
+{
+    write_string_header(B, tag, sz);
+    wb_addlstr(B, s, sz);
+}
+
+// 写入字节数组的头部，长度固定4个字节先占位，返回长度所在的位置
+static inline size_t write_simple_list_begin(struct write_buffer* B, uint8_t tag)
+{
+    write_header(B, tag, TarsHeadeSimpleList);
+    write_header(B, 0, TarsHeadeChar);
+    write_header(B, 0, TarsHeadeInt32);
+    size_t pos = B->n;
+    wb_addlstr(B, "\0\0\0\0", sizeof(uint32_t));
+    return pos;
+}
+
+// 字节数组的内容写完之后回填长度
+static inline void write_simple_list_end(lua_State* L, struct write_buffer* B, size_t pos)
+{
+    size_t n = B->n - pos - sizeof(uint32_t);
+    if (n > _MAX_STR_LEN) {
+        luaL_error(L, "byte list too large, sz:%d", (int)n);
+    }
+    wb_patch_be32(B, pos, n);
+}
+
 static int write_basic(  // 写入基础类型
     lua_State* L,
     struct write_buffer* B,
@@ -407,30 +783,20 @@ static int write_basic(  // 写入基础类型
                     lua_pushlstring(L, "", 0);
                 }
                 else {
-                    lua_rawgeti(L, 4, def.integer);
+                    lua_geti(L, 4, def.integer);
                 }
             }
             s = lua_tolstring(L, -1, &sz);
             if (NULL == s) {
-                luaL_error(L, "invalid string, tag: %d, type:%s", tag, lua_typename(L, ltype));
+                s = test_slice(L, -1, &sz);
             }
-            // 先写入长度
-            if (sz > 255) {
-                if (sz > _MAX_STR_LEN) {
-                    luaL_error(L, "string size too large, tag:%d, sz:%d", tag, sz);
-                }
-                // 写入整形长度
-                write_header(B, tag, TarsHeadeString4);
-                uint32_t sz1 = htobe32(sz);
-                wb_addlstr(B, (const char*)&sz1, sizeof sz1);
+            if (NULL == s) {
+                luaL_error(L, "invalid string, tag: %d, type:%s", tag, lua_typename(L, ltype));
             }
-            else {
-                // 写入字节长度
-                write_header(B, tag, TarsHeadeString1);
-                wb_addchar(B, (uint8_t)sz);
+            if (sz > _MAX_STR_LEN) {
+                luaL_error(L, "string size too large, tag:%d, sz:%d", tag, sz);
             }
-            // 再写入字符串
-            wb_addlstr(B, s, sz);
+            write_string(B, tag, s, sz);
         } break;
         default: {
             luaL_error(L, "type not support: %d, tag: %d", type, tag);
@@ -476,6 +842,61 @@ static int encodeList(  // 编码数组
     bool forced,
     bool noWrap);
 
+static int encodeSimpleList(  // 编码字节数组
+    lua_State* L,
+    struct write_buffer* B,
+    uint8_t tag,
+    bool forced,
+    bool noWrap);
+
+static int encodeField(  // 编码一个字段
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    struct tars_field* field);
+
+// 创建上下文的内存块并放到栈顶
+static struct tars_context* context_new(lua_State* L, size_t n, size_t nstruct)
+{
+    size_t sz = context_size(n, nstruct);
+    struct tars_context* context = (struct tars_context*)lua_newuserdata(L, sz);
+    // 内存块置零处理
+    memset(context, 0, sz);
+    // 总共的字段数量
+    context->n = n;
+    context->nstruct = nstruct;
+    return context;
+}
+
+// 把下标i的字段加入结构体描述，first表示是新结构体的第一个字段，返回字段所属的结构体
+static struct tars_struct* context_link(
+    lua_State* L, struct tars_context* context, struct tars_struct* st, size_t i, bool first)
+{
+    struct tars_struct* structs = context_structs(context);
+    struct tars_field* field = &context->fields[i];
+    if (first) {
+        st = (NULL == st) ? structs : st + 1;
+        st->first = i;
+        st->sorted = true;
+        memset(st->index, STRUCT_NO_FIELD, sizeof(st->index));
+    }
+    else if (NULL == st) {
+        luaL_error(L, "field #[%d] does not belong to any struct", (int)i + 1);
+    }
+    else if (st->sorted && field[-1].tag >= field->tag) {
+        st->sorted = false;
+    }
+    if (STRUCT_NO_FIELD != st->index[field->tag]) {
+        luaL_error(L, "duplicate tag %d at #[%d]", field->tag, (int)i + 1);
+    }
+    if (st->n >= STRUCT_NO_FIELD) {
+        luaL_error(L, "too many fields in struct at #[%d]", (int)i + 1);
+    }
+    st->index[field->tag] = st->n++;
+    context_owners(context)[i] = st - structs;
+    return st;
+}
+
 // 创建上下文
 int luatars_createContext(lua_State* L)
 {
@@ -484,21 +905,31 @@ int luatars_createContext(lua_State* L)
     lua_settop(L, 2);
 
     size_t n = lua_rawlen(L, 1);
-    size_t sz = sizeof(struct tars_context) + n * sizeof(struct tars_field);
-    struct tars_context* context = (struct tars_context*)lua_newuserdata(L, sz);
+    // 先统计结构体的数量，first字段标记了结构体的第一个字段，缺省时按序号0判断
+    size_t nstruct = 0;
+    for (size_t i = 1; i <= n; ++i) {
+        if (LUA_TTABLE != lua_rawgeti(L, 1, i)) {
+            luaL_error(L, "invalid field element at #[%d]", i);
+        }
+        if (LUA_TNIL != lua_getfield(L, -1, "first")) {
+            nstruct += lua_toboolean(L, -1) ? 1 : 0;
+        }
+        else {
+            lua_getfield(L, -2, "tag");
+            nstruct += 0 == lua_tointeger(L, -1) ? 1 : 0;
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+    }
+    struct tars_context* context = context_new(L, n, nstruct);
     lua_pushvalue(L, 2), lua_setmetatable(L, 3);
+    mark_object_mt(L, 2);
 
-    // 内存块置零处理
-    memset(context, 0, sz);
-    // 总共的字段数量
-    context->n = n;
+    struct tars_struct* st = NULL;
     for (size_t i = 0; i < context->n;) {
         struct tars_field* field = &context->fields[i];
         i += 1;
-        int t = lua_rawgeti(L, 1, i);
-        if (LUA_TTABLE != t) {
-            luaL_error(L, "invalid field element at #[%d]", i);
-        }
+        lua_rawgeti(L, 1, i);
         // 序号
         lua_getfield(L, -1, "tag"), field->tag = lua_tointeger(L, -1), lua_pop(L, 1);
         // 是否必须写入
@@ -509,11 +940,17 @@ int luatars_createContext(lua_State* L)
         lua_getfield(L, -1, "type2"), field->type2 = lua_tointeger(L, -1), lua_pop(L, 1);
         // 补充类型3
         lua_getfield(L, -1, "type3"), field->type3 = lua_tointeger(L, -1), lua_pop(L, 1);
+        // 是否结构体的第一个字段
+        bool first = 0 == field->tag;
+        if (LUA_TNIL != lua_getfield(L, -1, "first")) {
+            first = lua_toboolean(L, -1);
+        }
+        lua_pop(L, 1);
 
         field->def.integer = 0;
 
         // 参数校验在lua层做
-        t = lua_getfield(L, -1, "default");
+        int t = lua_getfield(L, -1, "default");
         if (field->type1 <= LUATARS_INT64) {
             field->def.integer = lua_tointeger(L, -1);
         }
@@ -529,6 +966,9 @@ int luatars_createContext(lua_State* L)
             }
         }
 
+        // 建立结构体的描述
+        st = context_link(L, context, st, i - 1, first);
+
         // VERB("[%d]:%s %d %d %d\n", field->tag, field->forced ? "required" : "optional", field->type1, field->type2,
         //        field->type3);
 
@@ -546,6 +986,28 @@ int encodeBasic(  // 编码基础类型
     return write_basic(L, B, field->tag, field->type1, field->forced, field->def);
 }
 
+int encodeField(  // 编码一个字段，使用栈顶的元素，按字段类型分派
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    struct tars_field* field)
+{
+    if (LUATARS_MAP == field->type1) {
+        // 写入字典
+        return encodeMap(context, L, B, field->type2, field->type3, field->tag, field->forced, false);
+    }
+    else if (LUATARS_LIST == field->type1) {
+        // 写入数组
+        return encodeList(context, L, B, field->type2, field->tag, field->forced, false);
+    }
+    else if (LUATARS_TYPE_MAX > field->type1) {
+        // 写入基础类型
+        return encodeBasic(context, L, B, field);
+    }
+    // 写入结构体
+    return encodeStruct(context, L, B, field->type1, field->tag, field->forced, false);
+}
+
 int encodeStruct(  // 编码结构体函数实现，使用栈顶的元素
     struct tars_context* context,
     lua_State* L,
@@ -570,53 +1032,32 @@ int encodeStruct(  // 编码结构体函数实现，使用栈顶的元素
     else if (LUA_TTABLE != ltype) {
         luaL_error(L, "%s require a table, got '%s'", __FUNCTION__, lua_typename(L, ltype));
     }
-    // 开始的字段
-    struct tars_field* field = context->fields + (size_t)(id - LUATARS_TYPE_MAX);
-    if (field > context->fields + context->n) {
-        luaL_error(L, "invalid struct for %s, id = %d", __FUNCTION__, id);
-    }
-    // 字段需要从0号开始
-    if (field->tag != 0) {
-        luaL_error(L, "invalid start field for %s, require 0, got %d", __FUNCTION__, field->tag);
-    }
+    struct tars_struct* st = check_struct(L, context, id);
     if (!noWrap) {
         // 写入结构体开始
         write_header(B, tag, TarsHeadeStructBegin);
     }
-    // 编码每一个字段
-    for (;;) {
+    // 按序号升序编码每一个字段
+    for (uint32_t i = 0, t = 0; i < st->n; ++i) {
+        uint32_t index = i;
+        if (!st->sorted) {
+            while (STRUCT_NO_FIELD == st->index[t]) {
+                ++t;
+            }
+            index = st->index[t++];
+        }
+        struct tars_field* field = context->fields + st->first + index;
         // 先从元表里面拿到字段的名称
-        int t1 = lua_rawgeti(L, 4, (field - context->fields));
+        int t1 = lua_geti(L, 4, (field - context->fields));
         if (LUA_TSTRING != t1) {
             luaL_error(L, "field name not found for index = %d", field - context->fields);
         }
         // 再用表名称从之前栈顶的表中查询成员
         VERB("写入字段tag = %d, name = %s, index = %d\n", field->tag, lua_tostring(L, -1), (int)(field - context->fields));
         lua_rawget(L, -2);
-        if (LUATARS_MAP == field->type1) {
-            // 写入字典
-            encodeMap(context, L, B, field->type2, field->type3, field->tag, field->forced, false);
-        }
-        else if (LUATARS_LIST == field->type1) {
-            // 写入数组
-            encodeList(context, L, B, field->type2, field->tag, field->forced, false);
-        }
-        else if (LUATARS_TYPE_MAX > field->type1) {
-            // 写入基础类型
-            encodeBasic(context, L, B, field);
-        }
-        else {
-            // 写入结构体
-            encodeStruct(context, L, B, field->type1, field->tag, field->forced, false);
-        }
+        encodeField(context, L, B, field);
         VERB("写入字段%d, %s, (%d/%d)\n", field->tag, lua_tostring(L, -1), B->n, B->size);
         lua_pop(L, 1);
-        // 切换到下一个字段
-        ++field;
-        if ((size_t)(field - context->fields) >= context->n || field->tag == 0) {
-            // 读取到字段结束，或者读取到了下一个结构体的开始
-            break;
-        }
     }
     // 写入结构体结束
     if (!noWrap) {
@@ -700,6 +1141,10 @@ int encodeList(  // 编码数组
     bool forced,
     bool noWrap)
 {
+    if (LUATARS_INT8 == value_type) {
+        // vector<byte> 写入SimpleList
+        return encodeSimpleList(L, B, tag, forced, noWrap);
+    }
     // 是否需要强制写入
     int ltype = lua_type(L, -1);
     if (LUA_TNIL == ltype) {
@@ -718,7 +1163,6 @@ int encodeList(  // 编码数组
         return 0;
     }
     if (!noWrap) {
-        // TODO: vector<char> 写入SimpleList
         write_header(B, tag, TarsHeadeList);
     }
     write_int32(B, 0, n);  // 写入长度
@@ -736,12 +1180,68 @@ int encodeList(  // 编码数组
     return 1;
 }
 
+int encodeSimpleList(  // 编码字节数组，lua层使用字符串，也兼容整数数组
+    lua_State* L,
+    struct write_buffer* B,
+    uint8_t tag,
+    bool forced,
+    bool noWrap)
+{
+    int ltype = lua_type(L, -1);
+    size_t n = 0;
+    const char* s = NULL;
+    if (LUA_TNIL == ltype) {
+        if (!forced) {
+            return 0;
+        }
+    }
+    else if (LUA_TSTRING == ltype) {
+        s = lua_tolstring(L, -1, &n);
+    }
+    else if (LUA_TTABLE == ltype) {
+        n = lua_rawlen(L, -1);
+    }
+    else if (NULL == (s = test_slice(L, -1, &n))) {
+        luaL_error(L, "%s require a string, got '%s'", __FUNCTION__, lua_typename(L, ltype));
+    }
+    if (n < 1 && !forced) {
+        return 0;
+    }
+    if (n > _MAX_STR_LEN) {
+        luaL_error(L, "byte list too large, tag:%d, sz:%d", tag, (int)n);
+    }
+    if (!noWrap) {
+        write_header(B, tag, TarsHeadeSimpleList);
+    }
+    write_header(B, 0, TarsHeadeChar);  // 元素类型
+    write_int32(B, 0, n);               // 写入长度
+    if (NULL != s) {
+        wb_addlstr(B, s, n);
+        return 1;
+    }
+    for (size_t i = 0; i < n;) {
+        ++i;
+        lua_rawgeti(L, -1, i);
+        int isnum = 0;
+        lua_Integer v = lua_tointegerx(L, -1, &isnum);
+        if (!isnum) {
+            luaL_error(L, "tag %d byte list requrie a number, got '%s'", tag, luaL_typename(L, -1));
+        }
+        if (v < INT8_MIN || v > UINT8_MAX) {
+            luaL_error(L, "tag %d byte overflow, got '%d'", tag, (int)v);
+        }
+        wb_addchar(B, (char)v);
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
 // 将lua的表当作对象，编码成二进制流
 // 用法：context:encodeStruct("TDemoDb", {sName = "value", iId = 1234})
 static int luatars_encodeStruct(lua_State* L)
 {
     luaL_checktype(L, 1, LUA_TUSERDATA);
-    struct tars_context* context = (struct tars_context*)lua_touserdata(L, 1);
+    struct tars_context* context = check_context(L, 1);
     int id = luaL_checkinteger(L, 2);  // 结构体id
     luaL_checktype(L, 3, LUA_TTABLE);  // 对象本身
     lua_settop(L, 3);
@@ -757,16 +1257,209 @@ static int luatars_encodeStruct(lua_State* L)
     return 1;
 }
 
-// 将lua表当作字典，编码成二进制流
-// 用法：
-//  1. context:encodeMap(tars.STRING, tars.STRING, {["hello"] = "world"}, 0)
-//  2. 用法：context:encodeMap(tars.STRING, tars.STRING, {["hello"] = "world"})
-static int luatars_encodeMap(lua_State* L)
+// tars标准的请求包和响应包，字段固定，不需要通过IDL声明
+struct envelope_field {
+    const char* name;
+    struct tars_field field;  // 序号，是否强制写入，类型
+};
+
+// RequestPacket
+static const struct envelope_field request_fields[] = {
+    {"iVersion", {1, true, LUATARS_INT16}},
+    {"cPacketType", {2, true, LUATARS_INT8}},
+    {"iMessageType", {3, true, LUATARS_INT32}},
+    {"iRequestId", {4, true, LUATARS_INT32}},
+    {"sServantName", {5, true, LUATARS_STRING}},
+    {"sFuncName", {6, true, LUATARS_STRING}},
+    {"sBuffer", {7, true, LUATARS_LIST, LUATARS_INT8}},
+    {"iTimeout", {8, true, LUATARS_INT32}},
+    {"context", {9, true, LUATARS_MAP, LUATARS_STRING, LUATARS_STRING}},
+    {"status", {10, true, LUATARS_MAP, LUATARS_STRING, LUATARS_STRING}},
+    {NULL},
+};
+
+// ResponsePacket，最后两个字段是可选的
+static const struct envelope_field response_fields[] = {
+    {"iVersion", {1, true, LUATARS_INT16}},
+    {"cPacketType", {2, true, LUATARS_INT8}},
+    {"iRequestId", {3, true, LUATARS_INT32}},
+    {"iMessageType", {4, true, LUATARS_INT32}},
+    {"iRet", {5, true, LUATARS_INT32}},
+    {"sBuffer", {6, true, LUATARS_LIST, LUATARS_INT8}},
+    {"status", {7, true, LUATARS_MAP, LUATARS_STRING, LUATARS_STRING}},
+    {"sResultDesc", {8, false, LUATARS_STRING}},
+    {"context", {9, false, LUATARS_MAP, LUATARS_STRING, LUATARS_STRING}},
+    {NULL},
+};
+
+// 编码请求包或响应包，2号位置是包头，4号位置是元表，5号位置是包体
+// 包体直接编码到sBuffer的位置，长度先占位，编码完成后回填，没有中间字符串
+static void encodeEnvelope(struct tars_context* context,
+                           lua_State* L,
+                           struct write_buffer* B,
+                           const struct envelope_field* fields,
+                           int body_id)
 {
-    luaL_checktype(L, 1, LUA_TUSERDATA);
-    struct tars_context* context = (struct tars_context*)lua_touserdata(L, 1);
-    int key_type = luaL_checkinteger(L, 2);
-    int value_type = luaL_checkinteger(L, 3);
+    for (const struct envelope_field* f = fields; f->name; ++f) {
+        const struct tars_field* field = &f->field;
+        lua_getfield(L, 2, f->name);
+        if (LUATARS_LIST == field->type1) {
+            if (body_id < 0) {
+                encodeSimpleList(L, B, field->tag, true, false);
+            }
+            else {
+                size_t pos = write_simple_list_begin(B, field->tag);
+                lua_pushvalue(L, 5);
+                encodeStruct(context, L, B, body_id, 0, true, true);
+                lua_pop(L, 1);
+                write_simple_list_end(L, B, pos);
+            }
+        }
+        else if (LUATARS_MAP == field->type1) {
+            encodeMap(context, L, B, field->type2, field->type3, field->tag, field->forced, false);
+        }
+        else {
+            write_basic(L, B, field->tag, field->type1, field->forced, def_zero);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+static int encodeEnvelopeL(lua_State* L, const struct envelope_field* fields)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);  // 包头
+    int body_id = luaL_optinteger(L, 3, -1);
+    bool framed = lua_toboolean(L, 5);
+    if (body_id >= 0) {
+        check_struct(L, context, body_id);
+        luaL_checktype(L, 4, LUA_TTABLE);
+    }
+    lua_settop(L, 4);
+    lua_getmetatable(L, 1);
+    lua_insert(L, 4);  // 4号位置是元表，包体放在5号位置
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    if (framed) {
+        wb_addlstr(&B, "\0\0\0\0", sizeof(uint32_t));
+    }
+    encodeEnvelope(context, L, &B, fields, body_id);
+    if (framed) {
+        if (B.n > _MAX_STR_LEN) {
+            luaL_error(L, "frame too large, sz:%d", (int)B.n);
+        }
+        wb_patch_be32(&B, 0, B.n);
+    }
+    wb_pushresult(&B, L);
+    return 1;
+}
+
+// 编码请求包，包体不为空时直接编码到sBuffer，否则使用包头的sBuffer字符串
+// framed为true时加上4字节的长度前缀
+// 用法：tars.encodeRequest(context, {iRequestId = 1, sServantName = "a.b.c", sFuncName = "f"}, id, body, framed)
+static int luatars_encodeRequest(lua_State* L)
+{
+    return encodeEnvelopeL(L, request_fields);
+}
+
+// 编码响应包，参数同encodeRequest
+static int luatars_encodeResponse(lua_State* L)
+{
+    return encodeEnvelopeL(L, response_fields);
+}
+
+// TUP协议中基础类型的名称
+static const char* tup_type_names[LUATARS_TYPE_MAX] = {
+    [LUATARS_BOOL] = "bool",     [LUATARS_INT8] = "char",     [LUATARS_UINT8] = "short",
+    [LUATARS_INT16] = "short",   [LUATARS_UINT16] = "int32",  [LUATARS_INT32] = "int32",
+    [LUATARS_UINT32] = "int64",  [LUATARS_INT64] = "int64",   [LUATARS_FLOAT] = "float",
+    [LUATARS_DOUBLE] = "double", [LUATARS_STRING] = "string",
+};
+
+// 解析属性的类型，结构体使用名称，基础类型使用枚举值，需要4号位置是元表
+// 返回类型id，TUP协议的类型名称放在name
+static uint32_t attr_type(lua_State* L, struct tars_context* context, int idx, const char** name, size_t* len)
+{
+    if (LUA_TSTRING == lua_type(L, idx)) {
+        *name = lua_tolstring(L, idx, len);
+        lua_pushvalue(L, idx);
+        lua_gettable(L, 4);
+        uint32_t id = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        check_struct(L, context, id);
+        return id;
+    }
+    uint32_t type = luaL_checkinteger(L, idx);
+    if (type >= LUATARS_TYPE_MAX || NULL == tup_type_names[type]) {
+        luaL_error(L, "[C] %s %d: attribute support basic type or struct only, got %d", __FUNCTION__, __LINE__,
+                   (int)type);
+    }
+    *name = tup_type_names[type];
+    *len = strlen(*name);
+    return type;
+}
+
+// 编码TUP协议的UniAttribute，即map<string, map<string, vector<byte>>>
+// 属性值直接编码到字节数组的位置，长度先占位再回填，不产生中间的表和字符串
+// 每个属性是{名称, 类型, 值, [类型名称]}，类型是结构体名称或者基础类型的枚举值
+// 用法：context:encodeAttr({{"req", "TBook", {iId = 1}}, {"ret", tars.INT32, 0}})
+static int luatars_encodeAttr(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);  // 4号位置是元表
+
+    size_t n = lua_rawlen(L, 2);
+    struct write_buffer B;
+    wb_init(&B, L);
+    write_header(&B, 0, TarsHeadeMap);
+    write_int32(&B, 0, n);
+    for (size_t i = 1; i <= n; ++i) {
+        if (LUA_TTABLE != lua_rawgeti(L, 2, i)) {  // 5号位置是属性
+            luaL_error(L, "[C] %s %d: attribute %d require a table", __FUNCTION__, __LINE__, (int)i);
+        }
+        lua_rawgeti(L, 5, 1);
+        write_basic(L, &B, 0, LUATARS_STRING, true, def_zero);  // 属性名称
+        lua_pop(L, 1);
+        lua_rawgeti(L, 5, 2);  // 6号位置是类型
+        const char* name = NULL;
+        size_t len = 0;
+        uint32_t type = attr_type(L, context, 6, &name, &len);
+        if (LUA_TSTRING == lua_rawgeti(L, 5, 4)) {
+            name = lua_tolstring(L, -1, &len);  // 指定的类型名称，例如带模块名的结构体
+        }
+        write_header(&B, 1, TarsHeadeMap);
+        write_int32(&B, 0, 1);
+        write_string(&B, 0, name, len);
+        size_t pos = write_simple_list_begin(&B, 1);
+        lua_rawgeti(L, 5, 3);
+        if (type < LUATARS_TYPE_MAX) {
+            write_basic(L, &B, 0, type, true, def_zero);
+        }
+        else {
+            encodeStruct(context, L, &B, type, 0, true, false);
+        }
+        write_simple_list_end(L, &B, pos);
+        lua_settop(L, 4);
+    }
+    wb_pushresult(&B, L);
+    return 1;
+}
+
+// 将lua表当作字典，编码成二进制流
+// 用法：
+//  1. context:encodeMap(tars.STRING, tars.STRING, {["hello"] = "world"}, 0)
+//  2. 用法：context:encodeMap(tars.STRING, tars.STRING, {["hello"] = "world"})
+static int luatars_encodeMap(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    int key_type = luaL_checkinteger(L, 2);
+    int value_type = luaL_checkinteger(L, 3);
     luaL_checktype(L, 4, LUA_TTABLE);  // 对象本身
     int tag = luaL_optinteger(L, 5, 0);
     lua_settop(L, 4);
@@ -787,9 +1480,11 @@ static int luatars_encodeMap(lua_State* L)
 static int luatars_encodeList(lua_State* L)
 {
     luaL_checktype(L, 1, LUA_TUSERDATA);
-    struct tars_context* context = (struct tars_context*)lua_touserdata(L, 1);
+    struct tars_context* context = check_context(L, 1);
     int value_type = luaL_checkinteger(L, 2);
-    luaL_checktype(L, 3, LUA_TTABLE);
+    if (LUATARS_INT8 != value_type || LUA_TSTRING != lua_type(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);  // 字节数组可以直接使用字符串
+    }
     int tag = luaL_optinteger(L, 4, 0);
     lua_settop(L, 3);
     lua_getmetatable(L, 1);  // 4号位置用来放元表
@@ -803,13 +1498,103 @@ static int luatars_encodeList(lua_State* L)
     return 1;
 }
 
+// 批量编码结构体，整批共用一个写缓存
+// separate为真时返回字符串数组；否则每个结构体用结构体开始和结束包裹后拼接，
+// 返回拼接的数据和每个结构体的起始位置(从1开始，最后多一个结束位置)
+// 用法：local data, offsets = context:encodeMany("TBook", {{iId = 1}, {iId = 2}})
+static int luatars_encodeMany(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    int id = luaL_checkinteger(L, 2);  // 结构体id
+    luaL_checktype(L, 3, LUA_TTABLE);  // 对象数组
+    bool separate = lua_toboolean(L, 4);
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);            // 拿到元表
+    luaL_checktype(L, 4, LUA_TTABLE);  // 元表在4号位置
+    check_struct(L, context, id);
+
+    size_t n = lua_rawlen(L, 3);
+    lua_createtable(L, n + 1, 0);  // 5号位置是结果数组或者起始位置数组
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    for (size_t i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 3, i);  // 栈顶是要编码的对象
+        if (separate) {
+            B.n = 0;
+            encodeStruct(context, L, &B, id, 0, true, true);
+            lua_pop(L, 1);
+            wb_pushresult(&B, L);
+            lua_rawseti(L, 5, i);
+        }
+        else {
+            lua_pushinteger(L, B.n + 1);
+            lua_rawseti(L, 5, i);
+            encodeStruct(context, L, &B, id, 0, true, false);
+            lua_pop(L, 1);
+        }
+    }
+    if (separate) {
+        return 1;
+    }
+    lua_pushinteger(L, B.n + 1);
+    lua_rawseti(L, 5, n + 1);
+    wb_pushresult(&B, L);
+    lua_insert(L, 5);
+    return 2;
+}
+
+// 编码缓存的统计信息
+// 用法：tars.arenaStats() => {capacity = 0, grows = 0, peak = 0, uses = 0}
+static int luatars_arenaStats(lua_State* L)
+{
+    struct wb_arena* A = wb_arena(L);
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, A->cap), lua_setfield(L, -2, "capacity");
+    lua_pushinteger(L, A->grows), lua_setfield(L, -2, "grows");
+    lua_pushinteger(L, A->peak), lua_setfield(L, -2, "peak");
+    lua_pushinteger(L, A->uses), lua_setfield(L, -2, "uses");
+    return 1;
+}
+
+// 释放编码缓存占用的内存，统计信息保留，编码过程中(例如在__gc里)调用时不释放，返回false
+// 用法：tars.arenaRelease()
+static int luatars_arenaRelease(lua_State* L)
+{
+    struct wb_arena* A = wb_arena(L);
+    if (A->busy) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    free(A->s);
+    A->s = NULL, A->cap = 0;
+    lua_pushboolean(L, true);
+    return 1;
+}
+
 // 读缓存
 struct read_buffer {
     size_t offset;
     size_t n;
     const char* data;
+    size_t slice;  // 不短于这个长度的字符串解码成切片，0表示不使用切片
+    int owner;     // 切片引用的源数据在栈上的位置
 };
 
+// 按虚拟机的切片阈值设置读缓存，owner是源数据在栈上的位置
+// 只有字符串和userdata能被切片引用，轻量userdata和内部的缓存传0，总是复制
+static void slice_source(lua_State* L, struct read_buffer* buffer, int owner)
+{
+    buffer->slice = 0, buffer->owner = owner;
+    int t = owner > 0 ? lua_type(L, owner) : LUA_TNONE;
+    if (LUA_TSTRING == t || LUA_TUSERDATA == t) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, slice_threshold);
+        buffer->slice = (size_t)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+}
+
 static void dump_buffer(struct read_buffer* buffer, const char* filename)
 {
     (void)dump_buffer;
@@ -872,19 +1657,28 @@ static inline int read_header(struct read_buffer* buffer, struct tars_header* he
     }
 }
 
+// 字段投影的标记
+#define PROJ_SKIP 0  // 跳过
+#define PROJ_ALL 1   // 完整解码
+#define PROJ_PART 2  // 只解码子字段中被投影的部分
+
 static int decodeStruct(  // 解码结构体
     struct tars_context* context,
     lua_State* L,
     struct read_buffer* buffer,
     uint32_t id,
-    bool missing);
+    bool missing,
+    const uint8_t* proj,
+    bool reuse);
 
 static int decodeList(  // 解码数组
     struct tars_context* context,
     lua_State* L,
     struct read_buffer* buffer,
     uint32_t value_type,
-    bool missing);
+    bool missing,
+    const uint8_t* proj,
+    bool reuse);
 
 static int decodeMap(  // 解码字典
     struct tars_context* context,
@@ -892,6 +1686,14 @@ static int decodeMap(  // 解码字典
     struct read_buffer* buffer,
     uint32_t key_type,
     uint32_t value_type,
+    bool missing,
+    const uint8_t* proj,
+    bool reuse);
+
+static int decodeSimpleList(  // 解码字节数组
+    lua_State* L,
+    struct read_buffer* buffer,
+    uint8_t head_type,
     bool missing);
 
 static bool readHeader(  // 读取字段头部，返回是否缺失字段
@@ -985,6 +1787,41 @@ static int64_t read_int64(  // 通用的读取整数值
     }
 }
 
+static const char* read_lstring(  // 读取字符串的位置和长度，不创建lua字符串
+    lua_State* L,
+    struct read_buffer* buffer,
+    struct tars_header header,
+    size_t* len)
+{
+    size_t sz = 0;
+    if (TarsHeadeString4 == header.type) {
+        if (!has_size(buffer, sizeof(uint32_t))) {
+            luaL_error(L, "[C] %s %d: truncated buffer", __FUNCTION__, __LINE__);
+        }
+        uint32_t sz4;
+        memcpy(&sz4, read_buffer(buffer, 0), sizeof sz4);
+        sz = be32toh(sz4);
+        skip_buffer(buffer, sizeof(uint32_t));
+    }
+    else if (TarsHeadeString1 == header.type) {
+        if (!has_size(buffer, sizeof(uint8_t))) {
+            luaL_error(L, "[C] %s %d: no buffer", __FUNCTION__, __LINE__);
+        }
+        sz = *(const uint8_t*)read_buffer(buffer, 0);
+        skip_buffer(buffer, sizeof(uint8_t));
+    }
+    else {
+        luaL_error(L, "invalid string type, got %d, tag = %d", header.type, header.tag);
+    }
+    if (!has_size(buffer, sz)) {
+        luaL_error(L, "[C] %s %d: no buffer, need %d", __FUNCTION__, __LINE__, (int)sz);
+    }
+    const char* s = read_buffer(buffer, 0);
+    skip_buffer(buffer, sz);
+    *len = sz;
+    return s;
+}
+
 static int read_basic(  // 读取基础类型
     lua_State* L,
     struct read_buffer* buffer,
@@ -1057,36 +1894,18 @@ static int read_basic(  // 读取基础类型
                     lua_pushlstring(L, "", 0);
                 }
                 else {
-                    lua_rawgeti(L, 4, def.integer);
+                    lua_geti(L, 4, def.integer);
                 }
             }
-            else if (TarsHeadeString4 == header.type) {
-                if (!has_size(buffer, sizeof(uint32_t))) {
-                    luaL_error(L, "[C] %s %d: truncated buffer", __FUNCTION__, __LINE__);
-                }
-                uint32_t sz = *(const uint32_t*)read_buffer(buffer, 0);
-                sz = be32toh(sz);
-                skip_buffer(buffer, sizeof(uint32_t));
-                if (!has_size(buffer, sz)) {
-                    luaL_error(L, "[C] %s %d: no buffer, need %d", __FUNCTION__, __LINE__, sz);
-                }
-                lua_pushlstring(L, read_buffer(buffer, 0), sz);
-                skip_buffer(buffer, sz);
-            }
-            else if (TarsHeadeString1 == header.type) {
-                if (!has_size(buffer, sizeof(uint8_t))) {
-                    luaL_error(L, "[C] %s %d: no buffer", __FUNCTION__, __LINE__);
+            else {
+                size_t sz = 0;
+                const char* s = read_lstring(L, buffer, header, &sz);
+                if (buffer->slice > 0 && sz >= buffer->slice) {
+                    slice_new(L, s, sz, buffer->owner);
                 }
-                uint8_t sz = *(const uint8_t*)read_buffer(buffer, 0);
-                skip_buffer(buffer, sizeof(uint8_t));
-                if (!has_size(buffer, sz)) {
-                    luaL_error(L, "truncated buffer, need %d", sz);
+                else {
+                    lua_pushlstring(L, s, sz);
                 }
-                lua_pushlstring(L, read_buffer(buffer, 0), sz);
-                skip_buffer(buffer, sz);
-            }
-            else {
-                luaL_error(L, "invalid string type, got %d, tag = %d", header.type, header.tag);
             }
         } break;
     }
@@ -1098,80 +1917,145 @@ static int skipField(  // 跳过若干字段
     struct read_buffer* buffer,
     uint16_t n);
 
-int decodeStruct(  // 解码结构体
+static int skipValue(  // 跳过一个值
+    lua_State* L,
+    struct read_buffer* buffer,
+    struct tars_header header);
+
+static int decodeField(  // 解码一个字段
+    struct tars_context* context,
+    lua_State* L,
+    struct read_buffer* buffer,
+    const struct tars_field* field,
+    struct tars_header header,
+    bool field_missing,
+    const uint8_t* proj,
+    bool reuse);
+
+int decodeField(  // 解码一个字段，头部已经读取，结果放在栈顶
+    struct tars_context* context,
+    lua_State* L,
+    struct read_buffer* buffer,
+    const struct tars_field* field,
+    struct tars_header header,
+    bool field_missing,
+    const uint8_t* proj,
+    bool reuse)
+{
+    if (reuse && (field->type1 <= LUATARS_STRING || (LUATARS_LIST == field->type1 && LUATARS_INT8 == field->type2))) {
+        // 基础类型和字节数组是lua的值，没有可以复用的
+        lua_pop(L, 1);
+        reuse = false;
+    }
+    if (field->type1 <= LUATARS_STRING) {
+        // 解析基础类型字段
+        read_basic(L, buffer, field->type1, def_zero, header, field_missing);
+    }
+    else if (field->type1 == LUATARS_MAP) {
+        // 解析字段字段
+        if (!field_missing && TarsHeadeMap != header.type) {
+            luaL_error(L, "[C] %s %d: invalid field, require 'map', got '%s', tag = %d", __FUNCTION__, __LINE__,
+                       tars_type_name(header.type), field->tag);
+        }
+        decodeMap(context, L, buffer, field->type2, field->type3, field_missing, proj, reuse);
+    }
+    else if (field->type1 == LUATARS_LIST && field->type2 == LUATARS_INT8) {
+        // 解析字节数组字段，兼容按普通数组写入的数据
+        if (!field_missing && TarsHeadeSimpleList != header.type && TarsHeadeList != header.type) {
+            luaL_error(L, "[C] %s %d: invalid field, require 'simple list', got '%s', tag = %d", __FUNCTION__,
+                       __LINE__, tars_type_name(header.type), field->tag);
+        }
+        decodeSimpleList(L, buffer, header.type, field_missing);
+    }
+    else if (field->type1 == LUATARS_LIST) {
+        // 解析数组字段
+        if (!field_missing && TarsHeadeList != header.type) {
+            luaL_error(L, "[C] %s %d: invalid field, require 'list', got '%s', tag = %d", __FUNCTION__, __LINE__,
+                       tars_type_name(header.type), field->tag);
+        }
+        decodeList(context, L, buffer, field->type2, field_missing, proj, reuse);
+    }
+    else {
+        if (!field_missing && TarsHeadeStructBegin != header.type) {
+            luaL_error(L, "[C] %s %d: invalid field, require 'struct', got '%s', tag = %d", __FUNCTION__, __LINE__,
+                       tars_type_name(header.type), field->tag);
+        }
+        decodeStruct(context, L, buffer, field->type1, field_missing, proj, reuse);
+    }
+    return 1;
+}
+
+int decodeStruct(  // 解码结构体，按字段头部的序号分派，不要求序号升序
     struct tars_context* context,
     lua_State* L,
     struct read_buffer* buffer,
     uint32_t id,
-    bool missing)
+    bool missing,
+    const uint8_t* proj,
+    bool reuse)
 {
     VERB("解码结构体");
-    // 开始的字段
-    struct tars_field* field = context->fields + (size_t)(id - LUATARS_TYPE_MAX);
-    if (field > context->fields + context->n) {
-        luaL_error(L, "[C] %s %d: invalid struct, id = %d", __FUNCTION__, __LINE__, id);
+    struct tars_struct* st = check_struct(L, context, id);
+    struct tars_field* fields = context->fields + st->first;
+    // 已经读取到的字段
+    uint8_t seen[256 / 8];
+    memset(seen, 0, sizeof seen);
+    // 此处头部已经读取，读取到结构体结束或者数据结束，解码就结束
+    // reuse为真时栈顶是旧的值，是表就原地覆盖字段，嵌套的表也尽量复用
+    if (reuse && !lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        reuse = false;
     }
-    // 字段需要从0号开始
-    if (field->tag != 0) {
-        luaL_error(L, "[C] %s %d: invalid start field, require 0, got %d", __FUNCTION__, __LINE__, field->tag);
+    if (!reuse) {
+        lua_createtable(L, 0, st->n);
     }
-    // 此处头部已经读取，只要在读取字段的后读取到结构体结束，解码就结束
-    lua_newtable(L);
-    for (;;) {
+    for (struct tars_header header; !missing && !readHeader(L, buffer, &header, -1);) {
+        uint8_t index = st->index[header.tag];
+        // 不认识的字段：使用旧协议解析新协议结构
+        // 投影之外的字段只跳过，不放入结果
+        uint8_t mark = STRUCT_NO_FIELD == index ? PROJ_SKIP : (proj ? proj[st->first + index] : PROJ_ALL);
+        if (PROJ_SKIP == mark) {
+            skipValue(L, buffer, header);
+            continue;
+        }
         // 先查询名称
-        int t = lua_rawgeti(L, 4, (field - context->fields));
+        int t = lua_geti(L, 4, st->first + index);
         if (LUA_TSTRING != t) {
             luaL_error(L, "field name not found for id = %d", id);
         }
-        VERB("解析字段 %d %s\n", (int)(field - context->fields), lua_tostring(L, -1));
-        bool field_missing = missing;
-        // 先读取字段头部
-        struct tars_header header;
-        if (!field_missing) {
-            field_missing = readHeader(L, buffer, &header, field->tag);
-            if (field_missing && TarsHeadeStructEnd == header.type) {
-                missing = true;  // 读取到结构体结束了
-            }
-        }
-        if (field->type1 <= LUATARS_STRING) {
-            // 解析基础类型字段
-            read_basic(L, buffer, field->type1, def_zero, header, field_missing);
+        VERB("解析字段 %d %s\n", (int)(st->first + index), lua_tostring(L, -1));
+        if (reuse) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
         }
-        else if (field->type1 == LUATARS_MAP) {
-            // 解析字段字段
-            if (!field_missing && TarsHeadeMap != header.type) {
-                luaL_error(L, "[C] %s %d: invalid field, require 'map', got '%s', tag = %d", __FUNCTION__, __LINE__,
-                           tars_type_name(header.type), field->tag);
-            }
-            decodeMap(context, L, buffer, field->type2, field->type3, field_missing);
+        decodeField(context, L, buffer, fields + index, header, false, PROJ_PART == mark ? proj : NULL, reuse);
+        lua_rawset(L, -3);
+        seen[index >> 3] |= 1u << (index & 7);
+    }
+    // 缺失的字段使用默认值
+    struct tars_header none = {0, 0};
+    for (uint32_t index = 0; index < st->n; ++index) {
+        uint8_t mark = proj ? proj[st->first + index] : PROJ_ALL;
+        if (seen[index >> 3] & (1u << (index & 7))) {
+            continue;
         }
-        else if (field->type1 == LUATARS_LIST) {
-            // 解析数组字段
-            if (!field_missing && TarsHeadeList != header.type) {
-                luaL_error(L, "[C] %s %d: invalid field, require 'list', got '%s', tag = %d", __FUNCTION__, __LINE__,
-                           tars_type_name(header.type), field->tag);
+        if (PROJ_SKIP == mark) {
+            if (reuse) {
+                // 投影之外的旧值清掉
+                lua_geti(L, 4, st->first + index);
+                lua_pushnil(L);
+                lua_rawset(L, -3);
             }
-            decodeList(context, L, buffer, field->type2, field_missing);
+            continue;
         }
-        else {
-            if (!field_missing && TarsHeadeStructBegin != header.type) {
-                luaL_error(L, "[C] %s %d: invalid field, require 'struct', got '%s', tag = %d", __FUNCTION__, __LINE__,
-                           tars_type_name(header.type), field->tag);
-            }
-            decodeStruct(context, L, buffer, field->type1, field_missing);
+        lua_geti(L, 4, st->first + index);
+        if (reuse) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
         }
-        // VERB("解析字段%d '%s' = %s %s\n", (int)(field - context->fields), lua_tostring(L, -2), lua_tostring(L, -1),
-        //     lua_typename(L, lua_type(L, -1)));
+        decodeField(context, L, buffer, fields + index, none, true, PROJ_PART == mark ? proj : NULL, reuse);
         lua_rawset(L, -3);
-        ++field;
-        if ((size_t)(field - context->fields) >= context->n || field->tag == 0) {
-            // 结构体结束了
-            break;
-        }
     }
-    // 跳过结构体尾部多余的字段：使用旧协议解析新协议结构
-    skipField(L, buffer, 255);
-
     return 1;
 }
 
@@ -1180,12 +2064,12 @@ int decodeList(  // 解码数组
     lua_State* L,
     struct read_buffer* buffer,
     uint32_t value_type,
-    bool missing)
+    bool missing,
+    const uint8_t* proj,
+    bool reuse)
 {
     if (value_type >= LUATARS_TYPE_MAX) {
-        if ((value_type - LUATARS_TYPE_MAX) > context->n) {
-            luaL_error(L, "[C] %s %d: invalid struct, id = %d", __FUNCTION__, __LINE__, value_type);
-        }
+        check_struct(L, context, value_type);
     }
     int64_t len = 0;
     if (!missing) {
@@ -1197,7 +2081,17 @@ int decodeList(  // 解码数组
         len = read_int64(L, buffer, def_zero, header, false);
     }
     // VERB("读取数组，长度为%d\n", len);
-    lua_createtable(L, len, 0);
+    size_t old = 0;
+    if (reuse && lua_istable(L, -1)) {
+        old = lua_rawlen(L, -1);
+    }
+    else {
+        if (reuse) {
+            lua_pop(L, 1);
+            reuse = false;
+        }
+        lua_createtable(L, len, 0);
+    }
     lua_rawgetp(L, LUA_REGISTRYINDEX, list_mt), lua_setmetatable(L, -2);
     for (int i = 0; i < len;) {
         // 读取数组元素，先读取头部
@@ -1213,28 +2107,77 @@ int decodeList(  // 解码数组
                 luaL_error(L, "[C] %s %d: invalid list element, require 'struct', got '%s', index = %d", __FUNCTION__, __LINE__,
                            tars_type_name(header.type), i);
             }
-            decodeStruct(context, L, buffer, value_type, false);
+            if (reuse) {
+                lua_rawgeti(L, -1, i + 1);
+            }
+            decodeStruct(context, L, buffer, value_type, false, proj, reuse);
         }
         i += 1;
         // VERB("读取第%d个元素:%s, i = %d, n = %d\n", i, lua_tostring(L, -1), buffer->offset, buffer->n);
         lua_rawseti(L, -2, i);
     }
+    // 去掉旧数组多出来的尾部
+    for (size_t i = len + 1; i <= old; ++i) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i);
+    }
     return 0;
 }
 
+// 删除复用的字典里这次没有出现的键，栈顶是字典，start是第一个键的位置
+// 键的数量和这次的长度一样时不会有多余的键，只有键变化时才重新读一遍键
+static void map_remove_stale(lua_State* L, struct read_buffer* buffer, size_t start, int64_t len, uint32_t key_type)
+{
+    int64_t count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        ++count;
+    }
+    if (count == len) {
+        return;
+    }
+    struct read_buffer keys = *buffer;
+    keys.slice = 0;
+    keys.offset = start;
+    lua_createtable(L, 0, len);
+    for (int64_t i = 0; i < len; ++i) {
+        struct tars_header header;
+        readHeader(L, &keys, &header, 0);
+        read_basic(L, &keys, key_type, def_zero, header, false);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, -3);
+        readHeader(L, &keys, &header, 1);
+        skipValue(L, &keys, header);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, -3)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        if (LUA_TNIL == lua_rawget(L, -3)) {
+            // 遍历时可以把已有的键置空
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, -6);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
 int decodeMap(  // 解码字典
     struct tars_context* context,
     lua_State* L,
     struct read_buffer* buffer,
     uint32_t key_type,
     uint32_t value_type,
-    bool missing)
+    bool missing,
+    const uint8_t* proj,
+    bool reuse)
 {
     VERB("解码字典");
     if (value_type >= LUATARS_TYPE_MAX) {
-        if ((size_t)(value_type - LUATARS_TYPE_MAX) > context->n) {
-            luaL_error(L, "invalid struct, id = %d", value_type);
-        }
+        check_struct(L, context, value_type);
     }
     int64_t len = 0;
     if (!missing) {
@@ -1245,15 +2188,26 @@ int decodeMap(  // 解码字典
         len = read_int64(L, buffer, def_zero, header, false);
     }
     VERB("字典大小:%d", len);
-    lua_createtable(L, 0, len);
+    if (reuse && !lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        reuse = false;
+    }
+    if (!reuse) {
+        lua_createtable(L, 0, len);
+    }
     lua_rawgetp(L, LUA_REGISTRYINDEX, map_mt), lua_setmetatable(L, -2);
+    size_t start = buffer->offset;
     for (int i = 0; i < len; ++i) {
         // key只支持基础类型
         struct tars_header header;
         if (readHeader(L, buffer, &header, 0)) {
             luaL_error(L, "[C] %s %d: map got no key", __FUNCTION__, __LINE__);
         }
+        // 键总是字符串，切片作为键无法按内容查找
+        size_t slice = buffer->slice;
+        buffer->slice = 0;
         read_basic(L, buffer, key_type, def_zero, header, false);
+        buffer->slice = slice;
         VERB("键为%s", lua_tostring(L, -1));
         // value只支持基础类型和复合类型，不支持嵌套类型
         if (readHeader(L, buffer, &header, 1)) {
@@ -1268,13 +2222,95 @@ int decodeMap(  // 解码字典
                 luaL_error(L, "[C] %s %d: invalid map value, require 'struct', got '%s'", __FUNCTION__, __LINE__,
                            tars_type_name(header.type));
             }
-            decodeStruct(context, L, buffer, value_type, false);
+            if (reuse) {
+                lua_pushvalue(L, -1);
+                lua_rawget(L, -3);
+            }
+            decodeStruct(context, L, buffer, value_type, false, proj, reuse);
         }
         lua_rawset(L, -3);
     }
+    if (reuse) {
+        map_remove_stale(L, buffer, start, len, key_type);
+    }
+    return 0;
+}
+
+int decodeSimpleList(  // 解码字节数组，结果是一个lua字符串
+    lua_State* L,
+    struct read_buffer* buffer,
+    uint8_t head_type,
+    bool missing)
+{
+    if (missing) {
+        lua_pushlstring(L, "", 0);
+        return 0;
+    }
+    struct tars_header header;
+    if (TarsHeadeSimpleList == head_type) {
+        // 元素类型，固定为字节
+        if (readHeader(L, buffer, &header, 0) || TarsHeadeChar != header.type) {
+            luaL_error(L, "[C] %s %d: simple list got invalid element type", __FUNCTION__, __LINE__);
+        }
+    }
+    if (readHeader(L, buffer, &header, 0)) {
+        luaL_error(L, "[C] %s %d: list got no length, (%d/%d)", __FUNCTION__, __LINE__, buffer->offset, buffer->n);
+    }
+    int64_t len = read_int64(L, buffer, def_zero, header, false);
+    if (len < 0 || len > _MAX_STR_LEN) {
+        luaL_error(L, "[C] %s %d: invalid list length %d", __FUNCTION__, __LINE__, (int)len);
+    }
+    if (TarsHeadeSimpleList == head_type) {
+        if (!has_size(buffer, len)) {
+            luaL_error(L, "[C] %s %d: no buffer, need %d", __FUNCTION__, __LINE__, (int)len);
+        }
+        if (buffer->slice > 0 && (size_t)len >= buffer->slice) {
+            slice_new(L, read_buffer(buffer, 0), len, buffer->owner);
+        }
+        else {
+            lua_pushlstring(L, read_buffer(buffer, 0), len);
+        }
+        skip_buffer(buffer, len);
+        return 0;
+    }
+    // 按普通数组写入的字节
+    luaL_Buffer B;
+    char* out = luaL_buffinitsize(L, &B, len);
+    for (int64_t i = 0; i < len; ++i) {
+        if (readHeader(L, buffer, &header, 0)) {
+            luaL_error(L, "[C] %s %d: list element not found, index = %d, n = %d", __FUNCTION__, __LINE__, (int)i,
+                       (int)len);
+        }
+        int64_t v = read_int64(L, buffer, def_zero, header, false);
+        if (v < INT8_MIN || v > UINT8_MAX) {
+            luaL_error(L, "invalid byte value = %d, index = %d", (int)v, (int)i);
+        }
+        out[i] = (char)v;
+    }
+    luaL_pushresultsize(&B, len);
     return 0;
 }
 
+// 读取字节数组的内容，头部已经读取，返回内容的位置，不复制
+static const char* read_simple_list(lua_State* L, struct read_buffer* buffer, size_t* len)
+{
+    struct tars_header header;
+    if (readHeader(L, buffer, &header, 0) || TarsHeadeChar != header.type) {
+        luaL_error(L, "[C] %s %d: simple list got invalid element type", __FUNCTION__, __LINE__);
+    }
+    if (readHeader(L, buffer, &header, 0)) {
+        luaL_error(L, "[C] %s %d: list got no length", __FUNCTION__, __LINE__);
+    }
+    int64_t n = read_int64(L, buffer, def_zero, header, false);
+    if (n < 0 || n > _MAX_STR_LEN || !has_size(buffer, n)) {
+        luaL_error(L, "[C] %s %d: invalid list length %d", __FUNCTION__, __LINE__, (int)n);
+    }
+    const char* s = read_buffer(buffer, 0);
+    skip_buffer(buffer, n);
+    *len = n;
+    return s;
+}
+
 #define CHECK_SIZE(L, Buffer, N)                                                \
     if (!has_size(Buffer, N)) {                                                 \
         luaL_error(L, "[C] %s %d: malformaled stream", __FUNCTION__, __LINE__); \
@@ -1284,101 +2320,221 @@ int decodeMap(  // 解码字典
     CHECK_SIZE(L, Buffer, N);   \
     skip_buffer(Buffer, N);
 
-int skipField(  // 跳过若干字段
+int skipValue(  // 跳过一个值，头部已经读取
     lua_State* L,
     struct read_buffer* buffer,
-    uint16_t n)
+    struct tars_header header)
 {
-    VERB("跳过字段");
-    for (struct tars_header header; n != 0 && !readHeader(L, buffer, &header, -1); --n) {
-        switch (header.type) {
-            case TarsHeadeZeroTag: {
-                // skip nothing
-            } break;
-            case TarsHeadeChar: {
-                SKIP_SIZE(L, buffer, sizeof(int8_t));
-            } break;
-            case TarsHeadeShort: {
-                SKIP_SIZE(L, buffer, sizeof(int16_t));
-            } break;
-            case TarsHeadeInt32: {
-                SKIP_SIZE(L, buffer, sizeof(int32_t));
-            } break;
-            case TarsHeadeInt64: {
-                SKIP_SIZE(L, buffer, sizeof(int64_t));
-            } break;
-            case TarsHeadeFloat: {
-                SKIP_SIZE(L, buffer, sizeof(float));
-            } break;
-            case TarsHeadeDouble: {
-                SKIP_SIZE(L, buffer, sizeof(double));
-            } break;
-            case TarsHeadeString1: {
-                CHECK_SIZE(L, buffer, sizeof(uint8_t));
-                uint8_t sz = *(const uint8_t*)read_buffer(buffer, 0);
-                SKIP_SIZE(L, buffer, sz + sizeof(uint8_t));
-            } break;
-            case TarsHeadeString4: {
-                CHECK_SIZE(L, buffer, sizeof(uint32_t));
-                uint32_t sz = *(const uint32_t*)read_buffer(buffer, 0);
-                sz = be32toh(sz);
-                SKIP_SIZE(L, buffer, sz + sizeof(uint32_t));
-            } break;
-            case TarsHeadeMap: {
-                VERB("跳过字典");
-                struct tars_header sz_header;
-                if (readHeader(L, buffer, &sz_header, 0)) {
-                    luaL_error(L, "[C] %s %d: map got no length", __FUNCTION__, __LINE__);
-                }
-                int64_t len = read_int64(L, buffer, def_zero, sz_header, false);
-                for (; len > 0; --len) {
-                    skipField(L, buffer, 1);
-                    skipField(L, buffer, 1);
-                }
-            } break;
-            case TarsHeadeList: {
-                VERB("跳过列表");
-                struct tars_header sz_header;
-                if (readHeader(L, buffer, &sz_header, 0)) {
-                    luaL_error(L, "[C] %s %d: list got no length", __FUNCTION__, __LINE__);
-                }
-                int64_t len = read_int64(L, buffer, def_zero, sz_header, false);
-                for (; len > 0; --len) {
-                    skipField(L, buffer, 1);
-                }
-            } break;
-            case TarsHeadeStructBegin: {
-                VERB("跳过结构体");
-                skipField(L, buffer, 256);  // 跳过一个完整的结构体
-            } break;
-            case TarsHeadeSimpleList: {
-                luaL_error(L, "[C] %s %d: TODO 'TarsHeadeSimpleList' not support yet", __FUNCTION__, __LINE__);
-            } break;
-            default: {
-                luaL_error(L, "[C] %s %d: can not skip type = %d '%s'", __FUNCTION__, __LINE__, header.type,
-                           tars_type_name(header.type));
+    switch (header.type) {
+        case TarsHeadeZeroTag: {
+            // skip nothing
+        } break;
+        case TarsHeadeChar: {
+            SKIP_SIZE(L, buffer, sizeof(int8_t));
+        } break;
+        case TarsHeadeShort: {
+            SKIP_SIZE(L, buffer, sizeof(int16_t));
+        } break;
+        case TarsHeadeInt32: {
+            SKIP_SIZE(L, buffer, sizeof(int32_t));
+        } break;
+        case TarsHeadeInt64: {
+            SKIP_SIZE(L, buffer, sizeof(int64_t));
+        } break;
+        case TarsHeadeFloat: {
+            SKIP_SIZE(L, buffer, sizeof(float));
+        } break;
+        case TarsHeadeDouble: {
+            SKIP_SIZE(L, buffer, sizeof(double));
+        } break;
+        case TarsHeadeString1: {
+            CHECK_SIZE(L, buffer, sizeof(uint8_t));
+            uint8_t sz = *(const uint8_t*)read_buffer(buffer, 0);
+            SKIP_SIZE(L, buffer, sz + sizeof(uint8_t));
+        } break;
+        case TarsHeadeString4: {
+            CHECK_SIZE(L, buffer, sizeof(uint32_t));
+            uint32_t sz = *(const uint32_t*)read_buffer(buffer, 0);
+            sz = be32toh(sz);
+            SKIP_SIZE(L, buffer, sz + sizeof(uint32_t));
+        } break;
+        case TarsHeadeMap: {
+            VERB("跳过字典");
+            struct tars_header sz_header;
+            if (readHeader(L, buffer, &sz_header, 0)) {
+                luaL_error(L, "[C] %s %d: map got no length", __FUNCTION__, __LINE__);
+            }
+            int64_t len = read_int64(L, buffer, def_zero, sz_header, false);
+            for (; len > 0; --len) {
+                skipField(L, buffer, 1);
+                skipField(L, buffer, 1);
+            }
+        } break;
+        case TarsHeadeList: {
+            VERB("跳过列表");
+            struct tars_header sz_header;
+            if (readHeader(L, buffer, &sz_header, 0)) {
+                luaL_error(L, "[C] %s %d: list got no length", __FUNCTION__, __LINE__);
+            }
+            int64_t len = read_int64(L, buffer, def_zero, sz_header, false);
+            for (; len > 0; --len) {
+                skipField(L, buffer, 1);
+            }
+        } break;
+        case TarsHeadeStructBegin: {
+            VERB("跳过结构体");
+            skipField(L, buffer, 256);  // 跳过一个完整的结构体
+        } break;
+        case TarsHeadeSimpleList: {
+            VERB("跳过字节数组");
+            struct tars_header sz_header;
+            if (readHeader(L, buffer, &sz_header, 0) || TarsHeadeChar != sz_header.type) {
+                luaL_error(L, "[C] %s %d: simple list got invalid element type", __FUNCTION__, __LINE__);
             }
+            if (readHeader(L, buffer, &sz_header, 0)) {
+                luaL_error(L, "[C] %s %d: simple list got no length", __FUNCTION__, __LINE__);
+            }
+            int64_t len = read_int64(L, buffer, def_zero, sz_header, false);
+            if (len < 0) {
+                luaL_error(L, "[C] %s %d: invalid simple list length %d", __FUNCTION__, __LINE__, (int)len);
+            }
+            SKIP_SIZE(L, buffer, len);
+        } break;
+        default: {
+            luaL_error(L, "[C] %s %d: can not skip type = %d '%s'", __FUNCTION__, __LINE__, header.type,
+                       tars_type_name(header.type));
         }
     }
     return 0;
 }
 
+int skipField(  // 跳过若干字段
+    lua_State* L,
+    struct read_buffer* buffer,
+    uint16_t n)
+{
+    VERB("跳过字段");
+    for (struct tars_header header; n != 0 && !readHeader(L, buffer, &header, -1); --n) {
+        skipValue(L, buffer, header);
+    }
+    return 0;
+}
+
+static const uint8_t* check_projection(lua_State* L, int idx, struct tars_context* context);
+
+// 解码的数据来源，可以是字符串，切片，userdata的整块内存，或者轻量userdata加长度
+// 轻量userdata的长度参数读取后从栈上移除，之后的参数位置和使用字符串时一样
+// 数据不复制，内存由调用者持有，解码期间不能释放
+static const char* check_source(lua_State* L, int idx, size_t* n)
+{
+    switch (lua_type(L, idx)) {
+        case LUA_TLIGHTUSERDATA: {
+            const char* s = (const char*)lua_touserdata(L, idx);
+            lua_Integer len = luaL_checkinteger(L, idx + 1);
+            if (len < 0 || (NULL == s && len > 0)) {
+                luaL_error(L, "[C] %s %d: invalid source length %d", __FUNCTION__, __LINE__, (int)len);
+            }
+            lua_remove(L, idx + 1);
+            *n = len;
+            return NULL == s ? "" : s;
+        }
+        case LUA_TUSERDATA: {
+            const char* s = test_slice(L, idx, n);
+            if (NULL != s) {
+                return s;
+            }
+            if (is_object(L, idx)) {
+                luaL_error(L, "[C] %s %d: invalid source, got a tars object", __FUNCTION__, __LINE__);
+            }
+            *n = lua_rawlen(L, idx);
+            return (const char*)lua_touserdata(L, idx);
+        }
+        default: {
+            return luaL_checklstring(L, idx, n);
+        }
+    }
+}
+
 // 从二进制流中解析出指定的结构体
+// 用法：context:decodeStruct("TStudent", data, context:projection("TStudent", {"sId", "mBook.*.sName"}))
 static int luatars_decodeStruct(lua_State* L)
 {
     luaL_checktype(L, 1, LUA_TUSERDATA);
-    struct tars_context* context = (struct tars_context*)lua_touserdata(L, 1);
+    struct tars_context* context = check_context(L, 1);
     uint32_t id = luaL_checkinteger(L, 2);
     size_t n = 0;
-    const char* s = luaL_checklstring(L, 3, &n);
-    lua_settop(L, 3);
+    const char* s = check_source(L, 3, &n);
+    lua_settop(L, 4);
+    const uint8_t* proj = lua_isnil(L, 4) ? NULL : check_projection(L, 4, context);
+    lua_getmetatable(L, 1);
+    lua_insert(L, 4);  // 4号位置是元表，投影放在5号位置
+
+    struct read_buffer buffer;
+    buffer.n = n, buffer.offset = 0, buffer.data = s;
+    slice_source(L, &buffer, 3);
+
+    decodeStruct(context, L, &buffer, id, false, proj, false);
+
+    return 1;
+}
+
+// 解码到已有的表里，覆盖字段，嵌套的结构体，数组和字典尽量复用原来的表，去掉多余的数组尾部和字典的键
+// 用法：context:decodeInto("TStudent", data, target, projection)，返回target
+static int luatars_decodeInto(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    size_t n = 0;
+    const char* s = check_source(L, 3, &n);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_settop(L, 5);
+    const uint8_t* proj = lua_isnil(L, 5) ? NULL : check_projection(L, 5, context);
     lua_getmetatable(L, 1);
+    lua_insert(L, 4);  // 4号位置是元表，目标放在5号位置
 
     struct read_buffer buffer;
     buffer.n = n, buffer.offset = 0, buffer.data = s;
+    slice_source(L, &buffer, 3);
+
+    lua_pushvalue(L, 5);
+    decodeStruct(context, L, &buffer, id, false, proj, true);
+
+    return 1;
+}
+
+// 批量解码结构体，数据是用结构体开始和结束包裹后拼接的多个结构体，和encodeMany对应
+// 用法：local list = context:decodeMany("TBook", data)
+static int luatars_decodeMany(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    size_t n = 0;
+    const char* s = check_source(L, 3, &n);
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);  // 4号位置是元表
+    check_struct(L, context, id);
+    lua_newtable(L);  // 5号位置是结果
 
-    decodeStruct(context, L, &buffer, id, false);
+    struct read_buffer buffer;
+    buffer.n = n, buffer.offset = 0, buffer.data = s;
+    slice_source(L, &buffer, 3);
 
+    struct tars_header header = {0, 0};
+    for (int i = 1; !readHeader(L, &buffer, &header, -1); ++i) {
+        if (TarsHeadeStructBegin != header.type) {
+            luaL_error(L, "[C] %s %d: require 'struct', got '%s', index = %d", __FUNCTION__, __LINE__,
+                       tars_type_name(header.type), i);
+        }
+        decodeStruct(context, L, &buffer, id, false, NULL, false);
+        lua_rawseti(L, 5, i);
+    }
+    // 多出来的结构体结束标志会结束循环，后面的数据不能悄悄丢掉
+    if (TarsHeadeStructEnd == header.type || buffer.offset < buffer.n) {
+        luaL_error(L, "[C] %s %d: unexpected 'struct end', (%d/%d)", __FUNCTION__, __LINE__, (int)buffer.offset,
+                   (int)buffer.n);
+    }
     return 1;
 }
 
@@ -1386,18 +2542,19 @@ static int luatars_decodeMap(lua_State* L)
 {
     // 从二进制流中解析出指定的字典
     luaL_checktype(L, 1, LUA_TUSERDATA);
-    struct tars_context* context = (struct tars_context*)lua_touserdata(L, 1);
+    struct tars_context* context = check_context(L, 1);
     uint32_t key_type = luaL_checkinteger(L, 2);
     uint32_t value_type = luaL_checkinteger(L, 3);
-    lua_settop(L, 4), lua_replace(L, 3);
     size_t n = 0;
-    const char* s = luaL_checklstring(L, 3, &n);
+    const char* s = check_source(L, 4, &n);
+    lua_settop(L, 4), lua_replace(L, 3);
     lua_getmetatable(L, 1);  // 4号位置是元表
 
     struct read_buffer buffer;
     buffer.n = n, buffer.offset = 0, buffer.data = s;
+    slice_source(L, &buffer, 3);
 
-    decodeMap(context, L, &buffer, key_type, value_type, false);
+    decodeMap(context, L, &buffer, key_type, value_type, false, NULL, false);
 
     return 1;
 }
@@ -1406,252 +2563,5081 @@ static int luatars_decodeList(lua_State* L)
 {
     // 从二进制流中解析出指定的数组
     luaL_checktype(L, 1, LUA_TUSERDATA);
-    struct tars_context* context = (struct tars_context*)lua_touserdata(L, 1);
+    struct tars_context* context = check_context(L, 1);
     uint32_t value_type = luaL_checkinteger(L, 2);
     size_t n = 0;
-    const char* s = luaL_checklstring(L, 3, &n);
+    const char* s = check_source(L, 3, &n);
     lua_settop(L, 3);
     lua_getmetatable(L, 1);  // 4号位置是元表
 
     struct read_buffer buffer;
     buffer.n = n, buffer.offset = 0, buffer.data = s;
+    slice_source(L, &buffer, 3);
 
-    decodeList(context, L, &buffer, value_type, false);
+    if (LUATARS_INT8 == value_type) {
+        decodeSimpleList(L, &buffer, TarsHeadeSimpleList, false);
+    }
+    else {
+        decodeList(context, L, &buffer, value_type, false, NULL, false);
+    }
 
     return 1;
 }
 
-// 打印环境的整体信息
-static int luatars_dump(lua_State* L)
+// 解码请求包或响应包，sBuffer不复制，只记录包体在数据里的位置
+static void decodeEnvelope(struct tars_context* context,
+                           lua_State* L,
+                           struct read_buffer* buffer,
+                           const struct envelope_field* fields,
+                           size_t* body,
+                           size_t* body_n)
 {
-    luaL_checktype(L, 1, LUA_TUSERDATA);
-    struct tars_context* context = (struct tars_context*)lua_touserdata(L, 1);
-    lua_settop(L, 1);
-    lua_getmetatable(L, 1);
-
-    luaL_Buffer B;
-    luaL_buffinit(L, &B);
-    for (size_t i = 0; i < context->n; ++i) {
-        char b[512];
-        lua_rawgeti(L, 2, i);
-        struct tars_field* field = &context->fields[i];
-        int sz = snprintf(b, sizeof b, "[%d]:%8s\t%s\t%d\t%d\t%d\n", field->tag, lua_tostring(L, -1),
-                          field->forced ? "require" : "optional", field->type1, field->type2, field->type3);
-        lua_pop(L, 1);
-        luaL_addlstring(&B, b, sz);
+    uint32_t seen = 0;
+    int n = 0;
+    while (fields[n].name) {
+        ++n;
+    }
+    lua_createtable(L, 0, n);
+    for (struct tars_header header; !readHeader(L, buffer, &header, -1);) {
+        int i = 0;
+        while (i < n && fields[i].field.tag != header.tag) {
+            ++i;
+        }
+        if (i == n) {
+            skipValue(L, buffer, header);
+            continue;
+        }
+        const struct tars_field* field = &fields[i].field;
+        seen |= 1u << i;
+        if (LUATARS_LIST == field->type1 && TarsHeadeSimpleList == header.type) {
+            *body = read_simple_list(L, buffer, body_n) - buffer->data;
+            continue;
+        }
+        // 按普通数组写入的sBuffer只能复制成字符串
+        decodeField(context, L, buffer, field, header, false, NULL, false);
+        lua_setfield(L, -2, fields[i].name);
+    }
+    // 缺失的字段使用默认值，sBuffer缺失就是空的包体
+    struct tars_header none = {0, 0};
+    for (int i = 0; i < n; ++i) {
+        const struct tars_field* field = &fields[i].field;
+        if ((seen & (1u << i)) || LUATARS_LIST == field->type1) {
+            continue;
+        }
+        decodeField(context, L, buffer, field, none, true, NULL, false);
+        lua_setfield(L, -2, fields[i].name);
     }
-    luaL_pushresult(&B);
-    return 1;
 }
 
-// 设置
-#define set_luatars_enum(L, Type) lua_pushinteger(L, LUATARS_##Type), lua_setfield(L, -2, #Type);
-
-static const unsigned char base64_table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-static int base64_encode(lua_State* L)
+static int decodeEnvelopeL(lua_State* L, const struct envelope_field* fields)
 {
-    size_t len = 0;
-    const unsigned char* src = (const unsigned char*)luaL_checklstring(L, 1, &len);
-    const unsigned char *end, *in;
-    size_t olen;
-    int line_len;
-
-    olen = len * 4 / 3 + 4; /* 3-byte blocks to 4-byte */
-    olen += olen / 72;      /* line feeds */
-    olen++;                 /* nul termination */
-    if (olen < len) {
-        luaL_error(L, "base64 integer overflow");
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    size_t n = 0;
+    const char* s = check_source(L, 2, &n);
+    int body_id = luaL_optinteger(L, 3, -1);
+    size_t first = luaL_optinteger(L, 4, 1);
+    size_t last = luaL_optinteger(L, 5, n);
+    if (first < 1 || last > n || first > last + 1) {
+        luaL_error(L, "invalid range [%d, %d]", (int)first, (int)last);
     }
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);  // 4号位置是元表
 
-    luaL_Buffer B;
-    luaL_buffinitsize(L, &B, olen);
-
-    // 结束位置
-    end = src + len;
-    // 当前位置
-    in = src;
-    line_len = 0;
-    while (end - in >= 3) {
-        luaL_addchar(&B, base64_table[in[0] >> 2]);
-        luaL_addchar(&B, base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)]);
-        luaL_addchar(&B, base64_table[((in[1] & 0x0f) << 2) | (in[2] >> 6)]);
-        luaL_addchar(&B, base64_table[in[2] & 0x3f]);
-        in += 3;
-        // line_len += 4;
-        // if (line_len >= 72) {
-        //     luaL_addchar(&B, '\n');
-        //     line_len = 0;
-        // }
-    }
-
-    if (end - in) {
-        luaL_addchar(&B, base64_table[in[0] >> 2]);
-        if (end - in == 1) {
-            luaL_addchar(&B, base64_table[(in[0] & 0x03) << 4]);
-            luaL_addchar(&B, '=');
+    struct read_buffer buffer;
+    buffer.data = s, buffer.n = last, buffer.offset = first - 1;
+    slice_source(L, &buffer, 2);
+    size_t body = buffer.offset, body_n = 0;
+    decodeEnvelope(context, L, &buffer, fields, &body, &body_n);  // 5号位置是包头
+
+    // 按普通数组写入的包体已经复制成字符串，不在数据里，没有位置
+    bool copied = LUA_TSTRING == lua_getfield(L, 5, "sBuffer");  // 6号位置
+    if (body_id < 0) {
+        lua_pushnil(L);
+    }
+    else {
+        struct read_buffer sub;
+        if (copied) {
+            sub.data = lua_tolstring(L, 6, &sub.n), sub.offset = 0;
+            slice_source(L, &sub, 6);
         }
         else {
-            luaL_addchar(&B, base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)]);
-            luaL_addchar(&B, base64_table[(in[1] & 0x0f) << 2]);
+            sub.data = s, sub.n = body + body_n, sub.offset = body;
+            slice_source(L, &sub, 2);
         }
-        luaL_addchar(&B, '=');
-        line_len += 4;
+        decodeStruct(context, L, &sub, body_id, false, NULL, false);
     }
+    if (copied) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+    else {
+        lua_pushinteger(L, body + 1);
+        lua_pushinteger(L, body + body_n);
+    }
+    lua_remove(L, 6);
+    return 4;
+}
 
-    // if (line_len) {
-    //     luaL_addchar(&B, '\n');
-    // }
-
-    luaL_pushresult(&B);
-
-    return 1;
+// 解码请求包，返回包头，包体，包体在数据里的开始和结束位置
+// 包体id为空时不解码包体，可以根据位置再解码，first和last可以直接使用splitFrames返回的区间
+// 包体按普通数组写入时不在数据里，位置返回nil，包头的sBuffer是复制出的字符串
+// 用法：local req, body, first, last = tars.decodeRequest(context, data, id, first, last)
+static int luatars_decodeRequest(lua_State* L)
+{
+    return decodeEnvelopeL(L, request_fields);
 }
 
-static int base64_decode(lua_State* L)
+// 解码响应包，参数同decodeRequest
+static int luatars_decodeResponse(lua_State* L)
 {
-    size_t len = 0;
-    const unsigned char* src = (const unsigned char*)luaL_checklstring(L, 1, &len);
-    unsigned char dtable[256], *out, *pos, block[4], tmp;
-    size_t i, count, olen;
-    int pad = 0;
+    return decodeEnvelopeL(L, response_fields);
+}
 
-    memset(dtable, 0x80, 256);
-    for (i = 0; i < sizeof(base64_table) - 1; i++) {
-        dtable[base64_table[i]] = (unsigned char)i;
+// 读取字典的长度，头部已经读取
+static int64_t read_map_size(lua_State* L, struct read_buffer* buffer, struct tars_header header)
+{
+    if (TarsHeadeMap != header.type) {
+        luaL_error(L, "[C] %s %d: require 'map', got '%s'", __FUNCTION__, __LINE__, tars_type_name(header.type));
     }
-    dtable['='] = 0;
+    if (readHeader(L, buffer, &header, 0)) {
+        luaL_error(L, "[C] %s %d: map got no length", __FUNCTION__, __LINE__);
+    }
+    int64_t n = read_int64(L, buffer, def_zero, header, false);
+    if (n < 0 || n > _MAX_STR_LEN) {
+        luaL_error(L, "[C] %s %d: invalid map length %d", __FUNCTION__, __LINE__, (int)n);
+    }
+    return n;
+}
 
-    count = 0;
-    for (i = 0; i < len; i++) {
-        if (dtable[src[i]] != 0x80)
-            count++;
+// 从TUP协议的UniAttribute中解码一个属性，只比较属性名称，其他属性直接跳过
+// 属性值从字节数组的位置直接解码，返回值和类型名称，属性不存在返回nil
+// first和last可以直接使用decodeRequest返回的包体位置
+// 用法：local value, type_name = context:decodeAttr(data, "req", "TBook", first, last)
+static int luatars_decodeAttr(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    size_t n = 0;
+    const char* s = check_source(L, 2, &n);
+    size_t name_n = 0;
+    const char* name = luaL_checklstring(L, 3, &name_n);
+    size_t first = luaL_optinteger(L, 5, 1);
+    size_t last = luaL_optinteger(L, 6, n);
+    if (first < 1 || last > n || first > last + 1) {
+        luaL_error(L, "invalid range [%d, %d]", (int)first, (int)last);
     }
+    lua_settop(L, 4);
+    lua_getmetatable(L, 1);
+    lua_insert(L, 4);  // 4号位置是元表，类型放在5号位置
+    const char* type_name = NULL;
+    size_t type_n = 0;
+    uint32_t type = attr_type(L, context, 5, &type_name, &type_n);
 
-    if (count == 0 || count % 4) {
-        lua_pushstring(L, "");
-        return 1;
+    struct read_buffer buffer;
+    buffer.data = s, buffer.n = last, buffer.offset = first - 1;
+    slice_source(L, &buffer, 2);
+    struct tars_header header;
+    if (readHeader(L, &buffer, &header, 0)) {
+        return 0;  // 没有任何属性
+    }
+    for (int64_t i = read_map_size(L, &buffer, header); i > 0; --i) {
+        if (readHeader(L, &buffer, &header, 0)) {
+            luaL_error(L, "[C] %s %d: attribute name not found", __FUNCTION__, __LINE__);
+        }
+        size_t key_n = 0;
+        const char* key = read_lstring(L, &buffer, header, &key_n);
+        if (readHeader(L, &buffer, &header, 1)) {
+            luaL_error(L, "[C] %s %d: attribute value not found", __FUNCTION__, __LINE__);
+        }
+        if (key_n != name_n || memcmp(key, name, name_n) != 0) {
+            skipValue(L, &buffer, header);
+            continue;
+        }
+        // 每个属性只有一种类型，取第一个
+        if (read_map_size(L, &buffer, header) < 1) {
+            return 0;
+        }
+        if (readHeader(L, &buffer, &header, 0)) {
+            luaL_error(L, "[C] %s %d: attribute type not found", __FUNCTION__, __LINE__);
+        }
+        type_name = read_lstring(L, &buffer, header, &type_n);
+        if (readHeader(L, &buffer, &header, 1) || TarsHeadeSimpleList != header.type) {
+            luaL_error(L, "[C] %s %d: attribute value require 'simple list'", __FUNCTION__, __LINE__);
+        }
+        struct read_buffer value;
+        value.offset = 0, value.data = read_simple_list(L, &buffer, &value.n);
+        value.slice = buffer.slice, value.owner = buffer.owner;
+        if (readHeader(L, &value, &header, 0)) {
+            luaL_error(L, "[C] %s %d: attribute value is empty", __FUNCTION__, __LINE__);
+        }
+        if (type < LUATARS_TYPE_MAX) {
+            read_basic(L, &value, type, def_zero, header, false);
+        }
+        else {
+            if (TarsHeadeStructBegin != header.type) {
+                luaL_error(L, "[C] %s %d: attribute value require 'struct', got '%s'", __FUNCTION__, __LINE__,
+                           tars_type_name(header.type));
+            }
+            decodeStruct(context, L, &value, type, false, NULL, false);
+        }
+        lua_pushlstring(L, type_name, type_n);
+        return 2;
     }
+    return 0;
+}
 
-    olen = count * 3 / 4;
+// 延迟解码的结构体视图，访问字段时才定位和解码
+struct tars_proxy {
+    uint32_t id;        // 结构体id
+    uint32_t n;         // 字段数量
+    size_t scan;        // 下一个还没扫描的字段头部位置
+    bool done;          // 是否已经扫描到结构体结束
+    size_t offsets[0];  // 各字段头部的位置
+};
 
-    luaL_Buffer B;
-    luaL_buffinitsize(L, &B, olen);
+#define PROXY_UNKNOWN ((size_t)-1)
 
-    pos = out = (unsigned char*)luaL_prepbuffsize(&B, olen);
+// 视图元表的id
+static const void* proxy_mt = &proxy_mt;
 
-    count = 0;
-    for (i = 0; i < len; i++) {
-        tmp = dtable[src[i]];
-        if (tmp == 0x80)
-            continue;
+// 创建结构体视图，uv位置的表里存放了源数据和上下文
+static void proxy_new(lua_State* L, struct tars_context* context, uint32_t id, size_t offset, int uv)
+{
+    uint32_t n = context_struct(context, id)->n;
+    struct tars_proxy* proxy = (struct tars_proxy*)lua_newuserdata(L, sizeof(struct tars_proxy) + n * sizeof(size_t));
+    proxy->id = id;
+    proxy->n = n;
+    proxy->scan = offset;
+    proxy->done = false;
+    for (uint32_t i = 0; i < n; ++i) {
+        proxy->offsets[i] = PROXY_UNKNOWN;
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, proxy_mt), lua_setmetatable(L, -2);
+    // 源数据和上下文放在附加表里，解码过的字段也缓存在这里
+    lua_createtable(L, 2, 0);
+    lua_rawgeti(L, uv, 1), lua_rawseti(L, -2, 1);
+    lua_rawgeti(L, uv, 2), lua_rawseti(L, -2, 2);
+    lua_setuservalue(L, -2);
+}
 
-        if (src[i] == '=') {
-            pad++;
-        }
-        block[count] = tmp;
-        count++;
-        if (count == 4) {
-            *pos++ = (block[0] << 2) | (block[1] >> 4);
-            *pos++ = (block[1] << 4) | (block[2] >> 2);
-            *pos++ = (block[2] << 6) | block[3];
-            count = 0;
-            if (pad) {
-                if (pad == 1)
-                    pos--;
-                else if (pad == 2)
-                    pos -= 2;
-                else {
-                    luaL_error(L, "invalid padding");
-                }
-                break;
-            }
+// 查找字段头部的位置，扫描过的字段都记录下来
+static size_t proxy_find(
+    lua_State* L,
+    struct tars_context* context,
+    struct tars_proxy* proxy,
+    struct read_buffer* buffer,
+    uint32_t index)
+{
+    struct tars_struct* st = context_struct(context, proxy->id);
+    while (PROXY_UNKNOWN == proxy->offsets[index] && !proxy->done) {
+        buffer->offset = proxy->scan;
+        struct tars_header header = {0, 0};
+        int n = read_header(buffer, &header);
+        if (n < 0) {
+            luaL_error(L, "[C] %s %d: data truncated, (%d/%d)", __FUNCTION__, __LINE__, buffer->offset, buffer->n);
+        }
+        if (0 == n || TarsHeadeStructEnd == header.type) {
+            proxy->done = true;
+            break;
+        }
+        uint8_t i = st->index[header.tag];
+        if (STRUCT_NO_FIELD != i && PROXY_UNKNOWN == proxy->offsets[i]) {
+            proxy->offsets[i] = proxy->scan;
         }
+        skipField(L, buffer, 1);
+        proxy->scan = buffer->offset;
     }
-    luaL_addsize(&B, pos - out);
-    luaL_pushresult(&B);
-    VERB("原始大小为%d, base64解码大小为:%d", len, pos - out);
-
-    return 1;
+    return proxy->offsets[index];
 }
 
-static int unzip_str(lua_State* L)
+// 视图的字段访问
+static int proxy_index(lua_State* L)
 {
-    z_stream strm;
-
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
+    struct tars_proxy* proxy = (struct tars_proxy*)lua_touserdata(L, 1);
+    lua_settop(L, 2);
+    if (LUA_TSTRING != lua_type(L, 2)) {
+        lua_pushnil(L);
+        return 1;  // 附加表的数字键是源数据和上下文，不能返回
+    }
+    lua_getuservalue(L, 1);  // 3号位置是附加表
+    lua_pushvalue(L, 2);
+    if (LUA_TNIL != lua_rawget(L, 3)) {
+        return 1;  // 已经解码过
+    }
+    lua_pop(L, 1);
+    lua_rawgeti(L, 3, 2);
+    struct tars_context* context = check_context(L, 4);
+    lua_getmetatable(L, 4);
+    lua_replace(L, 4);  // 4号位置是元表
+    // 按名称找到字段
+    size_t first = proxy->id - LUATARS_TYPE_MAX;
+    uint32_t index = 0;
+    for (; index < proxy->n; ++index) {
+        lua_geti(L, 4, first + index);
+        bool found = lua_rawequal(L, -1, 2);
+        lua_pop(L, 1);
+        if (found) {
+            break;
+        }
+    }
+    if (index >= proxy->n) {
+        lua_pushnil(L);
+        return 1;  // 不是结构体的字段
+    }
+    struct tars_field* field = context->fields + first + index;
 
-    int ret = inflateInit2(&strm, 47);
+    size_t n = 0;
+    lua_rawgeti(L, 3, 1);  // 5号位置是源数据，切片引用它
+    const char* data = lua_tolstring(L, -1, &n);
+    struct read_buffer buffer;
+    buffer.n = n, buffer.offset = 0, buffer.data = data;
+    slice_source(L, &buffer, 5);
 
-    if (ret != Z_OK) {
-        luaL_error(L, "inflateInit2 failed: %d", ret);
+    struct tars_header header;
+    size_t offset = proxy_find(L, context, proxy, &buffer, index);
+    bool field_missing = PROXY_UNKNOWN == offset;
+    if (field_missing) {
+        buffer.offset = buffer.n;  // 缺失的字段使用默认值，不再读取数据
+    }
+    else {
+        buffer.offset = offset;
+        readHeader(L, &buffer, &header, field->tag);
+    }
+    if (!field_missing && field->type1 >= LUATARS_TYPE_MAX && TarsHeadeStructBegin == header.type) {
+        // 嵌套的结构体也返回视图
+        proxy_new(L, context, field->type1, buffer.offset, 3);
     }
+    else {
+        decodeField(context, L, &buffer, field, header, field_missing, NULL, false);
+    }
+    // 缓存解码结果
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 3);
+    return 1;
+}
 
-    size_t length = 0;
-    strm.next_in = (unsigned char*)luaL_checklstring(L, 1, &length);
-    strm.avail_in = length;
+// 从二进制流中创建结构体的延迟解码视图，字段在访问时才解码
+// 用法：local view = context:decodeLazy("TStudent", data); print(view.sId)
+static int luatars_decodeLazy(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    luaL_checktype(L, 3, LUA_TSTRING);
+    lua_settop(L, 3);
+    check_struct(L, context, id);
+    lua_createtable(L, 2, 0);
+    lua_pushvalue(L, 3), lua_rawseti(L, 4, 1);
+    lua_pushvalue(L, 1), lua_rawseti(L, 4, 2);
+    proxy_new(L, context, id, 0, 4);
+    return 1;
+}
 
-    luaL_Buffer B;
-    luaL_buffinit(L, &B);
+// 设置虚拟机的切片阈值，不短于阈值的字符串和字节数组解码成切片，不复制内容，返回原来的阈值
+// 切片引用着源数据，源数据在切片被回收前不会释放，0或者nil表示关闭
+// 用法：tars.sliceStrings(1024 * 1024)
+static int luatars_sliceStrings(lua_State* L)
+{
+    lua_Integer threshold = luaL_optinteger(L, 1, 0);
+    if (threshold < 0) {
+        luaL_error(L, "[C] %s %d: invalid slice threshold %d", __FUNCTION__, __LINE__, (int)threshold);
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, slice_threshold);
+    lua_pushinteger(L, lua_tointeger(L, -1));
+    lua_pushinteger(L, threshold), lua_rawsetp(L, LUA_REGISTRYINDEX, slice_threshold);
+    return 1;
+}
 
-    static size_t CHUNK = 1024 * 256;
-    unsigned char* out = (unsigned char*)malloc(CHUNK);
+// 切片的长度
+static int slice_len(lua_State* L)
+{
+    struct tars_slice* slice = (struct tars_slice*)check_object(L, 1, slice_mt, "slice");
+    lua_pushinteger(L, slice->n);
+    return 1;
+}
 
-    /* run inflate() on input until output buffer not full */
-    do {
-        strm.avail_out = CHUNK;
-        strm.next_out = out;
-
-        ret = inflate(&strm, Z_NO_FLUSH);
-
-        switch (ret) {
-            case Z_NEED_DICT:
-                ret = Z_DATA_ERROR; /* and fall through */
-            case Z_STREAM_ERROR:
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                inflateEnd(&strm);
-                free(out);
-                luaL_error(L, "inflate error:%d", ret);
-        }
-        luaL_addlstring(&B, (const char*)out, CHUNK - strm.avail_out);
-    } while (strm.avail_out == 0);
-
-    /* clean up and return */
-    inflateEnd(&strm);
-    free(out);
-
-    if (ret == Z_STREAM_END) {
-        luaL_pushresult(&B);
-        return 1;
-    }
-    luaL_error(L, "inflateEnd error: %d", ret);
-    return 0;
+// 复制成字符串
+static int slice_string(lua_State* L)
+{
+    struct tars_slice* slice = (struct tars_slice*)check_object(L, 1, slice_mt, "slice");
+    lua_pushlstring(L, slice->s, slice->n);
+    return 1;
 }
 
-int luaopen_tars(lua_State* L)
+// 按内容比较
+static int slice_eq(lua_State* L)
 {
-    // 注册所有的函数
-    luaL_Reg funs[] = {
+    size_t n1 = 0, n2 = 0;
+    const char* s1 = test_slice(L, 1, &n1);
+    const char* s2 = test_slice(L, 2, &n2);
+    lua_pushboolean(L, NULL != s1 && NULL != s2 && n1 == n2 && 0 == memcmp(s1, s2, n1));
+    return 1;
+}
+
+// 取一段内容，下标的含义和string.sub一样，结果还是切片，引用同一份源数据
+static int slice_sub(lua_State* L)
+{
+    struct tars_slice* slice = (struct tars_slice*)check_object(L, 1, slice_mt, "slice");
+    lua_Integer n = (lua_Integer)slice->n;
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+    i = i < 0 ? (i < -n ? 1 : n + i + 1) : (0 == i ? 1 : (i > n ? n + 1 : i));
+    j = j < 0 ? n + j + 1 : (j > n ? n : j);
+    lua_getuservalue(L, 1);
+    slice_new(L, slice->s + i - 1, i > j ? 0 : j - i + 1, -1);
+    return 1;
+}
+
+// 内容的地址和长度，可以直接传给解码函数或者C模块，地址只在切片存活时有效
+static int slice_ptr(lua_State* L)
+{
+    struct tars_slice* slice = (struct tars_slice*)check_object(L, 1, slice_mt, "slice");
+    lua_pushlightuserdata(L, (void*)slice->s);
+    lua_pushinteger(L, slice->n);
+    return 2;
+}
+
+// 编译好的字段投影
+struct tars_projection {
+    struct tars_context* context;  // 编译时使用的上下文
+    uint8_t marks[0];               // 每个字段的投影标记
+};
+
+// 投影元表的id
+static const void* projection_mt = &projection_mt;
+
+const uint8_t* check_projection(lua_State* L, int idx, struct tars_context* context)
+{
+    struct tars_projection* projection =
+        (struct tars_projection*)check_object(L, idx, projection_mt, "projection");
+    if (projection->context != context) {
+        luaL_error(L, "projection was compiled against another context");
+    }
+    return projection->marks;
+}
+
+// 按名称查找结构体的字段，4号位置是元表
+static struct tars_field* find_field(
+    lua_State* L,
+    struct tars_context* context,
+    uint32_t id,
+    const char* name,
+    size_t len)
+{
+    size_t first = id - LUATARS_TYPE_MAX;
+    uint32_t n = context_struct(context, id)->n;
+    for (uint32_t i = 0; i < n; ++i) {
+        size_t sz = 0;
+        lua_geti(L, 4, first + i);
+        const char* s = lua_tolstring(L, -1, &sz);
+        bool found = NULL != s && sz == len && 0 == memcmp(s, name, len);
+        lua_pop(L, 1);
+        if (found) {
+            return context->fields + first + i;
+        }
+    }
+    return NULL;
+}
+
+// 把一条路径加入投影，路径形如 "sId"、"stBook1.sName"、"mBook.*.sName"
+static void projection_add(
+    lua_State* L,
+    struct tars_context* context,
+    uint8_t* marks,
+    uint32_t id,
+    const char* path)
+{
+    struct tars_field* field = NULL;  // 上一段路径对应的字段
+    for (const char* p = path;;) {
+        const char* e = strchr(p, '.');
+        size_t len = e ? (size_t)(e - p) : strlen(p);
+        if (0 == len) {
+            luaL_error(L, "invalid projection path '%s'", path);
+        }
+        if (1 == len && '*' == *p) {
+            // 数组或者字典的所有元素
+            if (NULL == field || (LUATARS_MAP != field->type1 && LUATARS_LIST != field->type1)) {
+                luaL_error(L, "'*' must follow a map or list, path '%s'", path);
+            }
+            size_t index = field - context->fields;
+            if (NULL == e) {
+                marks[index] = PROJ_ALL;
+                return;
+            }
+            id = LUATARS_MAP == field->type1 ? field->type3 : field->type2;
+            if (id < LUATARS_TYPE_MAX) {
+                luaL_error(L, "elements are not struct, path '%s'", path);
+            }
+            field = NULL;
+        }
+        else {
+            if (NULL != field) {
+                if (LUATARS_MAP == field->type1 || LUATARS_LIST == field->type1) {
+                    luaL_error(L, "require '*' after a map or list, path '%s'", path);
+                }
+                if (field->type1 < LUATARS_TYPE_MAX) {
+                    luaL_error(L, "field is not a struct, path '%s'", path);
+                }
+                id = field->type1;
+            }
+            field = find_field(L, context, id, p, len);
+            if (NULL == field) {
+                luaL_error(L, "field not found, path '%s'", path);
+            }
+            size_t index = field - context->fields;
+            if (NULL == e) {
+                marks[index] = PROJ_ALL;
+                return;
+            }
+            if (PROJ_ALL != marks[index]) {
+                marks[index] = PROJ_PART;
+            }
+        }
+        p = e + 1;
+    }
+}
+
+// 编译字段投影，同一个结构体类型经由不同路径到达时，投影取并集
+// 用法：local proj = context:projection("TStudent", {"sId", "mBook.*.sName"})
+static int luatars_compileProjection(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+    check_struct(L, context, id);
+    lua_getmetatable(L, 1);  // 4号位置是元表
+
+    size_t sz = sizeof(struct tars_projection) + context->n;
+    struct tars_projection* projection = (struct tars_projection*)lua_newuserdata(L, sz);
+    memset(projection, 0, sz);
+    projection->context = context;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, projection_mt), lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1), lua_setuservalue(L, -2);  // 保持上下文的引用
+
+    size_t n = lua_rawlen(L, 3);
+    for (size_t i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 3, i);
+        const char* path = lua_tostring(L, -1);
+        if (NULL == path) {
+            luaL_error(L, "invalid projection path at #[%d]", (int)i);
+        }
+        projection_add(L, context, projection->marks, id, path);
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+// 带长度前缀的帧头部大小，长度是大端的4字节整数，包含头部本身
+#define TARS_FRAME_HEAD 4
+
+// 读取大端的4字节整数，不要求对齐
+static inline uint32_t load_be32(const char* p)
+{
+    uint32_t v = 0;
+    memcpy(&v, p, sizeof v);
+    return be32toh(v);
+}
+
+// 检查offset位置开始的帧，返回帧的总长度，数据不完整返回0
+static size_t frame_check(lua_State* L, const char* s, size_t n, size_t offset)
+{
+    if (n - offset < TARS_FRAME_HEAD) {
+        return 0;
+    }
+    uint32_t len = load_be32(s + offset);
+    if (len < TARS_FRAME_HEAD || len > _MAX_STR_LEN) {
+        luaL_error(L, "[C] %s %d: invalid frame length %d at %d", __FUNCTION__, __LINE__, (int)len, (int)offset);
+    }
+    return n - offset < len ? 0 : len;
+}
+
+// 切分接收缓存里的帧，init是开始的位置(从1开始)
+// 返回完整帧占用的字节数，以及每个帧的包体区间{开始1, 结束1, 开始2, 结束2, ...}，不完整的尾部留给下次
+// 用法：local consumed, spans = tars.splitFrames(data)
+static int luatars_splitFrames(lua_State* L)
+{
+    size_t n = 0;
+    const char* s = check_source(L, 1, &n);
+    size_t init = luaL_optinteger(L, 2, 1);
+    if (init < 1 || init > n + 1) {
+        luaL_error(L, "invalid init position %d", (int)init);
+    }
+    lua_settop(L, 1);
+    lua_newtable(L);
+    size_t offset = init - 1;
+    int i = 0;
+    for (size_t len; (len = frame_check(L, s, n, offset)) > 0; offset += len) {
+        lua_pushinteger(L, offset + TARS_FRAME_HEAD + 1), lua_rawseti(L, 2, ++i);
+        lua_pushinteger(L, offset + len), lua_rawseti(L, 2, ++i);
+    }
+    lua_pushinteger(L, offset - (init - 1));
+    lua_insert(L, 2);
+    return 2;
+}
+
+// 原地解码接收缓存里的每个帧，包体是一个结构体
+// 返回完整帧占用的字节数和解码出的结构体数组
+// 用法：local consumed, list = context:decodeFrames("RequestPacket", data)
+static int luatars_decodeFrames(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    size_t n = 0;
+    const char* s = check_source(L, 3, &n);
+    size_t init = luaL_optinteger(L, 4, 1);
+    if (init < 1 || init > n + 1) {
+        luaL_error(L, "invalid init position %d", (int)init);
+    }
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);  // 4号位置是元表
+    check_struct(L, context, id);
+    lua_newtable(L);  // 5号位置是结果
+
+    size_t offset = init - 1;
+    int i = 0;
+    for (size_t len; (len = frame_check(L, s, n, offset)) > 0; offset += len) {
+        struct read_buffer buffer;
+        buffer.data = s, buffer.n = offset + len, buffer.offset = offset + TARS_FRAME_HEAD;
+        slice_source(L, &buffer, 3);
+        decodeStruct(context, L, &buffer, id, false, NULL, false);
+        lua_rawseti(L, 5, ++i);
+    }
+    lua_pushinteger(L, offset - (init - 1));
+    lua_insert(L, 5);
+    return 2;
+}
+
+// 编码结构体并加上长度前缀，长度先占位，编码完成后回填
+// 用法：local frame = context:encodeFrame("RequestPacket", obj)
+static int luatars_encodeFrame(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    int id = luaL_checkinteger(L, 2);  // 结构体id
+    luaL_checktype(L, 3, LUA_TTABLE);  // 对象本身
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);            // 拿到元表
+    luaL_checktype(L, 4, LUA_TTABLE);  // 元表在4号位置
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    wb_addlstr(&B, "\0\0\0\0", TARS_FRAME_HEAD);
+    lua_pushvalue(L, 3);  // 栈顶是要编码的对象
+    encodeStruct(context, L, &B, id, 0, 0, true);
+    if (B.n > _MAX_STR_LEN) {
+        luaL_error(L, "frame too large, sz:%d", (int)B.n);
+    }
+    wb_patch_be32(&B, 0, B.n);
+    wb_pushresult(&B, L);
+
+    return 1;
+}
+
+#define STREAM_MAX_DEPTH 64
+#define STREAM_FRAME_STRUCT 0  // 结构体，读取到结构体结束为止
+#define STREAM_FRAME_COUNT 1   // 数组或字典，读取指定数量的值
+
+// 流式解码器，接收任意切分的数据块，凑齐完整的结构体后立即解码
+// 不带长度前缀时，每个结构体需要用结构体开始和结束包裹
+struct tars_stream {
+    char* s;        // 缓存的数据
+    size_t n;       // 缓存的数据长度
+    size_t cap;     // 缓存的容量
+    size_t offset;  // 已经交付的位置
+    size_t body;    // 当前结构体字段开始的位置
+    size_t scan;    // 扫描到的位置，总是在一个完整单元的边界上
+    uint32_t id;    // 结构体id
+    bool framed;    // 是否带长度前缀
+    int depth;      // 扫描的嵌套深度
+    struct {
+        uint8_t kind;
+        int64_t remaining;
+    } stack[STREAM_MAX_DEPTH];
+};
+
+// 流式解码器元表的id
+static const void* stream_mt = &stream_mt;
+
+static void stream_push(lua_State* L, struct tars_stream* S, uint8_t kind, int64_t remaining)
+{
+    if (S->depth >= STREAM_MAX_DEPTH) {
+        luaL_error(L, "[C] %s %d: nested too deep", __FUNCTION__, __LINE__);
+    }
+    S->stack[S->depth].kind = kind;
+    S->stack[S->depth].remaining = remaining;
+    S->depth += 1;
+}
+
+// 一个值扫描完成
+static inline void stream_value_done(struct tars_stream* S)
+{
+    if (S->depth > 0 && STREAM_FRAME_COUNT == S->stack[S->depth - 1].kind) {
+        S->stack[S->depth - 1].remaining -= 1;
+    }
+}
+
+// 读取数组或字典的长度，数据不足返回false
+static bool stream_length(lua_State* L, struct read_buffer* buffer, int64_t* len)
+{
+    struct tars_header header;
+    int n = read_header(buffer, &header);
+    if (n <= 0) {
+        return false;
+    }
+    size_t sz = 0;
+    switch (header.type) {
+        case TarsHeadeZeroTag: sz = 0; break;
+        case TarsHeadeChar: sz = sizeof(int8_t); break;
+        case TarsHeadeShort: sz = sizeof(int16_t); break;
+        case TarsHeadeInt32: sz = sizeof(int32_t); break;
+        case TarsHeadeInt64: sz = sizeof(int64_t); break;
+        default: {
+            luaL_error(L, "[C] %s %d: invalid length type '%s'", __FUNCTION__, __LINE__, tars_type_name(header.type));
+        }
+    }
+    if (!has_size(buffer, n + sz)) {
+        return false;
+    }
+    skip_buffer(buffer, n);
+    *len = read_int64(L, buffer, def_zero, header, false);
+    if (*len < 0 || *len > _MAX_STR_LEN) {
+        luaL_error(L, "[C] %s %d: invalid length %d", __FUNCTION__, __LINE__, (int)*len);
+    }
+    return true;
+}
+
+// 从上次停下的位置继续扫描，返回是否凑齐了一个结构体
+// 凑齐时结构体的字段在[body, scan)区间
+static bool stream_scan(lua_State* L, struct tars_stream* S)
+{
+    struct read_buffer buffer;
+    buffer.data = S->s, buffer.n = S->n;
+    slice_source(L, &buffer, 0);  // 接收缓存会被覆盖，不能切片
+    if (S->framed) {
+        size_t len = frame_check(L, S->s, S->n, S->offset);
+        if (0 == len) {
+            return false;
+        }
+        S->body = S->offset + TARS_FRAME_HEAD;
+        S->scan = S->offset + len;
+        return true;
+    }
+    for (;;) {
+        if (S->depth > 0 && STREAM_FRAME_COUNT == S->stack[S->depth - 1].kind &&
+            S->stack[S->depth - 1].remaining <= 0) {
+            // 数组或字典的元素都扫描完了
+            S->depth -= 1;
+            stream_value_done(S);
+            continue;
+        }
+        buffer.offset = S->scan;
+        struct tars_header header;
+        int n = read_header(&buffer, &header);
+        if (n <= 0) {
+            return false;
+        }
+        skip_buffer(&buffer, n);
+        if (0 == S->depth) {
+            // 新的结构体开始
+            if (TarsHeadeStructBegin != header.type) {
+                luaL_error(L, "[C] %s %d: require struct begin, got '%s'", __FUNCTION__, __LINE__,
+                           tars_type_name(header.type));
+            }
+            stream_push(L, S, STREAM_FRAME_STRUCT, 0);
+            S->body = S->scan = buffer.offset;
+            continue;
+        }
+        bool nested = false;
+        switch (header.type) {
+            case TarsHeadeStructEnd: {
+                if (STREAM_FRAME_STRUCT != S->stack[S->depth - 1].kind) {
+                    luaL_error(L, "[C] %s %d: unexpected struct end", __FUNCTION__, __LINE__);
+                }
+                S->depth -= 1;
+                if (0 == S->depth) {
+                    S->scan = buffer.offset;
+                    return true;
+                }
+            } break;
+            case TarsHeadeZeroTag: break;
+            case TarsHeadeChar:
+            case TarsHeadeShort:
+            case TarsHeadeInt32:
+            case TarsHeadeInt64:
+            case TarsHeadeFloat:
+            case TarsHeadeDouble: {
+                static const size_t sizes[] = {1, 2, 4, 8, 4, 8};
+                if (!has_size(&buffer, sizes[header.type])) {
+                    return false;
+                }
+                skip_buffer(&buffer, sizes[header.type]);
+            } break;
+            case TarsHeadeString1: {
+                if (!has_size(&buffer, 1) || !has_size(&buffer, 1 + *(const uint8_t*)read_buffer(&buffer, 0))) {
+                    return false;
+                }
+                skip_buffer(&buffer, 1 + *(const uint8_t*)read_buffer(&buffer, 0));
+            } break;
+            case TarsHeadeString4: {
+                if (!has_size(&buffer, sizeof(uint32_t))) {
+                    return false;
+                }
+                uint32_t sz = load_be32(read_buffer(&buffer, 0));
+                if (sz > _MAX_STR_LEN) {
+                    luaL_error(L, "[C] %s %d: string too large %d", __FUNCTION__, __LINE__, (int)sz);
+                }
+                if (!has_size(&buffer, sizeof(uint32_t) + sz)) {
+                    return false;
+                }
+                skip_buffer(&buffer, sizeof(uint32_t) + sz);
+            } break;
+            case TarsHeadeMap:
+            case TarsHeadeList: {
+                int64_t len = 0;
+                if (!stream_length(L, &buffer, &len)) {
+                    return false;
+                }
+                stream_push(L, S, STREAM_FRAME_COUNT, TarsHeadeMap == header.type ? len * 2 : len);
+                nested = true;
+            } break;
+            case TarsHeadeSimpleList: {
+                struct tars_header type_header;
+                int tn = read_header(&buffer, &type_header);
+                if (tn <= 0) {
+                    return false;
+                }
+                if (TarsHeadeChar != type_header.type) {
+                    luaL_error(L, "[C] %s %d: simple list got invalid element type", __FUNCTION__, __LINE__);
+                }
+                skip_buffer(&buffer, tn);
+                int64_t len = 0;
+                if (!stream_length(L, &buffer, &len)) {
+                    return false;
+                }
+                if (!has_size(&buffer, len)) {
+                    return false;
+                }
+                skip_buffer(&buffer, len);
+            } break;
+            case TarsHeadeStructBegin: {
+                stream_push(L, S, STREAM_FRAME_STRUCT, 0);
+                nested = true;
+            } break;
+            default: {
+                luaL_error(L, "[C] %s %d: invalid type = %d '%s'", __FUNCTION__, __LINE__, header.type,
+                           tars_type_name(header.type));
+            }
+        }
+        // 完整的单元扫描完毕，记录位置
+        S->scan = buffer.offset;
+        if (!nested) {
+            stream_value_done(S);
+        }
+    }
+}
+
+// 追加数据，先把已经交付的数据移出缓存
+static void stream_append(lua_State* L, struct tars_stream* S, const char* s, size_t n)
+{
+    if (S->offset > 0) {
+        memmove(S->s, S->s + S->offset, S->n - S->offset);
+        S->n -= S->offset;
+        S->scan -= S->offset;
+        S->body -= S->offset;
+        S->offset = 0;
+    }
+    if (S->cap < S->n + n) {
+        size_t cap = S->cap > 0 ? S->cap : LUAL_BUFFERSIZE;
+        while (cap < S->n + n) {
+            cap = cap * 3 / 2 + 1;
+        }
+        char* p = (char*)realloc(S->s, cap);
+        if (NULL == p) {
+            luaL_error(L, "[C] %s %d: out of memory, require %d", __FUNCTION__, __LINE__, (int)cap);
+        }
+        S->s = p, S->cap = cap;
+    }
+    memcpy(S->s + S->n, s, n);
+    S->n += n;
+}
+
+static void stream_clear(struct tars_stream* S)
+{
+    S->n = S->offset = S->body = S->scan = 0;
+    S->depth = 0;
+}
+
+// 扫描并解码凑齐的结构体，结果写到5号位置的表里，栈的布局和stream_feed一样
+static int stream_run(lua_State* L)
+{
+    struct tars_stream* S = (struct tars_stream*)lua_touserdata(L, 1);
+    struct tars_context* context = check_context(L, 3);
+    for (int i = 1; stream_scan(L, S); ++i) {
+        struct read_buffer buffer;
+        buffer.data = S->s, buffer.n = S->scan, buffer.offset = S->body;
+        slice_source(L, &buffer, 0);
+        // 先交付再解码，解码出错时不会反复解码同一个结构体
+        S->offset = S->scan;
+        decodeStruct(context, L, &buffer, S->id, false, NULL, false);
+        lua_rawseti(L, 5, i);
+    }
+    // 不带长度前缀时，没有凑齐的结构体也不能无限缓存，上限和帧的长度一样
+    if (!S->framed && S->n - S->offset > _MAX_STR_LEN) {
+        luaL_error(L, "[C] %s %d: struct too large, pending %d", __FUNCTION__, __LINE__, (int)(S->n - S->offset));
+    }
+    return 0;
+}
+
+// 输入一块数据，返回已经凑齐并解码的结构体数组
+// 解码出错时停在出错的结构体，返回已经解码的结构体和错误信息，出错的结构体已经交付，剩下的数据留在缓存里
+// 用法：local list, err = decoder:feed(chunk)
+static int stream_feed(lua_State* L)
+{
+    struct tars_stream* S = (struct tars_stream*)check_object(L, 1, stream_mt, "decoder");
+    size_t n = 0;
+    const char* s = check_source(L, 2, &n);
+    lua_settop(L, 2);
+    lua_getuservalue(L, 1);  // 3号位置是上下文
+    check_context(L, 3);
+    lua_getmetatable(L, 3);  // 4号位置是元表
+    lua_newtable(L);         // 5号位置是结果
+
+    stream_append(L, S, s, n);
+    // 已经交付的结构体不能因为后面的出错丢掉，用保护模式解码
+    lua_pushcfunction(L, stream_run);
+    for (int i = 1; i <= 5; ++i) {
+        lua_pushvalue(L, i);
+    }
+    if (LUA_OK != lua_pcall(L, 5, 0, 0)) {
+        lua_pushvalue(L, 5);
+        lua_insert(L, -2);
+        return 2;
+    }
+    lua_settop(L, 5);
+    return 1;
+}
+
+// 还没有交付的数据长度
+static int stream_pending(lua_State* L)
+{
+    struct tars_stream* S = (struct tars_stream*)check_object(L, 1, stream_mt, "decoder");
+    lua_pushinteger(L, S->n - S->offset);
+    return 1;
+}
+
+// 丢弃缓存的数据，保留已经分配的内存
+static int stream_reset(lua_State* L)
+{
+    struct tars_stream* S = (struct tars_stream*)check_object(L, 1, stream_mt, "decoder");
+    stream_clear(S);
+    return 0;
+}
+
+static int stream_gc(lua_State* L)
+{
+    struct tars_stream* S = (struct tars_stream*)lua_touserdata(L, 1);
+    free(S->s);
+    S->s = NULL, S->cap = 0;
+    stream_clear(S);
+    return 0;
+}
+
+// 创建流式解码器
+// 用法：local decoder = context:newDecoder("TBook", true)
+static int luatars_newDecoder(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    bool framed = lua_toboolean(L, 3);
+    check_struct(L, context, id);
+
+    struct tars_stream* S = (struct tars_stream*)lua_newuserdata(L, sizeof(struct tars_stream));
+    memset(S, 0, sizeof(struct tars_stream));
+    S->id = id;
+    S->framed = framed;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, stream_mt), lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1), lua_setuservalue(L, -2);
+    return 1;
+}
+
+static size_t base64_encode_buffer(  // base64编码，定义在后面
+    const uint8_t* src,
+    size_t len,
+    uint8_t* out,
+    bool url);
+
+static ptrdiff_t base64_decode_buffer(  // base64解码，定义在后面
+    const uint8_t* src,
+    size_t len,
+    uint8_t* out,
+    bool url);
+
+// 解码时输出缓存额外预留的字节，向量化的实现会多写入
+#define BASE64_DECODE_SLACK 8
+
+// 写入json字符串，转义引号、反斜杠和控制字符
+static void json_string(struct write_buffer* B, const char* s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    wb_addchar(B, '"');
+    size_t begin = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t c = s[i];
+        if (c >= 0x20 && c != 0x7f && c != '"' && c != '\\') {
+            continue;
+        }
+        wb_addlstr(B, s + begin, i - begin);
+        begin = i + 1;
+        char esc[6] = {'\\', (char)c};
+        switch (c) {
+            case '"':
+            case '\\':
+                break;
+            case '\n':
+                esc[1] = 'n';
+                break;
+            case '\r':
+                esc[1] = 'r';
+                break;
+            case '\t':
+                esc[1] = 't';
+                break;
+            case '\b':
+                esc[1] = 'b';
+                break;
+            case '\f':
+                esc[1] = 'f';
+                break;
+            default: {
+                esc[1] = 'u', esc[2] = '0', esc[3] = '0', esc[4] = hex[c >> 4], esc[5] = hex[c & 0xf];
+                wb_addlstr(B, esc, 6);
+                continue;
+            }
+        }
+        wb_addlstr(B, esc, 2);
+    }
+    wb_addlstr(B, s + begin, n - begin);
+    wb_addchar(B, '"');
+}
+
+// 字节数组写成base64字符串，原始的字节可能不是合法的utf8
+static void json_bytes(struct write_buffer* B, const char* s, size_t n)
+{
+    char* out = wb_reserve(B, (n + 2) / 3 * 4 + 2);
+    out[0] = '"';
+    size_t len = base64_encode_buffer((const uint8_t*)s, n, (uint8_t*)out + 1, false);
+    out[len + 1] = '"';
+    B->n += len + 2;
+}
+
+// 写入基础类型的json，范围检查和decodeStruct一致
+static void json_basic(lua_State* L,
+                       struct write_buffer* B,
+                       struct read_buffer* buffer,
+                       uint8_t type,
+                       struct tars_header header,
+                       bool missing)
+{
+    if (LUATARS_STRING == type) {
+        size_t n = 0;
+        const char* s = missing ? "" : read_lstring(L, buffer, header, &n);
+        json_string(B, s, n);
+        return;
+    }
+    read_basic(L, buffer, type, def_zero, header, missing);
+    if (lua_isboolean(L, -1)) {
+        if (lua_toboolean(L, -1)) {
+            wb_addlstr(B, "true", 4);
+        }
+        else {
+            wb_addlstr(B, "false", 5);
+        }
+    }
+    else {
+        char b[32];
+        int sz = snprintf(b, sizeof b, "%" PRId64, (int64_t)lua_tointeger(L, -1));
+        wb_addlstr(B, b, sz);
+    }
+    lua_pop(L, 1);
+}
+
+// 写入字段名称，4号位置是元表
+static void json_name(lua_State* L, struct write_buffer* B, size_t index, bool* first)
+{
+    if (!*first) {
+        wb_addlstr(B, ", ", 2);
+    }
+    *first = false;
+    size_t n = 0;
+    lua_geti(L, 4, index);
+    const char* name = lua_tolstring(L, -1, &n);
+    if (NULL == name) {
+        luaL_error(L, "field name not found for index = %d", (int)index);
+    }
+    json_string(B, name, n);
+    lua_pop(L, 1);
+    wb_addlstr(B, ": ", 2);
+}
+
+static int jsonStruct(  // 结构体转换成json
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    struct read_buffer* buffer,
+    uint32_t id,
+    bool missing,
+    bool ordered);
+
+static void jsonValue(  // 数组元素或字典的值转换成json，头部已经读取
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    struct read_buffer* buffer,
+    uint32_t value_type,
+    struct tars_header header,
+    bool ordered)
+{
+    if (value_type < LUATARS_TYPE_MAX) {
+        json_basic(L, B, buffer, value_type, header, false);
+        return;
+    }
+    if (TarsHeadeStructBegin != header.type) {
+        luaL_error(L, "[C] %s %d: invalid value, require 'struct', got '%s'", __FUNCTION__, __LINE__,
+                   tars_type_name(header.type));
+    }
+    jsonStruct(context, L, B, buffer, value_type, false, ordered);
+}
+
+// 读取数组或字典的长度，头部已经读取
+static int64_t json_length(lua_State* L, struct read_buffer* buffer, bool missing)
+{
+    if (missing) {
+        return 0;
+    }
+    struct tars_header header;
+    if (readHeader(L, buffer, &header, 0)) {
+        luaL_error(L, "[C] %s %d: got no length, (%d/%d)", __FUNCTION__, __LINE__, buffer->offset, buffer->n);
+    }
+    int64_t len = read_int64(L, buffer, def_zero, header, false);
+    if (len < 0 || len > _MAX_STR_LEN) {
+        luaL_error(L, "[C] %s %d: invalid length %d", __FUNCTION__, __LINE__, (int)len);
+    }
+    return len;
+}
+
+static void jsonField(  // 字段转换成json，头部已经读取，和decodeField的分派一致
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    struct read_buffer* buffer,
+    struct tars_field* field,
+    struct tars_header header,
+    bool missing,
+    bool ordered)
+{
+    if (field->type1 <= LUATARS_STRING) {
+        json_basic(L, B, buffer, field->type1, header, missing);
+    }
+    else if (field->type1 == LUATARS_MAP) {
+        if (!missing && TarsHeadeMap != header.type) {
+            luaL_error(L, "[C] %s %d: invalid field, require 'map', got '%s', tag = %d", __FUNCTION__, __LINE__,
+                       tars_type_name(header.type), field->tag);
+        }
+        wb_addchar(B, '{');
+        for (int64_t i = 0, n = json_length(L, buffer, missing); i < n; ++i) {
+            if (i > 0) {
+                wb_addlstr(B, ", ", 2);
+            }
+            if (readHeader(L, buffer, &header, 0)) {
+                luaL_error(L, "[C] %s %d: map got no key", __FUNCTION__, __LINE__);
+            }
+            // json的键只能是字符串
+            if (LUATARS_STRING != field->type2) {
+                wb_addchar(B, '"');
+                json_basic(L, B, buffer, field->type2, header, false);
+                wb_addchar(B, '"');
+            }
+            else {
+                json_basic(L, B, buffer, field->type2, header, false);
+            }
+            wb_addlstr(B, ": ", 2);
+            if (readHeader(L, buffer, &header, 1)) {
+                luaL_error(L, "[C] %s %d: map got no value, (%d/%d)", __FUNCTION__, __LINE__, (int)i, (int)n);
+            }
+            jsonValue(context, L, B, buffer, field->type3, header, ordered);
+        }
+        wb_addchar(B, '}');
+    }
+    else if (field->type1 == LUATARS_LIST && field->type2 == LUATARS_INT8) {
+        if (!missing && TarsHeadeSimpleList == header.type) {
+            size_t n = 0;
+            const char* s = read_simple_list(L, buffer, &n);
+            json_bytes(B, s, n);
+        }
+        else if (!missing && TarsHeadeList == header.type) {
+            // 按普通数组写入的字节
+            decodeSimpleList(L, buffer, header.type, false);
+            size_t n = 0;
+            const char* s = lua_tolstring(L, -1, &n);
+            json_bytes(B, s, n);
+            lua_pop(L, 1);
+        }
+        else if (missing) {
+            json_bytes(B, "", 0);
+        }
+        else {
+            luaL_error(L, "[C] %s %d: invalid field, require 'simple list', got '%s', tag = %d", __FUNCTION__,
+                       __LINE__, tars_type_name(header.type), field->tag);
+        }
+    }
+    else if (field->type1 == LUATARS_LIST) {
+        if (!missing && TarsHeadeList != header.type) {
+            luaL_error(L, "[C] %s %d: invalid field, require 'list', got '%s', tag = %d", __FUNCTION__, __LINE__,
+                       tars_type_name(header.type), field->tag);
+        }
+        wb_addchar(B, '[');
+        for (int64_t i = 0, n = json_length(L, buffer, missing); i < n; ++i) {
+            if (i > 0) {
+                wb_addlstr(B, ", ", 2);
+            }
+            if (readHeader(L, buffer, &header, 0)) {
+                luaL_error(L, "[C] %s %d: list element not found, index = %d, n = %d", __FUNCTION__, __LINE__,
+                           (int)i, (int)n);
+            }
+            jsonValue(context, L, B, buffer, field->type2, header, ordered);
+        }
+        wb_addchar(B, ']');
+    }
+    else {
+        if (!missing && TarsHeadeStructBegin != header.type) {
+            luaL_error(L, "[C] %s %d: invalid field, require 'struct', got '%s', tag = %d", __FUNCTION__, __LINE__,
+                       tars_type_name(header.type), field->tag);
+        }
+        jsonStruct(context, L, B, buffer, field->type1, missing, ordered);
+    }
+}
+
+int jsonStruct(  // 结构体转换成json，ordered为false时按数据中的顺序输出，为true时按字段声明的顺序输出
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    struct read_buffer* buffer,
+    uint32_t id,
+    bool missing,
+    bool ordered)
+{
+    struct tars_struct* st = check_struct(L, context, id);
+    struct tars_field* fields = context->fields + st->first;
+    uint8_t seen[256 / 8];
+    memset(seen, 0, sizeof seen);
+    bool first = true;
+    wb_addchar(B, '{');
+    if (ordered) {
+        // 先扫描一遍记录每个字段的位置，再按声明的顺序输出
+        size_t offsets[STRUCT_NO_FIELD];
+        size_t offset = buffer->offset;
+        for (struct tars_header header; !missing && !readHeader(L, buffer, &header, -1); offset = buffer->offset) {
+            uint8_t index = st->index[header.tag];
+            if (STRUCT_NO_FIELD != index && !(seen[index >> 3] & (1u << (index & 7)))) {
+                offsets[index] = offset;
+                seen[index >> 3] |= 1u << (index & 7);
+            }
+            skipValue(L, buffer, header);
+        }
+        size_t end = buffer->offset;
+        struct tars_header none = {0, 0};
+        for (uint32_t index = 0; index < st->n; ++index) {
+            json_name(L, B, st->first + index, &first);
+            if (seen[index >> 3] & (1u << (index & 7))) {
+                struct tars_header header;
+                buffer->offset = offsets[index];
+                readHeader(L, buffer, &header, -1);
+                jsonField(context, L, B, buffer, fields + index, header, false, ordered);
+            }
+            else {
+                jsonField(context, L, B, buffer, fields + index, none, true, ordered);
+            }
+        }
+        buffer->offset = end;
+        wb_addchar(B, '}');
+        return 1;
+    }
+    // 此处头部已经读取，读取到结构体结束或者数据结束就结束
+    for (struct tars_header header; !missing && !readHeader(L, buffer, &header, -1);) {
+        uint8_t index = st->index[header.tag];
+        if (STRUCT_NO_FIELD == index || (seen[index >> 3] & (1u << (index & 7)))) {
+            skipValue(L, buffer, header);
+            continue;
+        }
+        json_name(L, B, st->first + index, &first);
+        jsonField(context, L, B, buffer, fields + index, header, false, ordered);
+        seen[index >> 3] |= 1u << (index & 7);
+    }
+    // 缺失的字段使用默认值
+    struct tars_header none = {0, 0};
+    for (uint32_t index = 0; index < st->n; ++index) {
+        if (seen[index >> 3] & (1u << (index & 7))) {
+            continue;
+        }
+        json_name(L, B, st->first + index, &first);
+        jsonField(context, L, B, buffer, fields + index, none, true, ordered);
+    }
+    wb_addchar(B, '}');
+    return 1;
+}
+
+// 直接把二进制流转换成json，不产生中间的lua表
+// ordered为true时按字段声明的顺序输出，否则按数据中的顺序输出，vector<byte>输出成base64字符串
+// 用法：tars.structToJson(context, id, data, ordered)
+static int luatars_structToJson(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    size_t n = 0;
+    const char* s = check_source(L, 3, &n);
+    bool ordered = lua_toboolean(L, 4);
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);  // 4号位置是元表
+
+    struct read_buffer buffer;
+    buffer.n = n, buffer.offset = 0, buffer.data = s;
+    slice_source(L, &buffer, 0);
+    struct write_buffer B;
+    wb_init(&B, L);
+    jsonStruct(context, L, &B, &buffer, id, false, ordered);
+    wb_pushresult(&B, L);
+
+    return 1;
+}
+
+#define JSON_MAX_DEPTH 64
+
+// json的读取位置，字符串以'\0'结尾
+struct json_reader {
+    const char* s;
+    size_t n;
+    size_t pos;
+};
+
+#define json_error(L, R, Msg) \
+    luaL_error(L, "[C] %s %d: json " Msg " at %d", __FUNCTION__, __LINE__, (int)(R)->pos)
+
+// 跳过空白，返回下一个字符，到达结尾返回'\0'
+static inline char json_peek(struct json_reader* R)
+{
+    while (R->pos < R->n) {
+        char c = R->s[R->pos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            return c;
+        }
+        ++R->pos;
+    }
+    return '\0';
+}
+
+static inline void json_expect(lua_State* L, struct json_reader* R, char c)
+{
+    if (json_peek(R) != c) {
+        luaL_error(L, "[C] %s %d: json expect '%c' at %d", __FUNCTION__, __LINE__, c, (int)R->pos);
+    }
+    ++R->pos;
+}
+
+// 读取逗号或者结束符，返回是否还有下一个元素
+static inline bool json_next(lua_State* L, struct json_reader* R, char end)
+{
+    char c = json_peek(R);
+    if (',' == c) {
+        ++R->pos;
+        return true;
+    }
+    if (end != c) {
+        luaL_error(L, "[C] %s %d: json expect ',' or '%c' at %d", __FUNCTION__, __LINE__, end, (int)R->pos);
+    }
+    ++R->pos;
+    return false;
+}
+
+static void json_literal(lua_State* L, struct json_reader* R, const char* word, size_t len)
+{
+    if (R->n - R->pos < len || memcmp(R->s + R->pos, word, len) != 0) {
+        json_error(L, R, "invalid literal");
+    }
+    R->pos += len;
+}
+
+// 读取字符串，返回引号之间的原始内容，escaped表示是否有转义
+static const char* json_string_span(lua_State* L, struct json_reader* R, size_t* len, bool* escaped)
+{
+    json_expect(L, R, '"');
+    const char* s = R->s + R->pos;
+    *escaped = false;
+    for (size_t i = R->pos; i < R->n; ++i) {
+        char c = R->s[i];
+        if ('"' == c) {
+            *len = i - R->pos;
+            R->pos = i + 1;
+            return s;
+        }
+        if ('\\' == c) {
+            *escaped = true;
+            ++i;
+        }
+    }
+    json_error(L, R, "unterminated string");
+    return NULL;
+}
+
+// 读取数字，返回原始内容，integer表示是否是整数
+static const char* json_number_span(lua_State* L, struct json_reader* R, size_t* len, bool* integer)
+{
+    const char* s = R->s + R->pos;
+    size_t i = R->pos;
+    *integer = true;
+    for (; i < R->n; ++i) {
+        char c = R->s[i];
+        if ('.' == c || 'e' == c || 'E' == c) {
+            *integer = false;
+        }
+        else if (!(c >= '0' && c <= '9') && '-' != c && '+' != c) {
+            break;
+        }
+    }
+    if (i == R->pos) {
+        json_error(L, R, "unexpected character");
+    }
+    *len = i - R->pos;
+    R->pos = i;
+    return s;
+}
+
+static uint32_t json_hex4(lua_State* L, const char* s, size_t i, size_t n)
+{
+    uint32_t v = 0;
+    if (n - i < 4) {
+        luaL_error(L, "[C] %s %d: json invalid unicode escape", __FUNCTION__, __LINE__);
+    }
+    for (size_t k = i; k < i + 4; ++k) {
+        char c = s[k];
+        v <<= 4;
+        if (c >= '0' && c <= '9') {
+            v |= c - '0';
+        }
+        else if (c >= 'a' && c <= 'f') {
+            v |= c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F') {
+            v |= c - 'A' + 10;
+        }
+        else {
+            luaL_error(L, "[C] %s %d: json invalid unicode escape", __FUNCTION__, __LINE__);
+        }
+    }
+    return v;
+}
+
+// 去掉转义，out为NULL时只计算长度，返回去掉转义后的长度
+static size_t json_unescape(lua_State* L, const char* s, size_t n, char* out)
+{
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        char c = s[i];
+        if ('\\' != c) {
+            if (out) {
+                out[k] = c;
+            }
+            ++k;
+            continue;
+        }
+        c = s[++i];
+        switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'u': {
+                uint32_t cp = json_hex4(L, s, i + 1, n);
+                i += 4;
+                // 代理对
+                if (cp >= 0xD800 && cp <= 0xDBFF && n - i > 6 && '\\' == s[i + 1] && 'u' == s[i + 2]) {
+                    uint32_t lo = json_hex4(L, s, i + 3, n);
+                    if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        i += 6;
+                    }
+                }
+                char u[4];
+                size_t m = 0;
+                if (cp < 0x80) {
+                    u[m++] = cp;
+                }
+                else if (cp < 0x800) {
+                    u[m++] = 0xC0 | (cp >> 6);
+                    u[m++] = 0x80 | (cp & 0x3F);
+                }
+                else if (cp < 0x10000) {
+                    u[m++] = 0xE0 | (cp >> 12);
+                    u[m++] = 0x80 | ((cp >> 6) & 0x3F);
+                    u[m++] = 0x80 | (cp & 0x3F);
+                }
+                else {
+                    u[m++] = 0xF0 | (cp >> 18);
+                    u[m++] = 0x80 | ((cp >> 12) & 0x3F);
+                    u[m++] = 0x80 | ((cp >> 6) & 0x3F);
+                    u[m++] = 0x80 | (cp & 0x3F);
+                }
+                if (out) {
+                    memcpy(out + k, u, m);
+                }
+                k += m;
+                continue;
+            }
+            default: {
+                luaL_error(L, "[C] %s %d: json invalid escape '\\%c'", __FUNCTION__, __LINE__, c);
+            }
+        }
+        if (out) {
+            out[k] = c;
+        }
+        ++k;
+    }
+    return k;
+}
+
+// 把json字符串写成tars字符串，没有转义时直接复制
+static void json_write_string(lua_State* L, struct write_buffer* B, uint8_t tag, const char* s, size_t n, bool escaped)
+{
+    size_t sz = escaped ? json_unescape(L, s, n, NULL) : n;
+    if (sz > _MAX_STR_LEN) {
+        luaL_error(L, "string size too large, tag:%d, sz:%d", tag, (int)sz);
+    }
+    write_string_header(B, tag, sz);
+    char* out = wb_reserve(B, sz);
+    if (escaped) {
+        json_unescape(L, s, n, out);
+    }
+    else {
+        memcpy(out, s, n);
+    }
+    B->n += sz;
+}
+
+// 把json字符串放到栈顶
+static void json_push_string(lua_State* L, const char* s, size_t n, bool escaped)
+{
+    if (!escaped) {
+        lua_pushlstring(L, s, n);
+        return;
+    }
+    luaL_Buffer b;
+    size_t sz = json_unescape(L, s, n, NULL);
+    char* out = luaL_buffinitsize(L, &b, sz);
+    json_unescape(L, s, n, out);
+    luaL_pushresultsize(&b, sz);
+}
+
+// 把json数字放到栈顶
+static void json_push_number(lua_State* L, const char* s, size_t n, bool integer)
+{
+    char* end = NULL;
+    errno = 0;
+    if (integer) {
+        long long v = strtoll(s, &end, 10);
+        if (ERANGE == errno) {
+            luaL_error(L, "[C] %s %d: json integer overflow '%s'", __FUNCTION__, __LINE__,
+                       lua_pushlstring(L, s, n));
+        }
+        lua_pushinteger(L, v);
+    }
+    else {
+        lua_pushnumber(L, strtod(s, &end));
+    }
+    if (end != s + n) {
+        luaL_error(L, "[C] %s %d: json invalid number '%s'", __FUNCTION__, __LINE__, lua_pushlstring(L, s, n));
+    }
+}
+
+static void json_skip(lua_State* L, struct json_reader* R, int depth)
+{
+    if (depth > JSON_MAX_DEPTH) {
+        json_error(L, R, "too deep");
+    }
+    size_t n = 0;
+    bool flag = false;
+    switch (json_peek(R)) {
+        case '"': {
+            json_string_span(L, R, &n, &flag);
+        } break;
+        case '{': {
+            ++R->pos;
+            if ('}' == json_peek(R)) {
+                ++R->pos;
+                break;
+            }
+            do {
+                json_string_span(L, R, &n, &flag);
+                json_expect(L, R, ':');
+                json_skip(L, R, depth + 1);
+            } while (json_next(L, R, '}'));
+        } break;
+        case '[': {
+            ++R->pos;
+            if (']' == json_peek(R)) {
+                ++R->pos;
+                break;
+            }
+            do {
+                json_skip(L, R, depth + 1);
+            } while (json_next(L, R, ']'));
+        } break;
+        case 't': {
+            json_literal(L, R, "true", 4);
+        } break;
+        case 'f': {
+            json_literal(L, R, "false", 5);
+        } break;
+        case 'n': {
+            json_literal(L, R, "null", 4);
+        } break;
+        default: {
+            json_number_span(L, R, &n, &flag);
+        }
+    }
+}
+
+// 读取一个基础类型的值，通过write_basic写入，复用它的范围检查
+static void jsonToBasic(lua_State* L,
+                        struct write_buffer* B,
+                        struct json_reader* R,
+                        uint8_t tag,
+                        uint32_t type,
+                        bool forced,
+                        union default_value def)
+{
+    size_t n = 0;
+    bool flag = false;
+    switch (json_peek(R)) {
+        case '"': {
+            const char* s = json_string_span(L, R, &n, &flag);
+            if (LUATARS_STRING == type) {
+                json_write_string(L, B, tag, s, n, flag);
+                return;
+            }
+            json_push_string(L, s, n, flag);
+        } break;
+        case 't': {
+            json_literal(L, R, "true", 4);
+            lua_pushboolean(L, 1);
+        } break;
+        case 'f': {
+            json_literal(L, R, "false", 5);
+            lua_pushboolean(L, 0);
+        } break;
+        case 'n': {
+            json_literal(L, R, "null", 4);
+            lua_pushnil(L);
+        } break;
+        case '{':
+        case '[': {
+            json_error(L, R, "require a basic value");
+        } break;
+        default: {
+            const char* s = json_number_span(L, R, &n, &flag);
+            if (LUATARS_STRING == type) {
+                write_string(B, tag, s, n);  // 字符串字段按原样保存数字
+                return;
+            }
+            json_push_number(L, s, n, flag);
+        }
+    }
+    write_basic(L, B, tag, type, forced, def);
+    lua_pop(L, 1);
+}
+
+static void jsonToStruct(  // json对象编码成结构体，不包括结构体的头部和结束标志
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    struct json_reader* R,
+    uint32_t id,
+    int depth);
+
+// 读取结构体的值，可以是null
+static void jsonToStructValue(struct tars_context* context,
+                              lua_State* L,
+                              struct write_buffer* B,
+                              struct json_reader* R,
+                              uint32_t id,
+                              uint8_t tag,
+                              bool forced,
+                              int depth)
+{
+    if ('n' == json_peek(R)) {
+        json_literal(L, R, "null", 4);
+        lua_pushnil(L);
+        encodeStruct(context, L, B, id, tag, forced, false);
+        lua_pop(L, 1);
+        return;
+    }
+    write_header(B, tag, TarsHeadeStructBegin);
+    jsonToStruct(context, L, B, R, id, depth + 1);
+    write_header(B, 0, TarsHeadeStructEnd);
+}
+
+// 读取数组或字典的元素，长度写成固定的4个字节，读取完成后回填
+static void jsonToContainer(struct tars_context* context,
+                            lua_State* L,
+                            struct write_buffer* B,
+                            struct json_reader* R,
+                            struct tars_field* field,
+                            int depth)
+{
+    bool map = LUATARS_MAP == field->type1;
+    bool bytes = !map && LUATARS_INT8 == field->type2;
+    size_t start = B->n, pos = 0;
+    int64_t count = 0;
+    if (bytes) {
+        pos = write_simple_list_begin(B, field->tag);
+    }
+    else {
+        write_header(B, field->tag, map ? TarsHeadeMap : TarsHeadeList);
+        write_header(B, 0, TarsHeadeInt32);
+        pos = B->n;
+        wb_addlstr(B, "\0\0\0\0", sizeof(uint32_t));
+    }
+    json_expect(L, R, map ? '{' : '[');
+    if (json_peek(R) == (map ? '}' : ']')) {
+        ++R->pos;
+    }
+    else {
+        do {
+            if (map) {
+                size_t n = 0;
+                bool escaped = false;
+                const char* s = json_string_span(L, R, &n, &escaped);
+                if (LUATARS_STRING == field->type2) {
+                    json_write_string(L, B, 0, s, n, escaped);
+                }
+                else {
+                    // json的键只能是字符串，转换成整数
+                    json_push_string(L, s, n, escaped);
+                    write_basic(L, B, 0, field->type2, true, def_zero);
+                    lua_pop(L, 1);
+                }
+                json_expect(L, R, ':');
+            }
+            uint32_t value_type = map ? field->type3 : field->type2;
+            uint8_t tag = map ? 1 : 0;
+            if (bytes) {
+                size_t n = 0;
+                bool integer = false;
+                const char* s = json_number_span(L, R, &n, &integer);
+                json_push_number(L, s, n, integer);
+                int isnum = 0;
+                lua_Integer v = lua_tointegerx(L, -1, &isnum);
+                if (!isnum || v < INT8_MIN || v > UINT8_MAX) {
+                    luaL_error(L, "tag %d byte overflow, got '%s'", field->tag, lua_tostring(L, -1));
+                }
+                wb_addchar(B, (char)v);
+                lua_pop(L, 1);
+            }
+            else if (value_type < LUATARS_TYPE_MAX) {
+                jsonToBasic(L, B, R, tag, value_type, true, def_zero);
+            }
+            else {
+                jsonToStructValue(context, L, B, R, value_type, tag, true, depth);
+            }
+            ++count;
+        } while (json_next(L, R, map ? '}' : ']'));
+    }
+    if (count < 1 && !field->forced) {
+        B->n = start;  // 不用强制写空的容器
+    }
+    else if (bytes) {
+        write_simple_list_end(L, B, pos);
+    }
+    else {
+        wb_patch_be32(B, pos, count);
+    }
+}
+
+// 按字段类型分派，和encodeField一致
+static void jsonToField(struct tars_context* context,
+                        lua_State* L,
+                        struct write_buffer* B,
+                        struct json_reader* R,
+                        struct tars_field* field,
+                        int depth)
+{
+    char c = json_peek(R);
+    if ('n' == c) {
+        // null和字段缺失一样处理
+        json_literal(L, R, "null", 4);
+        lua_pushnil(L);
+        encodeField(context, L, B, field);
+        lua_pop(L, 1);
+    }
+    else if (LUATARS_LIST == field->type1 && LUATARS_INT8 == field->type2 && '"' == c) {
+        // 字节数组也可以是base64字符串，和toJson的输出一致
+        size_t n = 0;
+        bool escaped = false;
+        const char* s = json_string_span(L, R, &n, &escaped);
+        json_push_string(L, s, n, escaped);
+        s = lua_tolstring(L, -1, &n);
+        luaL_Buffer b;
+        uint8_t* out = (uint8_t*)luaL_buffinitsize(L, &b, n / 4 * 3 + BASE64_DECODE_SLACK);
+        ptrdiff_t len = base64_decode_buffer((const uint8_t*)s, n, out, false);
+        if (len < 0) {
+            json_error(L, R, "invalid base64 bytes");
+        }
+        luaL_pushresultsize(&b, len);
+        encodeSimpleList(L, B, field->tag, field->forced, false);
+        lua_pop(L, 2);
+    }
+    else if (LUATARS_MAP == field->type1 || LUATARS_LIST == field->type1) {
+        jsonToContainer(context, L, B, R, field, depth + 1);
+    }
+    else if (field->type1 < LUATARS_TYPE_MAX) {
+        jsonToBasic(L, B, R, field->tag, field->type1, field->forced, field->def);
+    }
+    else {
+        jsonToStructValue(context, L, B, R, field->type1, field->tag, field->forced, depth);
+    }
+}
+
+void jsonToStruct(  // json对象编码成结构体，字段可以是任意顺序，编码后按序号升序重排
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    struct json_reader* R,
+    uint32_t id,
+    int depth)
+{
+    if (depth > JSON_MAX_DEPTH) {
+        json_error(L, R, "too deep");
+    }
+    struct tars_struct* st = check_struct(L, context, id);
+    struct tars_field* fields = context->fields + st->first;
+    // 每个字段编码后的开始位置，按编码的顺序
+    uint32_t offsets[STRUCT_NO_FIELD + 1];
+    uint8_t order[STRUCT_NO_FIELD];
+    uint8_t seen[256 / 8];
+    memset(seen, 0, sizeof seen);
+    size_t start = B->n;
+    uint32_t k = 0, hint = 0;
+
+    json_expect(L, R, '{');
+    if ('}' == json_peek(R)) {
+        ++R->pos;
+    }
+    else {
+        do {
+            size_t n = 0;
+            bool escaped = false;
+            const char* name = json_string_span(L, R, &n, &escaped);
+            char unescaped[256];
+            if (escaped && n <= sizeof unescaped) {
+                n = json_unescape(L, name, n, unescaped);
+                name = unescaped;
+            }
+            json_expect(L, R, ':');
+            // 通常按声明的顺序出现，从上一个字段之后开始查找
+            uint32_t index = STRUCT_NO_FIELD;
+            for (uint32_t i = 0; i < st->n; ++i) {
+                uint32_t j = (hint + i) % st->n;
+                size_t sz = 0;
+                lua_geti(L, 4, st->first + j);
+                const char* s = lua_tolstring(L, -1, &sz);
+                bool found = NULL != s && sz == n && 0 == memcmp(s, name, n);
+                lua_pop(L, 1);
+                if (found) {
+                    index = j, hint = j + 1;
+                    break;
+                }
+            }
+            // 不认识的字段和重复的字段跳过
+            if (STRUCT_NO_FIELD == index || (seen[index >> 3] & (1u << (index & 7)))) {
+                json_skip(L, R, depth + 1);
+                continue;
+            }
+            seen[index >> 3] |= 1u << (index & 7);
+            offsets[k] = B->n - start, order[k++] = index;
+            jsonToField(context, L, B, R, fields + index, depth);
+        } while (json_next(L, R, '}'));
+    }
+    // 缺失的字段和encodeStruct一样处理，强制写入的字段写入默认值
+    for (uint32_t index = 0; index < st->n; ++index) {
+        if (seen[index >> 3] & (1u << (index & 7))) {
+            continue;
+        }
+        offsets[k] = B->n - start, order[k++] = index;
+        lua_pushnil(L);
+        encodeField(context, L, B, fields + index);
+        lua_pop(L, 1);
+    }
+    offsets[k] = B->n - start;
+
+    // 检查编码后的字段是否已经按序号升序
+    bool sorted = true;
+    for (uint32_t i = 0, last = 0; i < k && sorted; ++i) {
+        if (offsets[i + 1] > offsets[i]) {
+            sorted = fields[order[i]].tag >= last;
+            last = fields[order[i]].tag;
+        }
+    }
+    if (sorted) {
+        return;
+    }
+    // 把编码结果复制到缓存的后面，再按序号升序写回
+    size_t len = B->n - start;
+    char* copy = wb_reserve(B, len);
+    memcpy(copy, B->s + start, len);
+    // 按序号稳定排序，序号相同的字段保持编码的顺序
+    uint8_t spans[STRUCT_NO_FIELD];
+    for (uint32_t i = 0; i < k; ++i) {
+        uint32_t j = i;
+        for (; j > 0 && fields[order[spans[j - 1]]].tag > fields[order[i]].tag; --j) {
+            spans[j] = spans[j - 1];
+        }
+        spans[j] = i;
+    }
+    char* out = B->s + start;
+    for (uint32_t i = 0; i < k; ++i) {
+        uint32_t sz = offsets[spans[i] + 1] - offsets[spans[i]];
+        memcpy(out, copy + offsets[spans[i]], sz);
+        out += sz;
+    }
+}
+
+// 把json直接编码成结构体，不产生中间的lua表
+// vector<byte>可以是base64字符串，和structToJson的输出一致，也可以是数字数组
+// 用法：tars.fromJson(context, id, json)
+static int luatars_fromJson(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    struct json_reader R;
+    R.s = luaL_checklstring(L, 3, &R.n);
+    R.pos = 0;
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);  // 4号位置是元表
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    jsonToStruct(context, L, &B, &R, id, 0);
+    if (json_peek(&R) != '\0') {
+        json_error(L, &R, "unexpected trailing characters");
+    }
+    wb_pushresult(&B, L);
+
+    return 1;
+}
+
+#define IDL_MAX_INCLUDE 32
+#define IDL_MAX_NAME 256
+
+// IDL的词法位置，每个文件一个
+struct idl_lexer {
+    const char* s;
+    size_t n;
+    size_t pos;
+    int line;
+    const char* file;  // 文件路径，直接解析字符串时为NULL
+};
+
+// IDL解析的状态，字段先收集到4号位置的用户数据里，解析完成后一次性创建上下文
+// 栈上的位置：2 元表，4 字段数组，5 常量和枚举值，6 已包含的文件，7 字符串默认值，8 枚举类型
+struct idl_field {
+    struct tars_field field;
+    bool first;  // 是否结构体的第一个字段
+};
+
+struct idl_state {
+    lua_State* L;
+    struct idl_field* fields;
+    size_t n;
+    size_t cap;
+    size_t nstruct;
+    int includes;                // 包含文件的嵌套深度
+    char module[IDL_MAX_NAME];  // 当前模块，嵌套模块用::连接
+    size_t nmodule;
+};
+
+#define idl_error(L, X, Msg, ...)                                                                            \
+    luaL_error(L, "[C] %s %d: %s:%d: " Msg, __FUNCTION__, __LINE__, (X)->file ? (X)->file : "<string>", (X)->line, \
+               ##__VA_ARGS__)
+
+// 基础类型的名称，unsigned X按u_X查找
+static const struct {
+    const char* name;
+    uint32_t type;
+} idl_basic_types[] = {
+    {"bool", LUATARS_BOOL},      {"byte", LUATARS_INT8},     {"u_byte", LUATARS_UINT8},  {"short", LUATARS_INT16},
+    {"u_short", LUATARS_UINT16}, {"int", LUATARS_INT32},     {"u_int", LUATARS_UINT32},  {"long", LUATARS_INT64},
+    {"u_long", LUATARS_INT64},   {"float", LUATARS_FLOAT},   {"double", LUATARS_DOUBLE}, {"string", LUATARS_STRING},
+    {NULL, 0},
+};
+
+static inline bool idl_is(const char* tok, size_t len, const char* word)
+{
+    return strlen(word) == len && 0 == memcmp(tok, word, len);
+}
+
+static inline bool idl_ident_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || '_' == c;
+}
+
+// 读取下一个记号，返回记号的种类：'a' 标识符，'0' 数字，'"' 字符串(不含引号)，'\0' 结束，其他是单个符号
+static char idl_next(lua_State* L, struct idl_lexer* X, const char** tok, size_t* len)
+{
+    const char* s = X->s;
+    size_t i = X->pos;
+    for (;;) {
+        if (i >= X->n) {
+            X->pos = i;
+            *tok = s + i, *len = 0;
+            return '\0';
+        }
+        char c = s[i];
+        if ('\n' == c) {
+            ++X->line, ++i;
+        }
+        else if (' ' == c || '\t' == c || '\r' == c || '\f' == c || '\v' == c) {
+            ++i;
+        }
+        else if ('/' == c && i + 1 < X->n && '/' == s[i + 1]) {
+            // 行注释
+            while (i < X->n && '\n' != s[i]) {
+                ++i;
+            }
+        }
+        else if ('/' == c && i + 1 < X->n && '*' == s[i + 1]) {
+            // 块注释
+            for (i += 2;; ++i) {
+                if (i + 1 >= X->n) {
+                    X->pos = i;
+                    idl_error(L, X, "unterminated comment");
+                }
+                if ('\n' == s[i]) {
+                    ++X->line;
+                }
+                else if ('*' == s[i] && '/' == s[i + 1]) {
+                    i += 2;
+                    break;
+                }
+            }
+        }
+        else {
+            break;
+        }
+    }
+
+    size_t start = i;
+    char c = s[i];
+    char kind = c;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || '_' == c) {
+        // 标识符，可以带模块限定
+        kind = 'a';
+        while (i < X->n && (idl_ident_char(s[i]) || (':' == s[i] && i + 1 < X->n && ':' == s[i + 1]))) {
+            i += ':' == s[i] ? 2 : 1;
+        }
+    }
+    else if ((c >= '0' && c <= '9') || (('-' == c || '+' == c || '.' == c) && i + 1 < X->n &&
+                                          ((s[i + 1] >= '0' && s[i + 1] <= '9') || '.' == s[i + 1]))) {
+        // 数字，具体格式交给lua转换
+        kind = '0';
+        for (++i; i < X->n; ++i) {
+            char d = s[i];
+            if (('-' == d || '+' == d) && ('e' == s[i - 1] || 'E' == s[i - 1]) &&
+                !(i - start > 1 && ('x' == s[start + 1] || 'X' == s[start + 1]))) {
+                continue;
+            }
+            if (!idl_ident_char(d) && '.' != d) {
+                break;
+            }
+        }
+    }
+    else if ('"' == c) {
+        // 字符串，返回引号之间的内容
+        for (++i;; ++i) {
+            if (i >= X->n || '\n' == s[i]) {
+                X->pos = i;
+                idl_error(L, X, "unterminated string");
+            }
+            if ('\\' == s[i]) {
+                ++i;
+            }
+            else if ('"' == s[i]) {
+                break;
+            }
+        }
+        X->pos = i + 1;
+        *tok = s + start + 1, *len = i - start - 1;
+        return '"';
+    }
+    else {
+        ++i;
+    }
+    X->pos = i;
+    *tok = s + start, *len = i - start;
+    return kind;
+}
+
+// 查看下一个记号但不读取
+static inline char idl_peek(lua_State* L, struct idl_lexer* X)
+{
+    struct idl_lexer Y = *X;
+    const char* tok = NULL;
+    size_t len = 0;
+    return idl_next(L, &Y, &tok, &len);
+}
+
+static void idl_expect(lua_State* L, struct idl_lexer* X, char c)
+{
+    const char* tok = NULL;
+    size_t len = 0;
+    if (idl_next(L, X, &tok, &len) != c) {
+        idl_error(L, X, "expect '%c' near '%s'", c, lua_pushlstring(L, tok, len));
+    }
+}
+
+// 结束符后面的分号可以省略
+static inline void idl_optional_semicolon(lua_State* L, struct idl_lexer* X)
+{
+    if (';' == idl_peek(L, X)) {
+        idl_expect(L, X, ';');
+    }
+}
+
+static const char* idl_name(lua_State* L, struct idl_lexer* X, size_t* len)
+{
+    const char* tok = NULL;
+    if (idl_next(L, X, &tok, len) != 'a') {
+        idl_error(L, X, "expect a name near '%s'", lua_pushlstring(L, tok, *len));
+    }
+    if (*len >= IDL_MAX_NAME) {
+        idl_error(L, X, "name too long");
+    }
+    return tok;
+}
+
+// 在表里按作用域查找名称，从最内层的模块开始，结果放到栈顶，返回找到名称的表，没有找到返回0
+// other不为0时每一层作用域都两个表一起查，内层的定义优先，不会因为先查table而用到外层的定义
+static int idl_lookup(struct idl_state* S, int table, int other, const char* name, size_t len)
+{
+    lua_State* L = S->L;
+    char buf[IDL_MAX_NAME * 2 + 2];
+    size_t m = S->nmodule;
+    for (;;) {
+        size_t k = 0;
+        if (m > 0) {
+            memcpy(buf, S->module, m);
+            memcpy(buf + m, "::", 2);
+            k = m + 2;
+        }
+        memcpy(buf + k, name, len);
+        lua_pushlstring(L, buf, k + len);
+        lua_pushvalue(L, -1);
+        if (LUA_TNIL != lua_rawget(L, table)) {
+            lua_remove(L, -2);
+            return table;
+        }
+        lua_pop(L, 1);
+        if (0 != other && LUA_TNIL != lua_rawget(L, other)) {
+            return other;
+        }
+        if (0 == other) {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+        }
+        if (0 == m) {
+            return 0;
+        }
+        lua_pop(L, 1);
+        // 退到外层模块
+        while (m > 0 && !(':' == S->module[m - 1] && m > 1 && ':' == S->module[m - 2])) {
+            --m;
+        }
+        m = m > 1 ? m - 2 : 0;
+    }
+}
+
+// 用栈顶的值定义名称，同时登记带模块限定的名称和不带限定的名称，不带限定的名称以先定义的为准
+static void idl_define(struct idl_state* S, struct idl_lexer* X, int table, const char* name, size_t len)
+{
+    lua_State* L = S->L;
+    if (S->nmodule > 0) {
+        lua_pushfstring(L, "%s::%s", S->module, lua_pushlstring(L, name, len));
+        lua_remove(L, -2);
+    }
+    else {
+        lua_pushlstring(L, name, len);
+    }
+    lua_pushvalue(L, -1);
+    if (LUA_TNIL != lua_rawget(L, table)) {
+        idl_error(L, X, "duplicate definition '%s'", lua_tostring(L, -2));
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, table);
+    if (S->nmodule > 0) {
+        lua_pushlstring(L, name, len);
+        if (LUA_TNIL == lua_rawget(L, table)) {
+            lua_pop(L, 1);
+            lua_pushlstring(L, name, len);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, table);
+        }
+        else {
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+}
+
+// 常量值放到栈顶，可以是数字，字符串，true/false，或者已经定义的常量和枚举值
+static void idl_value(struct idl_state* S, struct idl_lexer* X)
+{
+    lua_State* L = S->L;
+    const char* tok = NULL;
+    size_t len = 0;
+    switch (idl_next(L, X, &tok, &len)) {
+        case '0': {
+            char num[64];
+            if (len >= sizeof(num)) {
+                idl_error(L, X, "number too long");
+            }
+            memcpy(num, tok, len);
+            num[len] = '\0';
+            if (0 == lua_stringtonumber(L, num)) {
+                idl_error(L, X, "invalid number '%s'", num);
+            }
+        } break;
+        case '"': {
+            if (NULL == memchr(tok, '\\', len)) {
+                lua_pushlstring(L, tok, len);
+                break;
+            }
+            luaL_Buffer b;
+            size_t sz = json_unescape(L, tok, len, NULL);
+            char* out = luaL_buffinitsize(L, &b, sz);
+            json_unescape(L, tok, len, out);
+            luaL_pushresultsize(&b, sz);
+        } break;
+        case 'a': {
+            if (idl_is(tok, len, "true") || idl_is(tok, len, "false")) {
+                lua_pushboolean(L, 't' == tok[0]);
+            }
+            else if (0 == idl_lookup(S, 5, 0, tok, len)) {
+                idl_error(L, X, "unknown constant '%s'", lua_pushlstring(L, tok, len));
+            }
+        } break;
+        default: {
+            idl_error(L, X, "expect a value near '%s'", lua_pushlstring(L, tok, len));
+        }
+    }
+}
+
+// 解析单个类型，不能是容器，可以是基础类型，枚举或者结构体
+static uint32_t idl_scalar_type(struct idl_state* S, struct idl_lexer* X, const char* tok, size_t len)
+{
+    lua_State* L = S->L;
+    char name[IDL_MAX_NAME + 2];
+    if (idl_is(tok, len, "unsigned")) {
+        tok = idl_name(L, X, &len);
+        memcpy(name, "u_", 2);
+        memcpy(name + 2, tok, len);
+        tok = name, len += 2;
+    }
+    for (int i = 0; idl_basic_types[i].name; ++i) {
+        if (idl_is(tok, len, idl_basic_types[i].name)) {
+            return idl_basic_types[i].type;
+        }
+    }
+    if (idl_is(tok, len, "vector") || idl_is(tok, len, "map")) {
+        idl_error(L, X, "nested container is not supported");
+    }
+    // 枚举按int编码，每一层作用域同时查枚举和结构体
+    int isnum = 0;
+    int table = idl_lookup(S, 8, 2, tok, len);
+    if (8 == table) {
+        lua_pop(L, 1);
+        return LUATARS_INT32;
+    }
+    uint32_t id = lua_tointegerx(L, -1, &isnum);
+    lua_pop(L, 1);
+    if (!isnum || id < LUATARS_TYPE_MAX) {
+        idl_error(L, X, "unknown type '%s'", lua_pushlstring(L, tok, len));
+    }
+    return id;
+}
+
+// 解析字段类型，数组和字典的元素类型放在type2和type3
+static void idl_type(struct idl_state* S, struct idl_lexer* X, struct tars_field* field)
+{
+    lua_State* L = S->L;
+    size_t len = 0;
+    const char* tok = idl_name(L, X, &len);
+    const char* sub = NULL;
+    field->type2 = field->type3 = 0;
+    if (idl_is(tok, len, "vector")) {
+        idl_expect(L, X, '<');
+        sub = idl_name(L, X, &len);
+        field->type1 = LUATARS_LIST;
+        field->type2 = idl_scalar_type(S, X, sub, len);
+        idl_expect(L, X, '>');
+    }
+    else if (idl_is(tok, len, "map")) {
+        idl_expect(L, X, '<');
+        sub = idl_name(L, X, &len);
+        field->type1 = LUATARS_MAP;
+        field->type2 = idl_scalar_type(S, X, sub, len);
+        // 字典的键只能是整数和字符串
+        if (LUATARS_BOOL == field->type2 || LUATARS_FLOAT == field->type2 || LUATARS_DOUBLE == field->type2 ||
+            field->type2 >= LUATARS_TYPE_MAX) {
+            idl_error(L, X, "invalid map key type '%s'", lua_pushlstring(L, sub, len));
+        }
+        idl_expect(L, X, ',');
+        sub = idl_name(L, X, &len);
+        field->type3 = idl_scalar_type(S, X, sub, len);
+        idl_expect(L, X, '>');
+    }
+    else {
+        field->type1 = idl_scalar_type(S, X, tok, len);
+    }
+}
+
+// 追加一个字段，字段数组满了就换一个两倍大的用户数据
+static struct idl_field* idl_add_field(struct idl_state* S)
+{
+    if (S->n >= S->cap) {
+        size_t cap = S->cap * 2;
+        struct idl_field* fields = (struct idl_field*)lua_newuserdata(S->L, cap * sizeof(struct idl_field));
+        memcpy(fields, S->fields, S->n * sizeof(struct idl_field));
+        lua_replace(S->L, 4);
+        S->fields = fields, S->cap = cap;
+    }
+    struct idl_field* f = &S->fields[S->n++];
+    memset(f, 0, sizeof(*f));
+    return f;
+}
+
+// 字段默认值转换成定义中的格式，字符串先记在7号位置，创建上下文时再放进元表
+static void idl_default(struct idl_state* S, struct idl_lexer* X, struct tars_field* field, size_t index)
+{
+    lua_State* L = S->L;
+    idl_value(S, X);
+    int t = lua_type(L, -1);
+    int isnum = 0;
+    if (LUATARS_BOOL == field->type1 && LUA_TBOOLEAN == t) {
+        field->def.integer = lua_toboolean(L, -1);
+    }
+    else if (field->type1 <= LUATARS_INT64 && LUA_TNUMBER == t) {
+        field->def.integer = lua_tointegerx(L, -1, &isnum);
+        if (!isnum) {
+            idl_error(L, X, "require an integer default value");
+        }
+    }
+    else if ((LUATARS_FLOAT == field->type1 || LUATARS_DOUBLE == field->type1) && LUA_TNUMBER == t) {
+        field->def.number = lua_tonumber(L, -1);
+    }
+    else if (LUATARS_STRING == field->type1 && LUA_TSTRING == t) {
+        lua_rawseti(L, 7, index + 1);
+        return;
+    }
+    else {
+        idl_error(L, X, "invalid default value");
+    }
+    lua_pop(L, 1);
+}
+
+static void idl_struct(struct idl_state* S, struct idl_lexer* X)
+{
+    lua_State* L = S->L;
+    size_t len = 0;
+    const char* name = idl_name(L, X, &len);
+    size_t first = S->n;
+    // 结构体的标识符是第一个字段的下标加上LUATARS_TYPE_MAX，先定义好以便字段引用自身
+    lua_pushinteger(L, LUATARS_TYPE_MAX + first);
+    idl_define(S, X, 2, name, len);
+    ++S->nstruct;
+    idl_expect(L, X, '{');
+    for (;;) {
+        const char* tok = NULL;
+        char kind = idl_next(L, X, &tok, &len);
+        if ('}' == kind) {
+            break;
+        }
+        int isnum = 0;
+        lua_Integer tag = 0;
+        if ('0' == kind) {
+            lua_pushlstring(L, tok, len);
+            tag = lua_tointegerx(L, -1, &isnum);
+            lua_pop(L, 1);
+        }
+        if (!isnum || tag < 0 || tag > 255) {
+            idl_error(L, X, "invalid tag near '%s'", lua_pushlstring(L, tok, len));
+        }
+        struct idl_field* f = idl_add_field(S);
+        f->first = S->n - 1 == first;
+        f->field.tag = tag;
+        tok = idl_name(L, X, &len);
+        if (idl_is(tok, len, "require")) {
+            f->field.forced = true;
+        }
+        else if (!idl_is(tok, len, "optional")) {
+            idl_error(L, X, "struct member need 'require' or 'optional' near '%s'", lua_pushlstring(L, tok, len));
+        }
+        idl_type(S, X, &f->field);
+        // 记录字段的名称
+        tok = idl_name(L, X, &len);
+        lua_pushlstring(L, tok, len);
+        lua_rawseti(L, 2, S->n - 1);
+        if ('=' == idl_peek(L, X)) {
+            idl_expect(L, X, '=');
+            idl_default(S, X, &f->field, S->n - 1);
+        }
+        idl_expect(L, X, ';');
+    }
+    if (S->n == first) {
+        idl_error(L, X, "struct '%s' has no member", lua_pushlstring(L, name, len));
+    }
+    idl_optional_semicolon(L, X);
+}
+
+static void idl_enum(struct idl_state* S, struct idl_lexer* X)
+{
+    lua_State* L = S->L;
+    size_t len = 0;
+    const char* name = idl_name(L, X, &len);
+    lua_pushboolean(L, 1);
+    idl_define(S, X, 8, name, len);
+    idl_expect(L, X, '{');
+    lua_Integer value = 0;
+    while ('}' != idl_peek(L, X)) {
+        name = idl_name(L, X, &len);
+        if ('=' == idl_peek(L, X)) {
+            idl_expect(L, X, '=');
+            idl_value(S, X);
+            int isnum = 0;
+            value = lua_tointegerx(L, -1, &isnum);
+            if (!isnum || LUA_TNUMBER != lua_type(L, -1)) {
+                idl_error(L, X, "require an integer enum value");
+            }
+            lua_pop(L, 1);
+        }
+        lua_pushinteger(L, value++);
+        idl_define(S, X, 5, name, len);
+        if (',' != idl_peek(L, X)) {
+            break;
+        }
+        idl_expect(L, X, ',');
+    }
+    idl_expect(L, X, '}');
+    idl_optional_semicolon(L, X);
+}
+
+static void idl_const(struct idl_state* S, struct idl_lexer* X)
+{
+    lua_State* L = S->L;
+    struct tars_field field;
+    memset(&field, 0, sizeof(field));
+    idl_type(S, X, &field);
+    if (field.type1 >= LUATARS_MAP) {
+        idl_error(L, X, "const must be a basic type");
+    }
+    size_t len = 0;
+    const char* name = idl_name(L, X, &len);
+    idl_expect(L, X, '=');
+    idl_value(S, X);
+    int t = lua_type(L, -1);
+    if (LUATARS_BOOL == field.type1 ? LUA_TBOOLEAN != t
+                                     : (LUATARS_STRING == field.type1 ? LUA_TSTRING != t : LUA_TNUMBER != t)) {
+        idl_error(L, X, "invalid value of const '%s'", lua_pushlstring(L, name, len));
+    }
+    if (field.type1 <= LUATARS_INT64 && LUATARS_BOOL != field.type1 && !lua_isinteger(L, -1)) {
+        idl_error(L, X, "require an integer value of const '%s'", lua_pushlstring(L, name, len));
+    }
+    idl_define(S, X, 5, name, len);
+    idl_expect(L, X, ';');
+}
+
+// 跳过不关心的定义，如interface和key，直到分号或者配对的大括号
+static void idl_skip(struct idl_state* S, struct idl_lexer* X)
+{
+    lua_State* L = S->L;
+    int depth = 0;
+    for (;;) {
+        const char* tok = NULL;
+        size_t len = 0;
+        switch (idl_next(L, X, &tok, &len)) {
+            case '\0': {
+                idl_error(L, X, "unexpected end of file");
+            } break;
+            case '{': {
+                ++depth;
+            } break;
+            case '}': {
+                if (--depth <= 0) {
+                    idl_optional_semicolon(L, X);
+                    return;
+                }
+            } break;
+            case ';': {
+                if (0 == depth) {
+                    return;
+                }
+            } break;
+        }
+    }
+}
+
+static void idl_definitions(struct idl_state* S, struct idl_lexer* X, bool inModule);
+
+// 包含其他文件，相对路径按当前文件所在的目录查找，同一个文件只解析一次
+static void idl_include(struct idl_state* S, struct idl_lexer* X, const char* name, size_t len)
+{
+    lua_State* L = S->L;
+    luaL_checkstack(L, 8, "include too deep");
+    const char* slash = X->file ? strrchr(X->file, '/') : NULL;
+    if ('/' != name[0] && NULL != slash) {
+        lua_pushlstring(L, X->file, slash - X->file + 1);
+        lua_pushlstring(L, name, len);
+        lua_concat(L, 2);
+    }
+    else {
+        lua_pushlstring(L, name, len);
+    }
+    const char* path = lua_tostring(L, -1);
+    lua_pushvalue(L, -1);
+    if (LUA_TNIL != lua_rawget(L, 6)) {
+        lua_pop(L, 2);
+        return;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, 6);
+    if (S->includes >= IDL_MAX_INCLUDE) {
+        idl_error(L, X, "include too deep '%s'", path);
+    }
+
+    // 先取得文件大小再分配内存，分配内存可能抛出错误，这时文件已经关闭，不会泄漏
+    long size = -1;
+    FILE* fp = fopen(path, "rb");
+    if (NULL != fp) {
+        if (0 == fseek(fp, 0, SEEK_END)) {
+            size = ftell(fp);
+        }
+        fclose(fp);
+    }
+    if (size < 0) {
+        idl_error(L, X, "cannot open include file '%s'", path);
+    }
+    char* text = (char*)lua_newuserdata(L, size + 1);
+    size_t n = 0;
+    fp = fopen(path, "rb");
+    bool failed = NULL == fp;
+    if (NULL != fp) {
+        n = fread(text, 1, size, fp);
+        failed = ferror(fp);
+        fclose(fp);
+    }
+    if (failed) {
+        idl_error(L, X, "cannot read include file '%s'", path);
+    }
+
+    struct idl_lexer Y;
+    Y.s = text;
+    Y.n = n;
+    Y.pos = 0;
+    Y.line = 1;
+    Y.file = path;
+    ++S->includes;
+    idl_definitions(S, &Y, false);
+    --S->includes;
+    lua_pop(L, 2);
+}
+
+static void idl_module(struct idl_state* S, struct idl_lexer* X)
+{
+    lua_State* L = S->L;
+    size_t len = 0;
+    const char* name = idl_name(L, X, &len);
+    size_t m = S->nmodule;
+    if (m + len + 2 >= sizeof(S->module)) {
+        idl_error(L, X, "module name too long");
+    }
+    if (m > 0) {
+        memcpy(S->module + m, "::", 2);
+        m += 2;
+    }
+    memcpy(S->module + m, name, len);
+    S->module[m + len] = '\0';
+    size_t saved = S->nmodule;
+    S->nmodule = m + len;
+    idl_expect(L, X, '{');
+    idl_definitions(S, X, true);
+    S->nmodule = saved;
+    S->module[saved] = '\0';
+    idl_optional_semicolon(L, X);
+}
+
+void idl_definitions(struct idl_state* S, struct idl_lexer* X, bool inModule)
+{
+    lua_State* L = S->L;
+    for (;;) {
+        const char* tok = NULL;
+        size_t len = 0;
+        char kind = idl_next(L, X, &tok, &len);
+        if ('\0' == kind) {
+            if (inModule) {
+                idl_error(L, X, "unexpected end of file in module");
+            }
+            return;
+        }
+        if ('}' == kind && inModule) {
+            return;
+        }
+        if (';' == kind) {
+            continue;
+        }
+        if ('#' == kind) {
+            tok = idl_name(L, X, &len);
+            if (!idl_is(tok, len, "include")) {
+                idl_error(L, X, "unknown directive '#%s'", lua_pushlstring(L, tok, len));
+            }
+            if (idl_next(L, X, &tok, &len) != '"') {
+                idl_error(L, X, "expect include file name");
+            }
+            idl_include(S, X, tok, len);
+            continue;
+        }
+        if ('a' != kind) {
+            idl_error(L, X, "unexpected '%s'", lua_pushlstring(L, tok, len));
+        }
+        if (idl_is(tok, len, "module")) {
+            idl_module(S, X);
+        }
+        else if (idl_is(tok, len, "struct")) {
+            idl_struct(S, X);
+        }
+        else if (idl_is(tok, len, "enum")) {
+            idl_enum(S, X);
+        }
+        else if (idl_is(tok, len, "const")) {
+            idl_const(S, X);
+        }
+        else if (idl_is(tok, len, "interface") || idl_is(tok, len, "key")) {
+            idl_skip(S, X);
+        }
+        else {
+            idl_error(L, X, "unexpected '%s'", lua_pushlstring(L, tok, len));
+        }
+    }
+}
+
+// 解析IDL直接创建上下文，支持模块，注释，枚举，常量和包含文件
+// 用法：tars.parseIdl(text, mt, path)，返回上下文和常量表(包括枚举值)
+// 常量和结构体都可以用不带模块的名称访问，重名时以先定义的为准，带模块限定的名称总是唯一的
+static int luatars_parseIdl(lua_State* L)
+{
+    size_t n = 0;
+    const char* text = luaL_checklstring(L, 1, &n);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    const char* path = luaL_optstring(L, 3, NULL);
+    lua_settop(L, 3);
+
+    struct idl_state S;
+    memset(&S, 0, sizeof(S));
+    S.L = L;
+    S.cap = 64;
+    S.fields = (struct idl_field*)lua_newuserdata(L, S.cap * sizeof(struct idl_field));  // 4
+    lua_newtable(L);                                                                    // 5
+    lua_newtable(L);                                                                    // 6
+    lua_newtable(L);                                                                    // 7
+    lua_newtable(L);                                                                    // 8
+    if (path) {
+        lua_pushvalue(L, 3);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, 6);
+    }
+
+    struct idl_lexer X;
+    X.s = text;
+    X.n = n;
+    X.pos = 0;
+    X.line = 1;
+    X.file = path;
+    idl_definitions(&S, &X, false);
+
+    // 创建上下文
+    struct tars_context* context = context_new(L, S.n, S.nstruct);  // 9
+    lua_pushvalue(L, 2), lua_setmetatable(L, 9);
+    mark_object_mt(L, 2);
+    struct tars_struct* st = NULL;
+    for (size_t i = 0; i < S.n; ++i) {
+        context->fields[i] = S.fields[i].field;
+        st = context_link(L, context, st, i, S.fields[i].first);
+    }
+    // 缓存字符串默认值，和createContext的位置一致
+    lua_pushnil(L);
+    while (lua_next(L, 7)) {
+        lua_Integer i = lua_tointeger(L, -2);
+        context->fields[i - 1].def.integer = LUATARS_TYPE_MAX + context->n + i;
+        lua_rawseti(L, 2, context->fields[i - 1].def.integer);
+    }
+    lua_pushvalue(L, 5);
+
+    return 2;
+}
+
+// 进程内共享的只读上下文，按名称登记，登记表和每个句柄各持有一个引用
+// 上下文和名称放在同一块内存里，引用计数为0时一起释放
+struct shared_string {
+    const char* s;  // 没有时为NULL
+    size_t len;
+};
+
+struct shared_name {
+    struct shared_string name;
+    uint32_t id;
+};
+
+struct tars_shared {
+    struct tars_shared* next;
+    const char* name;  // 登记的名称
+    size_t refs;
+    struct tars_context* context;
+    struct shared_string* fields;    // 字段名称，按字段下标
+    struct shared_string* defaults;  // 字符串默认值，按字段下标
+    struct shared_name* names;       // 结构体名称，按名称排序
+    size_t nnames;
+};
+
+#define SHARED_ALIGN(sz) (((sz) + 7) & ~(size_t)7)
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tars_shared* shared_list = NULL;
+
+struct tars_context* shared_context(struct tars_shared* shared)
+{
+    return shared->context;
+}
+
+static int shared_compare(const char* s1, size_t len1, const char* s2, size_t len2)
+{
+    int r = memcmp(s1, s2, len1 < len2 ? len1 : len2);
+    return 0 != r ? r : (len1 > len2) - (len1 < len2);
+}
+
+static int shared_name_compare(const void* a, const void* b)
+{
+    const struct shared_name* x = (const struct shared_name*)a;
+    const struct shared_name* y = (const struct shared_name*)b;
+    return shared_compare(x->name.s, x->name.len, y->name.s, y->name.len);
+}
+
+// 登记表里按名称查找，调用者持有锁
+static struct tars_shared** shared_find(const char* name)
+{
+    struct tars_shared** p = &shared_list;
+    while (NULL != *p && 0 != strcmp((*p)->name, name)) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+static void shared_release(struct tars_shared* S)
+{
+    pthread_mutex_lock(&shared_lock);
+    bool dead = 0 == --S->refs;
+    pthread_mutex_unlock(&shared_lock);
+    if (dead) {
+        free(S);
+    }
+}
+
+// 复制字符串到共享内存，返回下一个可写的位置
+static char* shared_copy(lua_State* L, struct shared_string* str, char* pool)
+{
+    size_t len = 0;
+    const char* s = LUA_TSTRING == lua_type(L, -1) ? lua_tolstring(L, -1, &len) : NULL;
+    if (NULL == s) {
+        str->s = NULL, str->len = 0;
+        return pool;
+    }
+    memcpy(pool, s, len);
+    str->s = pool, str->len = len;
+    return pool + len;
+}
+
+// 把上下文登记到进程内共享，其他lua虚拟机可以用tars.attach(name)取得句柄
+// 用法：tars.share(name, context)
+static int luatars_share(lua_State* L)
+{
+    size_t namelen = 0;
+    const char* name = luaL_checklstring(L, 1, &namelen);
+    luaL_checktype(L, 2, LUA_TUSERDATA);
+    struct tars_context* context = (struct tars_context*)lua_touserdata(L, 2);
+    if (NULL != context->shared) {
+        luaL_error(L, "[C] %s %d: context is already shared", __FUNCTION__, __LINE__);
+    }
+    lua_settop(L, 2);
+    lua_getmetatable(L, 2);  // 3
+
+    // 先统计名称的数量和总长度
+    size_t n = context->n, nnames = 0, chars = namelen + 1;
+    for (size_t i = 0; i < n; ++i) {
+        struct tars_field* field = context->fields + i;
+        lua_rawgeti(L, 3, i);
+        chars += LUA_TSTRING == lua_type(L, -1) ? lua_rawlen(L, -1) : 0;
+        lua_pop(L, 1);
+        if (LUATARS_STRING == field->type1 && 0 != field->def.integer) {
+            lua_rawgeti(L, 3, field->def.integer);
+            chars += LUA_TSTRING == lua_type(L, -1) ? lua_rawlen(L, -1) : 0;
+            lua_pop(L, 1);
+        }
+    }
+    lua_pushnil(L);
+    while (lua_next(L, 3)) {
+        if (LUA_TSTRING == lua_type(L, -2) && lua_isinteger(L, -1) &&
+            NULL != context_struct(context, lua_tointeger(L, -1))) {
+            ++nnames;
+            chars += lua_rawlen(L, -2);
+        }
+        lua_pop(L, 1);
+    }
+
+    size_t sz = context_size(n, context->nstruct);
+    size_t total = SHARED_ALIGN(sizeof(struct tars_shared)) + SHARED_ALIGN(sz) +
+                   2 * n * sizeof(struct shared_string) + nnames * sizeof(struct shared_name) + chars;
+    char* p = (char*)malloc(total);
+    if (NULL == p) {
+        luaL_error(L, "[C] %s %d: out of memory", __FUNCTION__, __LINE__);
+    }
+    struct tars_shared* S = (struct tars_shared*)p;
+    p += SHARED_ALIGN(sizeof(struct tars_shared));
+    S->context = (struct tars_context*)p;
+    memcpy(S->context, context, sz);
+    S->context->shared = S;
+    p += SHARED_ALIGN(sz);
+    S->fields = (struct shared_string*)p;
+    S->defaults = S->fields + n;
+    S->names = (struct shared_name*)(S->defaults + n);
+    S->nnames = nnames;
+    char* pool = (char*)(S->names + nnames);
+    S->refs = 1;
+    S->next = NULL;
+
+    // 复制名称，之后都是只读的
+    memcpy(pool, name, namelen + 1);
+    S->name = pool;
+    pool += namelen + 1;
+    for (size_t i = 0; i < n; ++i) {
+        struct tars_field* field = context->fields + i;
+        lua_rawgeti(L, 3, i);
+        pool = shared_copy(L, S->fields + i, pool);
+        lua_pop(L, 1);
+        S->defaults[i].s = NULL, S->defaults[i].len = 0;
+        if (LUATARS_STRING == field->type1 && 0 != field->def.integer) {
+            lua_rawgeti(L, 3, field->def.integer);
+            pool = shared_copy(L, S->defaults + i, pool);
+            lua_pop(L, 1);
+        }
+    }
+    size_t k = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 3)) {
+        if (LUA_TSTRING == lua_type(L, -2) && lua_isinteger(L, -1) &&
+            NULL != context_struct(context, lua_tointeger(L, -1))) {
+            S->names[k].id = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            pool = shared_copy(L, &S->names[k++].name, pool);
+        }
+        lua_pop(L, 1);
+    }
+    qsort(S->names, nnames, sizeof(struct shared_name), shared_name_compare);
+
+    pthread_mutex_lock(&shared_lock);
+    struct tars_shared** slot = shared_find(S->name);
+    bool exists = NULL != *slot;
+    if (!exists) {
+        *slot = S;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    if (exists) {
+        free(S);
+        luaL_error(L, "[C] %s %d: shared context '%s' already exists", __FUNCTION__, __LINE__, name);
+    }
+    return 0;
+}
+
+// 取消登记，已经取得的句柄仍然有效，最后一个句柄回收时释放内存
+// 用法：tars.unshare(name)，返回是否存在
+static int luatars_unshare(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    pthread_mutex_lock(&shared_lock);
+    struct tars_shared** slot = shared_find(name);
+    struct tars_shared* S = *slot;
+    if (NULL != S) {
+        *slot = S->next;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    if (NULL != S) {
+        shared_release(S);
+    }
+    lua_pushboolean(L, NULL != S);
+    return 1;
+}
+
+// 句柄元表的查询，字段名称，字符串默认值和结构体标识符从共享内存取出，并缓存到元表
+static int shared_index(lua_State* L)
+{
+    struct tars_context* handle = (struct tars_context*)lua_touserdata(L, lua_upvalueindex(1));
+    struct tars_shared* S = handle->shared;
+    if (NULL == S) {
+        return 0;
+    }
+    size_t n = S->context->n;
+    if (lua_isinteger(L, 2)) {
+        lua_Integer i = lua_tointeger(L, 2);
+        const struct shared_string* str = NULL;
+        if (i >= 0 && (size_t)i < n) {
+            str = S->fields + i;
+        }
+        else if (i > (lua_Integer)(LUATARS_TYPE_MAX + n) && i <= (lua_Integer)(LUATARS_TYPE_MAX + 2 * n)) {
+            // 字符串默认值的位置，和createContext的约定一致
+            size_t index = i - LUATARS_TYPE_MAX - n - 1;
+            if (S->context->fields[index].def.integer == i) {
+                str = S->defaults + index;
+            }
+        }
+        if (NULL == str || NULL == str->s) {
+            return 0;
+        }
+        lua_pushlstring(L, str->s, str->len);
+    }
+    else if (LUA_TSTRING == lua_type(L, 2)) {
+        size_t len = 0;
+        const char* name = lua_tolstring(L, 2, &len);
+        size_t lo = 0, hi = S->nnames;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            int r = shared_compare(S->names[mid].name.s, S->names[mid].name.len, name, len);
+            if (0 == r) {
+                lo = mid;
+                break;
+            }
+            if (r < 0) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        if (lo >= S->nnames || 0 != shared_compare(S->names[lo].name.s, S->names[lo].name.len, name, len)) {
+            return 0;
+        }
+        lua_pushinteger(L, S->names[lo].id);
+    }
+    else {
+        return 0;
+    }
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+    return 1;
+}
+
+static int shared_handle_gc(lua_State* L)
+{
+    struct tars_context* handle = (struct tars_context*)lua_touserdata(L, 1);
+    if (NULL != handle && NULL != handle->shared) {
+        struct tars_shared* S = handle->shared;
+        handle->shared = NULL;
+        handle->n = handle->nstruct = 0;
+        shared_release(S);
+    }
+    return 0;
+}
+
+// 取得共享上下文的句柄，句柄很小，名称在第一次用到时才放进这个虚拟机
+// 用法：tars.attach(name, mt)，没有登记时返回nil
+static int luatars_attach(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    struct tars_context* handle = (struct tars_context*)lua_newuserdata(L, sizeof(struct tars_context));  // 3
+    memset(handle, 0, sizeof(struct tars_context));
+
+    pthread_mutex_lock(&shared_lock);
+    struct tars_shared* S = *shared_find(name);
+    if (NULL != S) {
+        ++S->refs;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    if (NULL == S) {
+        lua_pushnil(L);
+        return 1;
+    }
+    handle->shared = S;
+    handle->n = S->context->n;
+    handle->nstruct = S->context->nstruct;
+
+    // 元表的元表负责从共享内存查询名称
+    lua_pushcfunction(L, shared_handle_gc), lua_setfield(L, 2, "__gc");
+    lua_createtable(L, 0, 1);
+    lua_pushvalue(L, 3), lua_pushcclosure(L, shared_index, 1), lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, 2);
+    lua_pushvalue(L, 2), lua_setmetatable(L, 3);
+    mark_object_mt(L, 2);
+    return 1;
+}
+
+#define IMAGE_MAGIC "TARSIMG"
+#define IMAGE_VERSION 2
+#define IMAGE_ORDER 0x01020304u
+#define IMAGE_NIL UINT32_MAX
+
+// 二进制模式镜像的头部，镜像只在相同的平台和版本之间使用，整数都是本机字节序
+// 头部之后是上下文的内存块，然后依次是字段名称，结构体名称，字符串默认值，常量
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;        // 字节序标记
+    uint32_t field_size;   // sizeof(struct tars_field)
+    uint32_t struct_size;  // sizeof(struct tars_struct)
+    uint32_t head_size;    // sizeof(struct tars_context)，上下文头部变化后旧镜像不能使用
+    uint64_t n;            // 字段数量
+    uint64_t nstruct;      // 结构体数量
+};
+
+struct image_reader {
+    const char* s;
+    size_t n;
+    size_t pos;
+};
+
+static const char* image_read(lua_State* L, struct image_reader* R, size_t sz)
+{
+    if (R->n - R->pos < sz) {
+        luaL_error(L, "[C] %s %d: truncated image at %d", __FUNCTION__, __LINE__, (int)R->pos);
+    }
+    const char* s = R->s + R->pos;
+    R->pos += sz;
+    return s;
+}
+
+static inline uint32_t image_read_u32(lua_State* L, struct image_reader* R)
+{
+    uint32_t v;
+    memcpy(&v, image_read(L, R, sizeof v), sizeof v);
+    return v;
+}
+
+// 读取长度和字符串放到栈顶，长度为IMAGE_NIL时放nil
+static void image_read_string(lua_State* L, struct image_reader* R)
+{
+    uint32_t len = image_read_u32(L, R);
+    if (IMAGE_NIL == len) {
+        lua_pushnil(L);
+        return;
+    }
+    lua_pushlstring(L, image_read(L, R, len), len);
+}
+
+static inline void image_write_u32(struct write_buffer* B, uint32_t v)
+{
+    wb_addlstr(B, (const char*)&v, sizeof v);
+}
+
+// 写入栈顶的字符串，不是字符串时写IMAGE_NIL
+static void image_write_string(lua_State* L, struct write_buffer* B)
+{
+    size_t len = 0;
+    const char* s = LUA_TSTRING == lua_type(L, -1) ? lua_tolstring(L, -1, &len) : NULL;
+    if (NULL == s) {
+        image_write_u32(B, IMAGE_NIL);
+        return;
+    }
+    image_write_u32(B, len);
+    wb_addlstr(B, s, len);
+}
+
+// 类型是否有效，结构体必须是上下文里的
+static inline bool image_valid_type(struct tars_context* context, uint32_t type, bool container)
+{
+    if (LUATARS_MAP == type || LUATARS_LIST == type) {
+        return container;
+    }
+    return (type > 0 && type < LUATARS_TYPE_MAX) || NULL != context_struct(context, type);
+}
+
+// 检查镜像里的上下文，编解码时默认上下文是一致的，所以加载时要先校验
+// 结构体描述和字段所属的结构体不信任镜像，只取每个结构体的第一个字段，用context_link重新建立
+static void image_check_context(lua_State* L, struct tars_context* context)
+{
+    struct tars_struct* structs = context_structs(context);
+    uint32_t* owners = context_owners(context);
+    // 先在owners里标记每个结构体的第一个字段，必须从0开始严格递增
+    memset(owners, 0, context->n * sizeof(uint32_t));
+    for (size_t i = 0; i < context->nstruct; ++i) {
+        size_t first = structs[i].first;
+        if (first >= context->n || (0 == i ? 0 != first : first <= structs[i - 1].first)) {
+            luaL_error(L, "[C] %s %d: invalid image, struct #[%d]", __FUNCTION__, __LINE__, (int)i + 1);
+        }
+        owners[first] = 1;
+    }
+    memset(structs, 0, context->nstruct * sizeof(struct tars_struct));
+    struct tars_struct* st = NULL;
+    for (size_t i = 0; i < context->n; ++i) {
+        struct tars_field* field = context->fields + i;
+        uint8_t forced = 0;
+        memcpy(&forced, &field->forced, sizeof forced);
+        field->forced = 0 != forced;
+        st = context_link(L, context, st, i, 0 != owners[i]);
+    }
+    for (size_t i = 0; i < context->n; ++i) {
+        struct tars_field* field = context->fields + i;
+        bool valid = image_valid_type(context, field->type1, true);
+        if (valid && LUATARS_MAP == field->type1) {
+            valid = field->type2 < LUATARS_TYPE_MAX && image_valid_type(context, field->type2, false) &&
+                    image_valid_type(context, field->type3, false);
+        }
+        else if (valid && LUATARS_LIST == field->type1) {
+            valid = image_valid_type(context, field->type2, false);
+        }
+        if (!valid) {
+            luaL_error(L, "[C] %s %d: invalid image, field #[%d]", __FUNCTION__, __LINE__, (int)i + 1);
+        }
+    }
+}
+
+// 把上下文保存成二进制镜像，defines是可选的常量表，如tars.parse返回的第二个值
+// 用法：tars.saveImage(context, defines)
+static int luatars_saveImage(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+    lua_settop(L, 2);
+    if (!lua_getmetatable(L, 1)) {  // 3
+        luaL_error(L, "[C] %s %d: context without metatable", __FUNCTION__, __LINE__);
+    }
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    struct image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.order = IMAGE_ORDER;
+    header.field_size = sizeof(struct tars_field);
+    header.struct_size = sizeof(struct tars_struct);
+    header.head_size = sizeof(struct tars_context);
+    header.n = context->n;
+    header.nstruct = context->nstruct;
+    wb_addlstr(&B, (const char*)&header, sizeof(header));
+    // 上下文是一整块内存，直接保存
+    wb_addlstr(&B, (const char*)context, context_size(context->n, context->nstruct));
+
+    // 字段名称
+    for (size_t i = 0; i < context->n; ++i) {
+        lua_geti(L, 3, i);
+        image_write_string(L, &B);
+        lua_pop(L, 1);
+    }
+
+    // 结构体名称，包括带模块限定的名称，共享上下文的名称不一定都在元表里
+    size_t pos = B.n;
+    uint32_t count = 0;
+    image_write_u32(&B, 0);
+    for (size_t i = 0; NULL != context->shared && i < context->shared->nnames; ++i) {
+        struct shared_name* name = context->shared->names + i;
+        uint64_t id = name->id;
+        image_write_u32(&B, name->name.len);
+        wb_addlstr(&B, name->name.s, name->name.len);
+        wb_addlstr(&B, (const char*)&id, sizeof id);
+        ++count;
+    }
+    lua_pushnil(L);
+    while (NULL == context->shared && lua_next(L, 3)) {
+        if (LUA_TSTRING == lua_type(L, -2) && lua_isinteger(L, -1) &&
+            NULL != context_struct(context, lua_tointeger(L, -1))) {
+            uint64_t id = lua_tointeger(L, -1);
+            lua_pushvalue(L, -2);
+            image_write_string(L, &B);
+            lua_pop(L, 1);
+            wb_addlstr(&B, (const char*)&id, sizeof id);
+            ++count;
+        }
+        lua_pop(L, 1);
+    }
+    memcpy(B.s + pos, &count, sizeof count);
+
+    // 字符串默认值
+    pos = B.n, count = 0;
+    image_write_u32(&B, 0);
+    for (size_t i = 0; i < context->n; ++i) {
+        struct tars_field* field = context->fields + i;
+        if (LUATARS_STRING == field->type1 && 0 != field->def.integer) {
+            image_write_u32(&B, i);
+            lua_geti(L, 3, field->def.integer);
+            image_write_string(L, &B);
+            lua_pop(L, 1);
+            ++count;
+        }
+    }
+    memcpy(B.s + pos, &count, sizeof count);
+
+    // 常量
+    pos = B.n, count = 0;
+    image_write_u32(&B, 0);
+    if (!lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        while (lua_next(L, 2)) {
+            if (LUA_TSTRING != lua_type(L, -2)) {
+                lua_pop(L, 1);
+                continue;
+            }
+            lua_pushvalue(L, -2);
+            image_write_string(L, &B);
+            lua_pop(L, 1);
+            switch (lua_type(L, -1)) {
+                case LUA_TNUMBER: {
+                    if (lua_isinteger(L, -1)) {
+                        int64_t v = lua_tointeger(L, -1);
+                        wb_addchar(&B, 'i');
+                        wb_addlstr(&B, (const char*)&v, sizeof v);
+                    }
+                    else {
+                        double v = lua_tonumber(L, -1);
+                        wb_addchar(&B, 'd');
+                        wb_addlstr(&B, (const char*)&v, sizeof v);
+                    }
+                } break;
+                case LUA_TBOOLEAN: {
+                    wb_addchar(&B, 'b');
+                    wb_addchar(&B, lua_toboolean(L, -1));
+                } break;
+                case LUA_TSTRING: {
+                    wb_addchar(&B, 's');
+                    image_write_string(L, &B);
+                } break;
+                default: {
+                    luaL_error(L, "[C] %s %d: unsupported const '%s'", __FUNCTION__, __LINE__, lua_tostring(L, -2));
+                }
+            }
+            lua_pop(L, 1);
+            ++count;
+        }
+    }
+    memcpy(B.s + pos, &count, sizeof count);
+
+    wb_pushresult(&B, L);
+    return 1;
+}
+
+// 从二进制镜像创建上下文，上下文的内存块一次复制，不需要再解析IDL
+// 用法：tars.loadImage(data, mt)，返回上下文和常量表
+static int luatars_loadImage(lua_State* L)
+{
+    struct image_reader R;
+    R.s = luaL_checklstring(L, 1, &R.n);
+    R.pos = 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    struct image_header header;
+    memcpy(&header, image_read(L, &R, sizeof(header)), sizeof(header));
+    if (0 != memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))) {
+        luaL_error(L, "[C] %s %d: not a tars image", __FUNCTION__, __LINE__);
+    }
+    if (IMAGE_VERSION != header.version || IMAGE_ORDER != header.order ||
+        sizeof(struct tars_field) != header.field_size || sizeof(struct tars_struct) != header.struct_size ||
+        sizeof(struct tars_context) != header.head_size) {
+        luaL_error(L, "[C] %s %d: image built for another version or platform", __FUNCTION__, __LINE__);
+    }
+    if (header.n > R.n || header.nstruct > header.n) {
+        luaL_error(L, "[C] %s %d: invalid image size", __FUNCTION__, __LINE__);
+    }
+
+    size_t sz = context_size(header.n, header.nstruct);
+    const char* blob = image_read(L, &R, sz);
+    struct tars_context* context = (struct tars_context*)lua_newuserdata(L, sz);  // 3
+    memcpy(context, blob, sz);
+    context->shared = NULL;
+    if (context->n != header.n || context->nstruct != header.nstruct) {
+        luaL_error(L, "[C] %s %d: invalid image size", __FUNCTION__, __LINE__);
+    }
+    image_check_context(L, context);
+
+    // 字段名称
+    for (size_t i = 0; i < context->n; ++i) {
+        image_read_string(L, &R);
+        lua_rawseti(L, 2, i);
+    }
+
+    // 结构体名称
+    uint32_t count = image_read_u32(L, &R);
+    for (uint32_t i = 0; i < count; ++i) {
+        image_read_string(L, &R);
+        uint64_t id;
+        memcpy(&id, image_read(L, &R, sizeof id), sizeof id);
+        if (NULL == context_struct(context, id)) {
+            luaL_error(L, "[C] %s %d: invalid image, struct id %d", __FUNCTION__, __LINE__, (int)id);
+        }
+        lua_pushinteger(L, id);
+        lua_rawset(L, 2);
+    }
+
+    // 字符串默认值，和createContext的位置一致
+    count = image_read_u32(L, &R);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t index = image_read_u32(L, &R);
+        if (index >= context->n || LUATARS_STRING != context->fields[index].type1) {
+            luaL_error(L, "[C] %s %d: invalid image, default #[%d]", __FUNCTION__, __LINE__, (int)index + 1);
+        }
+        if (context->fields[index].def.integer < (lua_Integer)context->n) {
+            luaL_error(L, "[C] %s %d: invalid image, default #[%d]", __FUNCTION__, __LINE__, (int)index + 1);
+        }
+        image_read_string(L, &R);
+        lua_rawseti(L, 2, context->fields[index].def.integer);
+    }
+    for (size_t i = 0; i < context->n; ++i) {
+        struct tars_field* field = context->fields + i;
+        if (LUATARS_STRING == field->type1 && 0 != field->def.integer) {
+            // 默认值的位置在字段名称之后，不能覆盖名称
+            if (field->def.integer < (lua_Integer)context->n ||
+                LUA_TSTRING != lua_rawgeti(L, 2, field->def.integer)) {
+                luaL_error(L, "[C] %s %d: invalid image, default #[%d]", __FUNCTION__, __LINE__, (int)i + 1);
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pushvalue(L, 2), lua_setmetatable(L, 3);
+    mark_object_mt(L, 2);
+
+    // 常量
+    count = image_read_u32(L, &R);
+    lua_createtable(L, 0, count);  // 4
+    for (uint32_t i = 0; i < count; ++i) {
+        image_read_string(L, &R);
+        char type = *image_read(L, &R, 1);
+        switch (type) {
+            case 'i': {
+                int64_t v;
+                memcpy(&v, image_read(L, &R, sizeof v), sizeof v);
+                lua_pushinteger(L, v);
+            } break;
+            case 'd': {
+                double v;
+                memcpy(&v, image_read(L, &R, sizeof v), sizeof v);
+                lua_pushnumber(L, v);
+            } break;
+            case 'b': {
+                lua_pushboolean(L, *image_read(L, &R, 1));
+            } break;
+            case 's': {
+                image_read_string(L, &R);
+            } break;
+            default: {
+                luaL_error(L, "[C] %s %d: invalid image, const type %d", __FUNCTION__, __LINE__, type);
+            }
+        }
+        lua_rawset(L, 4);
+    }
+    if (R.pos != R.n) {
+        luaL_error(L, "[C] %s %d: invalid image, trailing data", __FUNCTION__, __LINE__);
+    }
+
+    return 2;
+}
+
+// 打印环境的整体信息
+static int luatars_dump(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    lua_settop(L, 1);
+    lua_getmetatable(L, 1);
+
+    luaL_Buffer B;
+    luaL_buffinit(L, &B);
+    for (size_t i = 0; i < context->n; ++i) {
+        char b[512];
+        lua_geti(L, 2, i);
+        struct tars_field* field = &context->fields[i];
+        int sz = snprintf(b, sizeof b, "[%d]:%8s\t%s\t%d\t%d\t%d\n", field->tag, lua_tostring(L, -1),
+                          field->forced ? "require" : "optional", field->type1, field->type2, field->type3);
+        lua_pop(L, 1);
+        luaL_addlstring(&B, b, sz);
+    }
+    luaL_pushresult(&B);
+    return 1;
+}
+
+// 设置
+#define set_luatars_enum(L, Type) lua_pushinteger(L, LUATARS_##Type), lua_setfield(L, -2, #Type);
+
+static const char base64_table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char base64_url_table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// 解码表，0x80是无效字符，0x40是填充字符
+static const uint8_t base64_dtable[256] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x40, 0x80, 0x80,
+    0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+static const uint8_t base64_url_dtable[256] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x40, 0x80, 0x80,
+    0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x3f,
+    0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+// 向量化的级别，加载模块时检测cpu
+#define BASE64_SCALAR 0
+#define BASE64_SSSE3 1
+#define BASE64_AVX2 2
+
+static int base64_level = BASE64_SCALAR;
+
+static void base64_init(void)
+{
+#ifdef TARS_BASE64_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        base64_level = BASE64_AVX2;
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+        base64_level = BASE64_SSSE3;
+    }
+#endif
+}
+
+#ifdef TARS_BASE64_SIMD
+// 向量化的实现参考 Wojciech Muła, Daniel Lemire: Faster Base64 Encoding and Decoding using AVX2 Instructions
+// 每次处理一个完整的块，返回处理的输入字节数，剩余的部分由标量代码处理
+
+// 6位的值转换成字符：按值所在的区间查询偏移，url为true时最后两个字符是'-'和'_'
+#define BASE64_ENCODE_LUT(Url) \
+    65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, (Url) ? -17 : -19, (Url) ? 32 : -16, 0, 0
+
+__attribute__((target("ssse3"))) static size_t base64_encode_ssse3(const uint8_t* src,
+                                                                   size_t len,
+                                                                   uint8_t* out,
+                                                                   bool url)
+{
+    const __m128i shuf = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i lut = url ? _mm_setr_epi8(BASE64_ENCODE_LUT(1)) : _mm_setr_epi8(BASE64_ENCODE_LUT(0));
+    size_t i = 0;
+    // 每次读取16个字节，使用其中的12个
+    for (; len - i >= 16; i += 12, out += 16) {
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i)), shuf);
+        __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        in = _mm_or_si128(t0, t1);
+        __m128i index = _mm_subs_epu8(in, _mm_set1_epi8(51));
+        index = _mm_sub_epi8(index, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+        _mm_storeu_si128((__m128i*)out, _mm_add_epi8(in, _mm_shuffle_epi8(lut, index)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t base64_encode_avx2(const uint8_t* src,
+                                                                 size_t len,
+                                                                 uint8_t* out,
+                                                                 bool url)
+{
+    const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,  //
+                                          1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i lut = url ? _mm256_setr_epi8(BASE64_ENCODE_LUT(1), BASE64_ENCODE_LUT(1))
+                            : _mm256_setr_epi8(BASE64_ENCODE_LUT(0), BASE64_ENCODE_LUT(0));
+    size_t i = 0;
+    // 两个通道各读取16个字节，分别使用其中的12个
+    for (; len - i >= 28; i += 24, out += 32) {
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src + i))),
+                                             _mm_loadu_si128((const __m128i*)(src + i + 12)), 1);
+        in = _mm256_shuffle_epi8(in, shuf);
+        __m256i t0 =
+            _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        __m256i t1 =
+            _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        in = _mm256_or_si256(t0, t1);
+        __m256i index = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+        index = _mm256_sub_epi8(index, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+        _mm256_storeu_si256((__m256i*)out, _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, index)));
+    }
+    return i;
+}
+
+// 字符转换成6位的值，同时校验，遇到不在字母表中的字符(包括填充)就停止
+// 每16个字符输出12个字节，但是会写入16个字节，输出缓存需要预留空间
+#define BASE64_DECODE_LUT_LO \
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define BASE64_DECODE_LUT_HI \
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define BASE64_DECODE_LUT_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define BASE64_DECODE_PACK 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3"))) static size_t base64_decode_ssse3(const uint8_t* src, size_t len, uint8_t* out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(BASE64_DECODE_LUT_LO);
+    const __m128i lut_hi = _mm_setr_epi8(BASE64_DECODE_LUT_HI);
+    const __m128i lut_roll = _mm_setr_epi8(BASE64_DECODE_LUT_ROLL);
+    const __m128i pack = _mm_setr_epi8(BASE64_DECODE_PACK);
+    const __m128i mask = _mm_set1_epi8(0x2f);
+    size_t i = 0;
+    for (; len - i >= 16; i += 16, out += 12) {
+        __m128i in = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, mask));
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xFFFF) {
+            break;
+        }
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask), hi_nibbles));
+        in = _mm_add_epi8(in, roll);
+        in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+        in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(in, pack));
+    }
+    return i;
+}
+
+// 每32个字符输出24个字节，但是会写入32个字节
+__attribute__((target("avx2"))) static size_t base64_decode_avx2(const uint8_t* src, size_t len, uint8_t* out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(BASE64_DECODE_LUT_LO, BASE64_DECODE_LUT_LO);
+    const __m256i lut_hi = _mm256_setr_epi8(BASE64_DECODE_LUT_HI, BASE64_DECODE_LUT_HI);
+    const __m256i lut_roll = _mm256_setr_epi8(BASE64_DECODE_LUT_ROLL, BASE64_DECODE_LUT_ROLL);
+    const __m256i pack = _mm256_setr_epi8(BASE64_DECODE_PACK, BASE64_DECODE_PACK);
+    const __m256i mask = _mm256_set1_epi8(0x2f);
+    size_t i = 0;
+    for (; len - i >= 32; i += 32, out += 24) {
+        __m256i in = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, mask));
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) {
+            break;
+        }
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask), hi_nibbles));
+        in = _mm256_add_epi8(in, roll);
+        in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+        in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+        in = _mm256_shuffle_epi8(in, pack);
+        in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i*)out, in);
+    }
+    return i;
+}
+#endif
+
+// 编码到out，out需要有(len + 2) / 3 * 4个字节，返回编码的长度
+static size_t base64_encode_buffer(const uint8_t* src, size_t len, uint8_t* out, bool url)
+{
+    const char* table = url ? base64_url_table : base64_table;
+    uint8_t* pos = out;
+    size_t i = 0;
+#ifdef TARS_BASE64_SIMD
+    if (BASE64_AVX2 == base64_level) {
+        i = base64_encode_avx2(src, len, pos, url);
+    }
+    else if (BASE64_SSSE3 == base64_level) {
+        i = base64_encode_ssse3(src, len, pos, url);
+    }
+    pos += i / 3 * 4;
+#endif
+    for (; len - i >= 3; i += 3, pos += 4) {
+        pos[0] = table[src[i] >> 2];
+        pos[1] = table[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+        pos[2] = table[((src[i + 1] & 0x0f) << 2) | (src[i + 2] >> 6)];
+        pos[3] = table[src[i + 2] & 0x3f];
+    }
+    if (len - i == 1) {
+        pos[0] = table[src[i] >> 2];
+        pos[1] = table[(src[i] & 0x03) << 4];
+        pos[2] = '=';
+        pos[3] = '=';
+        pos += 4;
+    }
+    else if (len - i == 2) {
+        pos[0] = table[src[i] >> 2];
+        pos[1] = table[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+        pos[2] = table[(src[i + 1] & 0x0f) << 2];
+        pos[3] = '=';
+        pos += 4;
+    }
+    return pos - out;
+}
+
+// 解码到out，忽略不在字母表中的字符，out需要有len / 4 * 3 + BASE64_DECODE_SLACK个字节
+// 返回解码的长度，有效字符数不是4的倍数返回-1，填充错误返回-2
+static ptrdiff_t base64_decode_buffer(const uint8_t* src, size_t len, uint8_t* out, bool url)
+{
+    const uint8_t* dtable = url ? base64_url_dtable : base64_dtable;
+    uint8_t* pos = out;
+    uint8_t block[4];
+    size_t i = 0, count = 0, valid = 0;
+    int pad = 0;
+    while (i < len) {
+#ifdef TARS_BASE64_SIMD
+        // 块的边界上尝试向量化，url字母表只使用标量代码
+        if (0 == count && !url) {
+            size_t n = 0;
+            if (BASE64_AVX2 == base64_level) {
+                n = base64_decode_avx2(src + i, len - i, pos);
+            }
+            else if (BASE64_SSSE3 == base64_level) {
+                n = base64_decode_ssse3(src + i, len - i, pos);
+            }
+            i += n, valid += n, pos += n / 4 * 3;
+        }
+#endif
+        // 向量化处理不了的字符，逐个处理，至少处理到下一个块的边界
+        for (size_t stop = i + 32; i < len && (i < stop || count > 0); ++i) {
+            uint8_t v = dtable[src[i]];
+            if (v & 0x80) {
+                continue;
+            }
+            ++valid;
+            if (v & 0x40) {
+                ++pad, v = 0;
+            }
+            block[count++] = v;
+            if (4 == count) {
+                *pos++ = (block[0] << 2) | (block[1] >> 4);
+                *pos++ = (block[1] << 4) | (block[2] >> 2);
+                *pos++ = (block[2] << 6) | block[3];
+                count = 0;
+                if (pad > 0) {
+                    pos -= pad;
+                    // 填充之后的字符不再解码，只统计数量
+                    for (++i; i < len; ++i) {
+                        valid += !(dtable[src[i]] & 0x80);
+                    }
+                }
+            }
+        }
+    }
+    if (valid % 4) {
+        return -1;
+    }
+    return pad > 2 ? -2 : pos - out;
+}
+
+// base64编码，url为true时使用url安全的字母表
+// 用法：tars.encodeB64(data, url)
+static int base64_encode(lua_State* L)
+{
+    size_t len = 0;
+    const uint8_t* src = (const uint8_t*)luaL_checklstring(L, 1, &len);
+    bool url = lua_toboolean(L, 2);
+    if (len > (SIZE_MAX - 2) / 4 * 3) {
+        luaL_error(L, "base64 integer overflow");
+    }
+
+    luaL_Buffer B;
+    uint8_t* out = (uint8_t*)luaL_buffinitsize(L, &B, (len + 2) / 3 * 4);
+    luaL_pushresultsize(&B, base64_encode_buffer(src, len, out, url));
+    return 1;
+}
+
+// base64解码，一遍完成校验和解码，有效字符数不是4的倍数时返回空字符串
+// 用法：tars.decodeB64(data, url)
+static int base64_decode(lua_State* L)
+{
+    size_t len = 0;
+    const uint8_t* src = (const uint8_t*)luaL_checklstring(L, 1, &len);
+    bool url = lua_toboolean(L, 2);
+
+    luaL_Buffer B;
+    uint8_t* out = (uint8_t*)luaL_buffinitsize(L, &B, len / 4 * 3 + BASE64_DECODE_SLACK);
+    ptrdiff_t n = base64_decode_buffer(src, len, out, url);
+    if (-2 == n) {
+        luaL_error(L, "invalid padding");
+    }
+    luaL_pushresultsize(&B, n < 0 ? 0 : n);
+    VERB("原始大小为%d, base64解码大小为:%d", len, (int)n);
+
+    return 1;
+}
+
+// 编码结构体后直接从编码缓存做base64编码，结果也写在编码缓存的后面，不产生中间的字符串
+// 用法：tars.encodeStructB64(context, id, obj, url)
+static int luatars_encodeStructB64(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    int id = luaL_checkinteger(L, 2);  // 结构体id
+    luaL_checktype(L, 3, LUA_TTABLE);  // 对象本身
+    bool url = lua_toboolean(L, 4);
+    lua_settop(L, 3);
+    lua_getmetatable(L, 1);            // 拿到元表
+    luaL_checktype(L, 4, LUA_TTABLE);  // 元表在4号位置
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    lua_pushvalue(L, 3);  // 栈顶是要编码的对象
+    encodeStruct(context, L, &B, id, 0, 0, true);
+    size_t n = B.n;
+    uint8_t* out = (uint8_t*)wb_reserve(&B, (n + 2) / 3 * 4);
+    size_t olen = base64_encode_buffer((const uint8_t*)B.s, n, out, url);
+    B.n += olen;
+    if (B.A && B.A->peak < B.n) {
+        B.A->peak = B.n;
+    }
+    lua_pushlstring(L, (const char*)out, olen);
+
+    return 1;
+}
+
+// base64解码到编码缓存，再直接从缓存解码结构体，不产生中间的字符串
+// 经过arena_call调用，解码过程中缓存一直被占用，__gc里的编码不会覆盖它
+// 用法：tars.decodeStructB64(context, id, data, proj, url)
+static int luatars_decodeStructB64(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    size_t len = 0;
+    const uint8_t* src = (const uint8_t*)luaL_checklstring(L, 3, &len);
+    bool url = lua_toboolean(L, 5);
+    lua_settop(L, 4);
+    const uint8_t* proj = lua_isnil(L, 4) ? NULL : check_projection(L, 4, context);
+    lua_getmetatable(L, 1);
+    lua_insert(L, 4);  // 4号位置是元表，投影放在5号位置
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    uint8_t* out = (uint8_t*)wb_reserve(&B, len / 4 * 3 + BASE64_DECODE_SLACK);
+    ptrdiff_t n = base64_decode_buffer(src, len, out, url);
+    if (-2 == n) {
+        luaL_error(L, "invalid padding");
+    }
+
+    struct read_buffer buffer;
+    buffer.n = n < 0 ? 0 : n, buffer.offset = 0, buffer.data = (const char*)out;
+    slice_source(L, &buffer, 0);
+    decodeStruct(context, L, &buffer, id, false, proj, false);
+
+    return 1;
+}
+
+// 解压器，跨调用保留z_stream和输出缓存，只在显式释放时归还内存
+struct tars_inflater {
+    z_stream strm;
+    bool init;
+
+    char* s;     // 输出缓存
+    size_t cap;
+    size_t max;  // 解压后的最大长度
+};
+
+static const void* inflater_mt = &inflater_mt;
+static const void* inflater = &inflater;
+
+// 解压到输出缓存，返回解压后的长度
+// gzip格式会根据尾部的ISIZE预先分配缓存，超过最大长度报错
+static size_t inflater_run(lua_State* L, struct tars_inflater* I, const unsigned char* in, size_t n)
+{
+    z_stream* strm = &I->strm;
+    if (!I->init) {
+        memset(strm, 0, sizeof(z_stream));
+        int ret = inflateInit2(strm, 47);  // 自动识别gzip和zlib格式
+        if (ret != Z_OK) {
+            luaL_error(L, "inflateInit2 failed: %d", ret);
+        }
+        I->init = true;
+    }
+    else {
+        inflateReset(strm);
+    }
+    // ISIZE是原始长度对2^32取模，小端序
+    size_t hint = n * 4;
+    if (n >= 18 && 0x1f == in[0] && 0x8b == in[1]) {
+        uint32_t isize;
+        memcpy(&isize, in + n - 4, sizeof isize);
+        hint = le32toh(isize);
+    }
+    // deflate的压缩比不超过1032:1，防止伪造的ISIZE占用过多内存
+    if (hint > n * 1032) {
+        hint = n * 1032;
+    }
+    // 多留一个字节，用来判断是否超过最大长度
+    hint = (hint < I->max ? hint : I->max) + 1;
+    if (I->cap < hint) {
+        free(I->s), I->s = NULL, I->cap = 0;
+        if (NULL == (I->s = (char*)malloc(hint))) {
+            luaL_error(L, "inflater out of memory, require %d", (int)hint);
+        }
+        I->cap = hint;
+    }
+
+    strm->next_in = (unsigned char*)in;
+    strm->avail_in = n;
+    size_t total = 0;
+    for (;;) {
+        if (total == I->cap) {
+            if (I->cap > I->max) {
+                luaL_error(L, "inflate output exceeds %d bytes", (int)I->max);
+            }
+            size_t cap = I->cap * 2 < I->max + 1 ? I->cap * 2 : I->max + 1;
+            char* s = (char*)realloc(I->s, cap);
+            if (NULL == s) {
+                luaL_error(L, "inflater out of memory, require %d", (int)cap);
+            }
+            I->s = s, I->cap = cap;
+        }
+        strm->next_out = (unsigned char*)I->s + total;
+        strm->avail_out = I->cap - total;
+        int ret = inflate(strm, Z_NO_FLUSH);
+        total = I->cap - strm->avail_out;
+        if (Z_STREAM_END == ret) {
+            break;
+        }
+        if (Z_BUF_ERROR == ret && strm->avail_out > 0) {
+            luaL_error(L, "inflateEnd error: %d", ret);  // 输入被截断
+        }
+        if (Z_OK != ret && Z_BUF_ERROR != ret) {
+            luaL_error(L, "inflate error:%d", Z_NEED_DICT == ret ? Z_DATA_ERROR : ret);
+        }
+    }
+    if (total > I->max) {
+        luaL_error(L, "inflate output exceeds %d bytes", (int)I->max);
+    }
+    return total;
+}
+
+static struct tars_inflater* inflater_new(lua_State* L, size_t max)
+{
+    struct tars_inflater* I = (struct tars_inflater*)lua_newuserdata(L, sizeof(struct tars_inflater));
+    memset(I, 0, sizeof(struct tars_inflater));
+    I->max = max;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, inflater_mt), lua_setmetatable(L, -2);
+    return I;
+}
+
+// 取得虚拟机默认的解压器，放在栈顶，不存在则创建并挂在注册表上
+static struct tars_inflater* default_inflater(lua_State* L)
+{
+    if (LUA_TUSERDATA == lua_rawgetp(L, LUA_REGISTRYINDEX, inflater)) {
+        return (struct tars_inflater*)lua_touserdata(L, -1);
+    }
+    lua_pop(L, 1);
+    struct tars_inflater* I = inflater_new(L, _MAX_STR_LEN);
+    lua_pushvalue(L, -1), lua_rawsetp(L, LUA_REGISTRYINDEX, inflater);
+    return I;
+}
+
+// 解压字符串
+// 用法：local data = inflater:unzip(zipped)
+static int inflater_unzip(lua_State* L)
+{
+    struct tars_inflater* I = (struct tars_inflater*)check_object(L, 1, inflater_mt, "inflater");
+    size_t n = 0;
+    const unsigned char* in = (const unsigned char*)check_source(L, 2, &n);
+    size_t total = inflater_run(L, I, in, n);
+    lua_pushlstring(L, I->s, total);
+    return 1;
+}
+
+// 解压后直接从输出缓存解码结构体，不产生中间的字符串
+// 用法：local obj = inflater:decode(context, id, zipped, proj)
+static int inflater_decode(lua_State* L)
+{
+    struct tars_inflater* I = (struct tars_inflater*)check_object(L, 1, inflater_mt, "inflater");
+    luaL_checktype(L, 2, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 2);
+    uint32_t id = luaL_checkinteger(L, 3);
+    size_t n = 0;
+    const unsigned char* in = (const unsigned char*)check_source(L, 4, &n);
+    lua_settop(L, 5);
+    const uint8_t* proj = lua_isnil(L, 5) ? NULL : check_projection(L, 5, context);
+
+    struct read_buffer buffer;
+    buffer.n = inflater_run(L, I, in, n), buffer.offset = 0, buffer.data = I->s;
+    slice_source(L, &buffer, 0);  // 解压缓存会被复用，不能切片
+    lua_getmetatable(L, 2);
+    lua_replace(L, 4);  // 解压之后不再需要输入，4号位置放元表
+    decodeStruct(context, L, &buffer, id, false, proj, false);
+
+    return 1;
+}
+
+// 设置解压后的最大长度，返回之前的值
+// 用法：local old = inflater:limit(16 * 1024 * 1024)
+static int inflater_limit(lua_State* L)
+{
+    struct tars_inflater* I = (struct tars_inflater*)check_object(L, 1, inflater_mt, "inflater");
+    lua_Integer old = I->max;
+    if (!lua_isnoneornil(L, 2)) {
+        lua_Integer max = luaL_checkinteger(L, 2);
+        if (max < 0) {
+            luaL_error(L, "invalid limit %d", (int)max);
+        }
+        I->max = max;
+    }
+    lua_pushinteger(L, old);
+    return 1;
+}
+
+// 释放输出缓存，z_stream保留
+static int inflater_release(lua_State* L)
+{
+    struct tars_inflater* I = (struct tars_inflater*)check_object(L, 1, inflater_mt, "inflater");
+    free(I->s);
+    I->s = NULL, I->cap = 0;
+    return 0;
+}
+
+static int inflater_gc(lua_State* L)
+{
+    struct tars_inflater* I = (struct tars_inflater*)lua_touserdata(L, 1);
+    if (I->init) {
+        inflateEnd(&I->strm);
+        I->init = false;
+    }
+    free(I->s);
+    I->s = NULL, I->cap = 0;
+    return 0;
+}
+
+// 创建解压器，max是解压后的最大长度
+// 用法：local inflater = tars.newInflater(16 * 1024 * 1024)
+static int luatars_newInflater(lua_State* L)
+{
+    lua_Integer max = luaL_optinteger(L, 1, _MAX_STR_LEN);
+    if (max < 0) {
+        luaL_error(L, "invalid limit %d", (int)max);
+    }
+    inflater_new(L, max);
+    return 1;
+}
+
+// 返回虚拟机默认的解压器，可以用来设置最大长度
+static int luatars_defaultInflater(lua_State* L)
+{
+    default_inflater(L);
+    return 1;
+}
+
+// 占用默认的解压器，放在栈顶，只在arena_call的调用里使用，调用结束时归还
+// 已经被外层占用时(例如在解码时的__gc里再解压)，使用一个同样限制的临时解压器
+static struct tars_inflater* take_inflater(lua_State* L)
+{
+    struct wb_arena* A = wb_arena(L);
+    struct tars_inflater* I = default_inflater(L);
+    if (A->inflating) {
+        size_t max = I->max;
+        lua_pop(L, 1);
+        return inflater_new(L, max);
+    }
+    A->inflating = A->busy;
+    return I;
+}
+
+// 使用默认的解压器解压
+// 用法：tars.unzip(zipped)
+static int unzip_str(lua_State* L)
+{
+    lua_settop(L, 1);
+    take_inflater(L);
+    lua_insert(L, 1);
+    return inflater_unzip(L);
+}
+
+// 使用默认的解压器解压后直接解码结构体
+// 用法：tars.unzipDecode(context, id, zipped, proj)
+static int luatars_unzipDecode(lua_State* L)
+{
+    lua_settop(L, 4);
+    take_inflater(L);
+    lua_insert(L, 1);
+    return inflater_decode(L);
+}
+
+#define DEFLATE_CHUNK (16 * 1024)
+
+// 压缩器，跨调用保留z_stream和输出缓存，编码时写满一个分块就压缩一次
+struct tars_deflater {
+    z_stream strm;
+    bool init;
+    int level;
+    int bits;  // 格式，gzip是31，zlib是15，raw是-15
+
+    char* s;  // 输出缓存
+    size_t n;
+    size_t cap;
+
+    char in[DEFLATE_CHUNK];  // 编码用的分块
+};
+
+static const void* deflater_mt = &deflater_mt;
+static const void* deflater = &deflater;
+
+// 开始一次压缩，需要时调整压缩级别
+static void deflater_begin(lua_State* L, struct tars_deflater* D, int level)
+{
+    z_stream* strm = &D->strm;
+    if (!D->init) {
+        memset(strm, 0, sizeof(z_stream));
+        int ret = deflateInit2(strm, level, Z_DEFLATED, D->bits, 8, Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            luaL_error(L, "deflateInit2 failed: %d", ret);
+        }
+        D->init = true;
+    }
+    else {
+        deflateReset(strm);
+        if (level != D->level) {
+            int ret = deflateParams(strm, level, Z_DEFAULT_STRATEGY);
+            if (ret != Z_OK) {
+                luaL_error(L, "deflateParams failed: %d", ret);
+            }
+        }
+    }
+    D->level = level;
+    D->n = 0;
+}
+
+// 压缩一段输入，追加到输出缓存，mode为Z_FINISH时结束压缩
+static void deflater_feed(lua_State* L, struct tars_deflater* D, const char* in, size_t n, int mode)
+{
+    z_stream* strm = &D->strm;
+    strm->next_in = (unsigned char*)in;
+    strm->avail_in = n;
+    int ret = Z_OK;
+    do {
+        if (D->n == D->cap) {
+            size_t cap = D->cap < DEFLATE_CHUNK ? DEFLATE_CHUNK : D->cap * 2;
+            if (cap > _MAX_STR_LEN) {
+                luaL_error(L, "deflate output too large, sz:%d", (int)D->n);
+            }
+            char* s = (char*)realloc(D->s, cap);
+            if (NULL == s) {
+                luaL_error(L, "deflater out of memory, require %d", (int)cap);
+            }
+            D->s = s, D->cap = cap;
+        }
+        strm->next_out = (unsigned char*)D->s + D->n;
+        strm->avail_out = D->cap - D->n;
+        ret = deflate(strm, mode);
+        if (Z_STREAM_ERROR == ret) {
+            luaL_error(L, "deflate error:%d", ret);
+        }
+        D->n = D->cap - strm->avail_out;
+    } while (0 == strm->avail_out || (Z_FINISH == mode && Z_STREAM_END != ret));
+}
+
+static void deflater_flush(struct write_buffer* B, const char* s, size_t n)
+{
+    deflater_feed(B->L, (struct tars_deflater*)B->ud, s, n, Z_NO_FLUSH);
+}
+
+static int check_level(lua_State* L, int idx, int def)
+{
+    int level = luaL_optinteger(L, idx, def);
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+        luaL_error(L, "invalid compression level %d", level);
+    }
+    return level;
+}
+
+static struct tars_deflater* deflater_new(lua_State* L, int level, int bits)
+{
+    struct tars_deflater* D = (struct tars_deflater*)lua_newuserdata(L, sizeof(struct tars_deflater));
+    memset(D, 0, sizeof(struct tars_deflater));
+    D->level = level, D->bits = bits;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, deflater_mt), lua_setmetatable(L, -2);
+    return D;
+}
+
+// 取得虚拟机默认的gzip压缩器，放在栈顶，不存在则创建并挂在注册表上
+static struct tars_deflater* default_deflater(lua_State* L)
+{
+    if (LUA_TUSERDATA == lua_rawgetp(L, LUA_REGISTRYINDEX, deflater)) {
+        return (struct tars_deflater*)lua_touserdata(L, -1);
+    }
+    lua_pop(L, 1);
+    struct tars_deflater* D = deflater_new(L, Z_DEFAULT_COMPRESSION, 31);
+    lua_pushvalue(L, -1), lua_rawsetp(L, LUA_REGISTRYINDEX, deflater);
+    return D;
+}
+
+// 1号位置是压缩器，2号位置是字符串
+static int deflater_zip_level(lua_State* L, int level)
+{
+    struct tars_deflater* D = (struct tars_deflater*)check_object(L, 1, deflater_mt, "deflater");
+    size_t n = 0;
+    const char* in = luaL_checklstring(L, 2, &n);
+    deflater_begin(L, D, level);
+    deflater_feed(L, D, in, n, Z_FINISH);
+    lua_pushlstring(L, D->s, D->n);
+    return 1;
+}
+
+// 1号位置是压缩器，然后是上下文，结构体id，对象
+// 编码的内容写满一个分块就交给deflate，不保留完整的编码结果
+static int deflater_encode_level(lua_State* L, int level)
+{
+    struct tars_deflater* D = (struct tars_deflater*)check_object(L, 1, deflater_mt, "deflater");
+    luaL_checktype(L, 2, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 2);
+    int id = luaL_checkinteger(L, 3);  // 结构体id
+    luaL_checktype(L, 4, LUA_TTABLE);  // 对象本身
+    lua_settop(L, 4);
+    lua_getmetatable(L, 2);
+    lua_insert(L, 4);  // 4号位置是元表，对象放在5号位置
+
+    deflater_begin(L, D, level);
+    struct write_buffer B;
+    wb_init(&B, L);
+    B.s = D->in, B.cap = sizeof(D->in);
+    B.flush = deflater_flush, B.ud = D;
+    lua_pushvalue(L, 5);  // 栈顶是要编码的对象
+    encodeStruct(context, L, &B, id, 0, 0, true);
+    deflater_feed(L, D, B.s, B.n, Z_FINISH);
+    lua_pushlstring(L, D->s, D->n);
+
+    return 1;
+}
+
+// 压缩字符串
+// 用法：local zipped = deflater:zip(data)
+static int deflater_zip(lua_State* L)
+{
+    struct tars_deflater* D = (struct tars_deflater*)check_object(L, 1, deflater_mt, "deflater");
+    return deflater_zip_level(L, D->level);
+}
+
+// 编码结构体的同时压缩
+// 用法：local zipped = deflater:encode(context, id, obj)
+static int deflater_encode(lua_State* L)
+{
+    struct tars_deflater* D = (struct tars_deflater*)check_object(L, 1, deflater_mt, "deflater");
+    return deflater_encode_level(L, D->level);
+}
+
+// 释放输出缓存，z_stream保留
+static int deflater_release(lua_State* L)
+{
+    struct tars_deflater* D = (struct tars_deflater*)check_object(L, 1, deflater_mt, "deflater");
+    free(D->s);
+    D->s = NULL, D->n = 0, D->cap = 0;
+    return 0;
+}
+
+static int deflater_gc(lua_State* L)
+{
+    struct tars_deflater* D = (struct tars_deflater*)lua_touserdata(L, 1);
+    if (D->init) {
+        deflateEnd(&D->strm);
+        D->init = false;
+    }
+    free(D->s);
+    D->s = NULL, D->n = 0, D->cap = 0;
+    return 0;
+}
+
+// 创建压缩器，level是压缩级别(-1~9)，format是"gzip"、"zlib"或者"raw"，默认gzip
+// 用法：local deflater = tars.newDeflater(1, "gzip")
+static int luatars_newDeflater(lua_State* L)
+{
+    static const char* formats[] = {"gzip", "zlib", "raw", NULL};
+    static const int bits[] = {31, 15, -15};
+    int level = check_level(L, 1, Z_DEFAULT_COMPRESSION);
+    int format = luaL_checkoption(L, 2, "gzip", formats);
+    deflater_new(L, level, bits[format]);
+    return 1;
+}
+
+// 占用默认的压缩器，放在栈顶，只在arena_call的调用里使用，调用结束时归还
+// 已经被外层占用时(例如在编码时的__gc里再压缩)，使用一个临时的gzip压缩器
+static struct tars_deflater* take_deflater(lua_State* L)
+{
+    struct wb_arena* A = wb_arena(L);
+    struct tars_deflater* D = default_deflater(L);
+    if (A->deflating) {
+        lua_pop(L, 1);
+        return deflater_new(L, Z_DEFAULT_COMPRESSION, 31);
+    }
+    A->deflating = A->busy;
+    return D;
+}
+
+// 使用默认的压缩器压缩成gzip
+// 用法：tars.zip(data, level)
+static int luatars_zip(lua_State* L)
+{
+    int level = check_level(L, 2, Z_DEFAULT_COMPRESSION);
+    lua_settop(L, 1);
+    take_deflater(L);
+    lua_insert(L, 1);
+    return deflater_zip_level(L, level);
+}
+
+// 使用默认的压缩器，编码结构体的同时压缩成gzip
+// 用法：tars.encodeZip(context, id, obj, level)
+static int luatars_encodeZip(lua_State* L)
+{
+    int level = check_level(L, 4, Z_DEFAULT_COMPRESSION);
+    lua_settop(L, 3);
+    take_deflater(L);
+    lua_insert(L, 1);
+    return deflater_encode_level(L, level);
+}
+
+// 可以追加的编码器，多次编码写到同一块缓存，最后一次生成字符串
+// 有自己的持久缓存，不占用虚拟机的编码缓存，可以跨请求重复使用
+struct tars_builder {
+    struct write_buffer B;
+    struct wb_arena A;
+    size_t committed;  // 成功追加的长度，编码出错时丢弃之后写入的部分
+};
+
+static const void* builder_mt = &builder_mt;
+
+// 取得编码器，丢掉上次出错留下的内容
+static struct tars_builder* check_builder(lua_State* L)
+{
+    struct tars_builder* T = (struct tars_builder*)check_object(L, 1, builder_mt, "builder");
+    T->B.L = L;
+    T->B.n = T->committed;
+    return T;
+}
+
+// 追加完成，返回编码器自身以便链式调用
+static int builder_commit(lua_State* L, struct tars_builder* T)
+{
+    T->committed = T->B.n;
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+// 类型可以是枚举值，也可以是结构体名称，mt是元表的位置
+static uint32_t builder_type(lua_State* L, struct tars_context* context, int idx, int mt)
+{
+    if (LUA_TSTRING != lua_type(L, idx)) {
+        uint32_t type = luaL_checkinteger(L, idx);
+        if (type >= LUATARS_TYPE_MAX) {
+            check_struct(L, context, type);
+        }
+        return type;
+    }
+    lua_pushvalue(L, idx);
+    lua_gettable(L, mt);
+    uint32_t id = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    check_struct(L, context, id);
+    return id;
+}
+
+// 准备编码用的栈，value是要编码的值，之前的参数是类型
+// 绑定的上下文放到value + 1，元表放到value + 2，类型解析完成后再调用builder_stack
+static struct tars_context* builder_context(lua_State* L, int value)
+{
+    lua_settop(L, value);
+    lua_getuservalue(L, 1);
+    struct tars_context* context = check_context(L, value + 1);
+    lua_getmetatable(L, value + 1);
+    return context;
+}
+
+// 4号位置换成元表，要编码的值放在栈顶
+static void builder_stack(lua_State* L, int value)
+{
+    lua_pushvalue(L, value);
+    lua_pushvalue(L, value + 2), lua_replace(L, 4);
+}
+
+// 取得tag序号，超出0~255时报错，不能截断成别的tag
+static uint8_t builder_tag(lua_State* L, int idx)
+{
+    lua_Integer tag = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, tag >= 0 && tag <= 255, idx, "tag out of range");
+    return (uint8_t)tag;
+}
+
+// 追加结构体，tag为nil时和encodeStruct一样不包裹，否则作为tag序号的字段
+// 用法：builder:struct(tag, "TBook", obj)
+static int builder_struct(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    struct tars_context* context = builder_context(L, 4);
+    uint32_t id = builder_type(L, context, 3, 6);
+    bool noWrap = lua_isnil(L, 2);
+    uint8_t tag = noWrap ? 0 : builder_tag(L, 2);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    builder_stack(L, 4);
+    encodeStruct(context, L, &T->B, id, tag, !noWrap, noWrap);
+    return builder_commit(L, T);
+}
+
+// 追加数组，tag为nil时和encodeList一样只写长度和元素
+// 用法：builder:list(tag, tars.STRING, {"a", "b"})
+static int builder_list(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    struct tars_context* context = builder_context(L, 4);
+    uint32_t value_type = builder_type(L, context, 3, 6);
+    bool noWrap = lua_isnil(L, 2);
+    uint8_t tag = noWrap ? 0 : builder_tag(L, 2);
+    builder_stack(L, 4);
+    encodeList(context, L, &T->B, value_type, tag, true, noWrap);
+    return builder_commit(L, T);
+}
+
+// 追加字典，tag为nil时和encodeMap一样只写长度和键值对
+// 用法：builder:map(tag, tars.STRING, "TBook", {k = {iId = 1}})
+static int builder_map(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    struct tars_context* context = builder_context(L, 5);
+    uint32_t key_type = luaL_checkinteger(L, 3);
+    uint32_t value_type = builder_type(L, context, 4, 7);
+    bool noWrap = lua_isnil(L, 2);
+    uint8_t tag = noWrap ? 0 : builder_tag(L, 2);
+    builder_stack(L, 5);
+    encodeMap(context, L, &T->B, key_type, value_type, tag, true, noWrap);
+    return builder_commit(L, T);
+}
+
+// 追加基础类型的字段
+// 用法：builder:basic(tag, tars.INT32, 1)
+static int builder_basic(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    uint8_t tag = builder_tag(L, 2);
+    uint32_t type = luaL_checkinteger(L, 3);
+    if (type < LUATARS_BOOL || type > LUATARS_STRING) {
+        luaL_error(L, "[C] %s %d: invalid basic type %d", __FUNCTION__, __LINE__, (int)type);
+    }
+    lua_settop(L, 4);
+    write_basic(L, &T->B, tag, type, true, def_zero);
+    return builder_commit(L, T);
+}
+
+// 追加已经编码好的数据
+// 用法：builder:raw(bytes)
+static int builder_raw(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    size_t n = 0;
+    const char* s = luaL_checklstring(L, 2, &n);
+    wb_addlstr(&T->B, s, n);
+    return builder_commit(L, T);
+}
+
+// 生成字符串并清空，缓存保留给下次使用
+// 用法：local data = builder:finish()
+static int builder_finish(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    if (T->A.peak < T->B.n) {
+        T->A.peak = T->B.n;
+    }
+    lua_pushlstring(L, T->B.s, T->B.n);
+    T->B.n = T->committed = 0;
+    return 1;
+}
+
+// 清空已经追加的内容
+static int builder_reset(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    T->B.n = T->committed = 0;
+    return 0;
+}
+
+// 已经追加的长度
+static int builder_size(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    lua_pushinteger(L, T->B.n);
+    return 1;
+}
+
+// 清空并释放扩容的缓存，回到栈上的缓存
+static int builder_release(lua_State* L)
+{
+    struct tars_builder* T = check_builder(L);
+    free(T->A.s);
+    T->A.s = NULL, T->A.cap = 0;
+    T->B.s = T->B.buf, T->B.cap = sizeof(T->B.buf);
+    T->B.n = T->committed = 0;
+    return 0;
+}
+
+static int builder_gc(lua_State* L)
+{
+    struct tars_builder* T = (struct tars_builder*)lua_touserdata(L, 1);
+    free(T->A.s);
+    T->A.s = NULL, T->A.cap = 0;
+    T->B.s = T->B.buf, T->B.cap = sizeof(T->B.buf);
+    return 0;
+}
+
+// 创建绑定上下文的编码器
+// 用法：local builder = context:newBuilder()
+static int luatars_newBuilder(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    check_context(L, 1);
+    lua_settop(L, 1);
+    struct tars_builder* T = (struct tars_builder*)lua_newuserdata(L, sizeof(struct tars_builder));
+    memset(T, 0, sizeof(struct tars_builder));
+    T->B.L = L;
+    T->B.A = &T->A;
+    T->B.s = T->B.buf, T->B.cap = sizeof(T->B.buf);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, builder_mt), lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1), lua_setuservalue(L, -2);  // 保持上下文的引用
+    return 1;
+}
+
+// 差异编码：只写入和旧对象不同的字段，格式和结构体一致，可以和旧版本的数据合并
+// 基础类型和字节数组写入新值，结构体写入嵌套的差异
+// 字典写成结构体：0号是新增和变化的键值，1号是删除的键的数组
+// 数组写成结构体：0号是新的长度，1号是变化区间的开始下标，2号是区间内的元素，区间外的元素不变
+// 结构体都写成差异，旧值不存在时和空表比较，应用时先填上默认值再修改
+
+static bool deltaStruct(  // 编码结构体的差异，栈顶是旧值，下面是新值
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    uint32_t id,
+    uint8_t tag,
+    bool noWrap);
+
+// B->n从a到b是旧值的编码，b之后是新值的编码，相同时都去掉，不同时只保留新值，返回是否不同
+static bool delta_keep(struct write_buffer* B, size_t a, size_t b)
+{
+    size_t n = B->n - b;
+    if (n == b - a && 0 == memcmp(B->s + a, B->s + b, n)) {
+        B->n = a;
+        return false;
+    }
+    memmove(B->s + a, B->s + b, n);
+    B->n = a + n;
+    return true;
+}
+
+// 编码基础类型或字节数组的差异，栈顶是旧值，下面是新值，都按强制写入编码后比较，nil等于默认值
+static bool deltaBasic(lua_State* L, struct write_buffer* B, uint8_t tag, uint32_t type, union default_value def, bool bytes)
+{
+    size_t a = B->n;
+    if (bytes) {
+        encodeSimpleList(L, B, tag, true, false);
+    }
+    else {
+        write_basic(L, B, tag, type, true, def);
+    }
+    size_t b = B->n;
+    lua_pushvalue(L, -2);
+    if (bytes) {
+        encodeSimpleList(L, B, tag, true, false);
+    }
+    else {
+        write_basic(L, B, tag, type, true, def);
+    }
+    lua_pop(L, 1);
+    return delta_keep(B, a, b);
+}
+
+// 编码容器元素的差异，栈顶是旧值，下面是新值，forced为真或者旧值不存在时必须写入
+static bool deltaElement(
+    struct tars_context* context,
+    lua_State* L,
+    struct write_buffer* B,
+    uint32_t type,
+    uint8_t tag,
+    bool forced)
+{
+    forced = forced || lua_isnil(L, -1);
+    bool changed = type < LUATARS_TYPE_MAX ? deltaBasic(L, B, tag, type, def_zero, false)
+                                           : deltaStruct(context, L, B, type, tag, false);
+    if (changed || !forced) {
+        return changed;
+    }
+    // 没有变化也要写入：基础类型写入新值，结构体写入空的差异
+    if (type < LUATARS_TYPE_MAX) {
+        lua_pushvalue(L, -2);
+        write_basic(L, B, tag, type, true, def_zero);
+        lua_pop(L, 1);
+    }
+    else {
+        write_header(B, tag, TarsHeadeStructBegin);
+        write_header(B, 0, TarsHeadeStructEnd);
+    }
+    return true;
+}
+
+// 差异两边的nil当作空表
+static void delta_tables(lua_State* L)
+{
+    for (int i = -2; i < 0; ++i) {
+        int t = lua_type(L, i);
+        if (LUA_TNIL == t) {
+            lua_newtable(L);
+            lua_replace(L, i - 1);
+        }
+        else if (LUA_TTABLE != t) {
+            luaL_error(L, "[C] %s %d: delta require a table, got '%s'", __FUNCTION__, __LINE__, lua_typename(L, t));
+        }
+    }
+}
+
+// 编码字典的差异，栈顶是旧值，下面是新值
+static bool deltaMap(struct tars_context* context,
+                     lua_State* L,
+                     struct write_buffer* B,
+                     uint32_t key_type,
+                     uint32_t value_type,
+                     uint8_t tag)
+{
+    delta_tables(L);
+    size_t start = B->n;
+    write_header(B, tag, TarsHeadeStructBegin);
+    size_t body = B->n;
+    // 新增和变化的键值，个数先占位
+    write_header(B, 0, TarsHeadeMap);
+    write_header(B, 0, TarsHeadeInt32);
+    size_t pos = B->n;
+    wb_addlstr(B, "\0\0\0\0", sizeof(uint32_t));
+    uint32_t count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -3)) {
+        size_t key = B->n;
+        lua_pushvalue(L, -2);
+        write_basic(L, B, 0, key_type, true, def_zero);
+        lua_pop(L, 1);
+        lua_pushvalue(L, -2);
+        lua_rawget(L, -4);
+        if (deltaElement(context, L, B, value_type, 1, false)) {
+            ++count;
+        }
+        else {
+            B->n = key;  // 没有变化，键也去掉
+        }
+        lua_pop(L, 2);
+    }
+    if (count < 1) {
+        B->n = body;
+    }
+    else {
+        wb_patch_be32(B, pos, count);
+    }
+    // 删除的键
+    size_t removed = B->n;
+    write_header(B, 1, TarsHeadeList);
+    write_header(B, 0, TarsHeadeInt32);
+    pos = B->n;
+    wb_addlstr(B, "\0\0\0\0", sizeof(uint32_t));
+    count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        if (LUA_TNIL == lua_rawget(L, -4)) {
+            lua_pushvalue(L, -2);
+            write_basic(L, B, 0, key_type, true, def_zero);
+            lua_pop(L, 1);
+            ++count;
+        }
+        lua_pop(L, 1);
+    }
+    if (count < 1) {
+        B->n = removed;
+    }
+    else {
+        wb_patch_be32(B, pos, count);
+    }
+    if (B->n == body) {
+        B->n = start;
+        return false;
+    }
+    write_header(B, 0, TarsHeadeStructEnd);
+    return true;
+}
+
+// 编码数组的差异，栈顶是旧值，下面是新值，只写入第一个到最后一个变化的元素之间的部分
+static bool deltaList(struct tars_context* context,
+                      lua_State* L,
+                      struct write_buffer* B,
+                      uint32_t value_type,
+                      uint8_t tag)
+{
+    delta_tables(L);
+    size_t nn = lua_rawlen(L, -2), on = lua_rawlen(L, -1);
+    size_t first = 0, last = 0;
+    size_t start = B->n;
+    for (size_t i = 1; i <= nn && i <= on; ++i) {
+        lua_rawgeti(L, -2, i);
+        lua_rawgeti(L, -2, i);
+        bool changed = deltaElement(context, L, B, value_type, 0, false);
+        B->n = start;  // 只用来比较
+        lua_pop(L, 2);
+        if (changed) {
+            first = first ? first : i;
+            last = i;
+        }
+    }
+    if (nn > on) {
+        first = first ? first : on + 1;
+        last = nn;
+    }
+    if (!first && nn == on) {
+        return false;
+    }
+    write_header(B, tag, TarsHeadeStructBegin);
+    write_int64(B, 0, nn);
+    if (first) {
+        write_int64(B, 1, first);
+        write_header(B, 2, TarsHeadeList);
+        write_int32(B, 0, last - first + 1);
+        for (size_t i = first; i <= last; ++i) {
+            lua_rawgeti(L, -2, i);
+            lua_rawgeti(L, -2, i);
+            deltaElement(context, L, B, value_type, 0, true);  // 区间内的元素都要写入
+            lua_pop(L, 2);
+        }
+    }
+    write_header(B, 0, TarsHeadeStructEnd);
+    return true;
+}
+
+// 按字段类型分派，和encodeField一致
+static bool deltaField(struct tars_context* context, lua_State* L, struct write_buffer* B, struct tars_field* field)
+{
+    if (LUATARS_MAP == field->type1) {
+        return deltaMap(context, L, B, field->type2, field->type3, field->tag);
+    }
+    else if (LUATARS_LIST == field->type1 && LUATARS_INT8 == field->type2) {
+        return deltaBasic(L, B, field->tag, field->type1, field->def, true);
+    }
+    else if (LUATARS_LIST == field->type1) {
+        return deltaList(context, L, B, field->type2, field->tag);
+    }
+    else if (LUATARS_TYPE_MAX > field->type1) {
+        return deltaBasic(L, B, field->tag, field->type1, field->def, false);
+    }
+    return deltaStruct(context, L, B, field->type1, field->tag, false);
+}
+
+bool deltaStruct(struct tars_context* context,
+                 lua_State* L,
+                 struct write_buffer* B,
+                 uint32_t id,
+                 uint8_t tag,
+                 bool noWrap)
+{
+    delta_tables(L);
+    struct tars_struct* st = check_struct(L, context, id);
+    size_t start = B->n;
+    if (!noWrap) {
+        write_header(B, tag, TarsHeadeStructBegin);
+    }
+    size_t body = B->n;
+    // 和encodeStruct一样按序号升序
+    for (uint32_t i = 0, t = 0; i < st->n; ++i) {
+        uint32_t index = i;
+        if (!st->sorted) {
+            while (STRUCT_NO_FIELD == st->index[t]) {
+                ++t;
+            }
+            index = st->index[t++];
+        }
+        struct tars_field* field = context->fields + st->first + index;
+        if (LUA_TSTRING != lua_geti(L, 4, (field - context->fields))) {
+            luaL_error(L, "field name not found for index = %d", field - context->fields);
+        }
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -4);  // 新值
+        lua_pushvalue(L, -2);
+        lua_rawget(L, -4);  // 旧值
+        deltaField(context, L, B, field);
+        lua_pop(L, 3);
+    }
+    if (B->n == body) {
+        B->n = start;
+        return false;
+    }
+    if (!noWrap) {
+        write_header(B, 0, TarsHeadeStructEnd);
+    }
+    return true;
+}
+
+// 编码两个版本的结构体之间的差异，没有变化时返回空字符串，old为nil时和空表比较
+// 用法：local delta = context:encodeDelta("TStudent", new, old)
+static int luatars_encodeDelta(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 4);
+    lua_getmetatable(L, 1);
+    lua_insert(L, 4);  // 4号位置是元表，旧值放在5号位置
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    lua_pushvalue(L, 3);
+    lua_pushvalue(L, 5);
+    deltaStruct(context, L, &B, id, 0, true);
+    wb_pushresult(&B, L);
+
+    return 1;
+}
+
+static void patchStruct(  // 把结构体的差异应用到栈顶的表上
+    struct tars_context* context,
+    lua_State* L,
+    struct read_buffer* buffer,
+    uint32_t id);
+
+// 读取数组的长度，数组的头部已经读取
+static int64_t read_list_size(lua_State* L, struct read_buffer* buffer, struct tars_header header)
+{
+    if (TarsHeadeList != header.type) {
+        luaL_error(L, "[C] %s %d: require 'list', got '%s'", __FUNCTION__, __LINE__, tars_type_name(header.type));
+    }
+    if (readHeader(L, buffer, &header, 0)) {
+        luaL_error(L, "[C] %s %d: list got no length", __FUNCTION__, __LINE__);
+    }
+    int64_t n = read_int64(L, buffer, def_zero, header, false);
+    if (n < 0 || n > _MAX_STR_LEN) {
+        luaL_error(L, "[C] %s %d: invalid list length %d", __FUNCTION__, __LINE__, (int)n);
+    }
+    return n;
+}
+
+// 应用容器元素的差异，栈顶是旧值，结构体是表就原地修改，否则先填上默认值，结果留在栈顶
+static void patchElement(struct tars_context* context,
+                         lua_State* L,
+                         struct read_buffer* buffer,
+                         uint32_t type,
+                         struct tars_header header)
+{
+    if (type < LUATARS_TYPE_MAX) {
+        lua_pop(L, 1);
+        read_basic(L, buffer, type, def_zero, header, false);
+        return;
+    }
+    if (TarsHeadeStructBegin != header.type) {
+        luaL_error(L, "[C] %s %d: invalid delta, require 'struct', got '%s'", __FUNCTION__, __LINE__,
+                   tars_type_name(header.type));
+    }
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        decodeStruct(context, L, buffer, type, true, NULL, false);
+    }
+    patchStruct(context, L, buffer, type);
+}
+
+// 差异里的容器写成结构体，栈顶的旧值不是表时换成新的表
+static void patch_container(lua_State* L, struct tars_header header, const void* mt)
+{
+    if (TarsHeadeStructBegin != header.type) {
+        luaL_error(L, "[C] %s %d: invalid delta, require 'struct', got '%s'", __FUNCTION__, __LINE__,
+                   tars_type_name(header.type));
+    }
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, mt), lua_setmetatable(L, -2);
+}
+
+// 应用字典的差异，栈顶是旧值，结果留在栈顶
+static void patchMap(struct tars_context* context,
+                     lua_State* L,
+                     struct read_buffer* buffer,
+                     uint32_t key_type,
+                     uint32_t value_type,
+                     struct tars_header header)
+{
+    patch_container(L, header, map_mt);
+    for (struct tars_header h; !readHeader(L, buffer, &h, -1);) {
+        if (0 == h.tag) {
+            for (int64_t i = read_map_size(L, buffer, h); i > 0; --i) {
+                if (readHeader(L, buffer, &h, 0)) {
+                    luaL_error(L, "[C] %s %d: map got no key", __FUNCTION__, __LINE__);
+                }
+                read_basic(L, buffer, key_type, def_zero, h, false);
+                if (readHeader(L, buffer, &h, 1)) {
+                    luaL_error(L, "[C] %s %d: map got no value", __FUNCTION__, __LINE__);
+                }
+                lua_pushvalue(L, -1);
+                lua_rawget(L, -3);
+                patchElement(context, L, buffer, value_type, h);
+                lua_rawset(L, -3);
+            }
+        }
+        else if (1 == h.tag) {
+            for (int64_t i = read_list_size(L, buffer, h); i > 0; --i) {
+                if (readHeader(L, buffer, &h, 0)) {
+                    luaL_error(L, "[C] %s %d: removed key not found", __FUNCTION__, __LINE__);
+                }
+                read_basic(L, buffer, key_type, def_zero, h, false);
+                lua_pushnil(L);
+                lua_rawset(L, -3);
+            }
+        }
+        else {
+            skipValue(L, buffer, h);
+        }
+    }
+}
+
+// 应用数组的差异，栈顶是旧值，结果留在栈顶
+static void patchList(struct tars_context* context,
+                      lua_State* L,
+                      struct read_buffer* buffer,
+                      uint32_t value_type,
+                      struct tars_header header)
+{
+    patch_container(L, header, list_mt);
+    int64_t n = -1, first = 1;
+    for (struct tars_header h; !readHeader(L, buffer, &h, -1);) {
+        if (0 == h.tag) {
+            n = read_int64(L, buffer, def_zero, h, false);
+        }
+        else if (1 == h.tag) {
+            first = read_int64(L, buffer, def_zero, h, false);
+        }
+        else if (2 == h.tag) {
+            int64_t count = read_list_size(L, buffer, h);
+            if (first < 1 || (n >= 0 && first + count - 1 > n)) {
+                luaL_error(L, "[C] %s %d: invalid delta range %d, %d", __FUNCTION__, __LINE__, (int)first, (int)count);
+            }
+            for (int64_t i = first; i < first + count; ++i) {
+                if (readHeader(L, buffer, &h, 0)) {
+                    luaL_error(L, "[C] %s %d: list element not found, index = %d", __FUNCTION__, __LINE__, (int)i);
+                }
+                lua_rawgeti(L, -1, i);
+                patchElement(context, L, buffer, value_type, h);
+                lua_rawseti(L, -2, i);
+            }
+        }
+        else {
+            skipValue(L, buffer, h);
+        }
+    }
+    // 去掉多余的尾部
+    for (int64_t i = lua_rawlen(L, -1); n >= 0 && i > n; --i) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i);
+    }
+}
+
+void patchStruct(struct tars_context* context, lua_State* L, struct read_buffer* buffer, uint32_t id)
+{
+    struct tars_struct* st = check_struct(L, context, id);
+    for (struct tars_header header; !readHeader(L, buffer, &header, -1);) {
+        uint8_t index = st->index[header.tag];
+        if (STRUCT_NO_FIELD == index) {
+            skipValue(L, buffer, header);  // 新协议的字段
+            continue;
+        }
+        struct tars_field* field = context->fields + st->first + index;
+        if (LUA_TSTRING != lua_geti(L, 4, st->first + index)) {
+            luaL_error(L, "field name not found for id = %d", id);
+        }
+        if (LUATARS_MAP == field->type1) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
+            patchMap(context, L, buffer, field->type2, field->type3, header);
+        }
+        else if (LUATARS_LIST == field->type1 && LUATARS_INT8 != field->type2) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
+            patchList(context, L, buffer, field->type2, header);
+        }
+        else if (field->type1 >= LUATARS_TYPE_MAX) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
+            patchElement(context, L, buffer, field->type1, header);
+        }
+        else {
+            decodeField(context, L, buffer, field, header, false, NULL, false);
+        }
+        lua_rawset(L, -3);
+    }
+}
+
+// 应用encodeDelta编码的差异，target可以是解码后的表，原地修改后返回
+// 也可以是编码后的数据，解码修改后重新编码，返回新的数据，target为nil时在默认值上修改
+// 用法：context:applyDelta("TStudent", delta, target)
+static int luatars_applyDelta(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    struct tars_context* context = check_context(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+    size_t n = 0;
+    const char* s = check_source(L, 3, &n);
+    lua_settop(L, 4);
+    lua_getmetatable(L, 1);
+    lua_insert(L, 4);  // 4号位置是元表，目标放在5号位置
+    check_struct(L, context, id);
+
+    struct read_buffer buffer;
+    buffer.n = n, buffer.offset = 0, buffer.data = s;
+    slice_source(L, &buffer, 3);
+
+    int t = lua_type(L, 5);
+    if (LUA_TNIL == t) {
+        decodeStruct(context, L, &buffer, id, true, NULL, false);
+        patchStruct(context, L, &buffer, id);
+        return 1;
+    }
+    if (LUA_TTABLE == t) {
+        lua_pushvalue(L, 5);
+        patchStruct(context, L, &buffer, id);
+        return 1;
+    }
+    // 编码后的数据，先解码成表
+    if (LUA_TLIGHTUSERDATA == t) {
+        luaL_error(L, "[C] %s %d: delta target require a table or data, got pointer", __FUNCTION__, __LINE__);
+    }
+    size_t blob_n = 0;
+    const char* blob = check_source(L, 5, &blob_n);
+    struct read_buffer old;
+    old.n = blob_n, old.offset = 0, old.data = blob;
+    slice_source(L, &old, 5);
+    decodeStruct(context, L, &old, id, false, NULL, false);
+    patchStruct(context, L, &buffer, id);
+
+    struct write_buffer B;
+    wb_init(&B, L);
+    encodeStruct(context, L, &B, id, 0, 0, true);
+    wb_pushresult(&B, L);
+
+    return 1;
+}
+
+int luaopen_tars(lua_State* L)
+{
+    base64_init();
+
+    // 注册所有的函数
+    luaL_Reg funs[] = {
         {"createContext", luatars_createContext},
+        {"parseIdl", luatars_parseIdl},
+        {"saveImage", luatars_saveImage},
+        {"loadImage", luatars_loadImage},
+        {"share", luatars_share},
+        {"unshare", luatars_unshare},
+        {"attach", luatars_attach},
         {"encodeStruct", luatars_encodeStruct},
         {"encodeMap", luatars_encodeMap},
         {"encodeList", luatars_encodeList},
+        {"newBuilder", luatars_newBuilder},
         {"decodeStruct", luatars_decodeStruct},
+        {"decodeInto", luatars_decodeInto},
+        {"encodeDelta", luatars_encodeDelta},
+        {"applyDelta", luatars_applyDelta},
         {"decodeMap", luatars_decodeMap},
         {"decodeList", luatars_decodeList},
+        {"decodeLazy", luatars_decodeLazy},
+        {"sliceStrings", luatars_sliceStrings},
+        {"encodeMany", luatars_encodeMany},
+        {"encodeRequest", luatars_encodeRequest},
+        {"encodeResponse", luatars_encodeResponse},
+        {"decodeRequest", luatars_decodeRequest},
+        {"decodeResponse", luatars_decodeResponse},
+        {"encodeAttr", luatars_encodeAttr},
+        {"decodeAttr", luatars_decodeAttr},
+        {"decodeMany", luatars_decodeMany},
+        {"compileProjection", luatars_compileProjection},
+        {"newDecoder", luatars_newDecoder},
+        {"splitFrames", luatars_splitFrames},
+        {"decodeFrames", luatars_decodeFrames},
+        {"encodeFrame", luatars_encodeFrame},
+        {"structToJson", luatars_structToJson},
+        {"fromJson", luatars_fromJson},
         {"dump", luatars_dump},
+        {"arenaStats", luatars_arenaStats},
+        {"arenaRelease", luatars_arenaRelease},
         {"encodeB64", base64_encode},
+        {"encodeStructB64", luatars_encodeStructB64},
+        {"decodeStructB64", luatars_decodeStructB64},
         {"decodeB64", base64_decode},
         {"unzip", unzip_str},
+        {"unzipDecode", luatars_unzipDecode},
+        {"newInflater", luatars_newInflater},
+        {"defaultInflater", luatars_defaultInflater},
+        {"zip", luatars_zip},
+        {"encodeZip", luatars_encodeZip},
+        {"newDeflater", luatars_newDeflater},
         {NULL, NULL},
     };
     luaL_newlib(L, funs);
+    // 使用编码缓存或者默认解压器、压缩器的函数
+    const char* arena_funs[] = {
+        "encodeStruct", "encodeMap", "encodeList", "encodeMany", "encodeRequest", "encodeResponse",
+        "encodeAttr", "encodeFrame", "structToJson", "fromJson", "saveImage", "encodeStructB64",
+        "decodeStructB64", "encodeZip", "encodeDelta", "applyDelta", "unzip", "unzipDecode", "zip", NULL,
+    };
+    arena_wrap(L, arena_funs);
     // 注册所有的类型定义
     set_luatars_enum(L, BOOL);
     set_luatars_enum(L, INT8);
@@ -1668,11 +7654,98 @@ int luaopen_tars(lua_State* L)
     set_luatars_enum(L, LIST);
     set_luatars_enum(L, TYPE_MAX);
 
+    if (LUA_TTABLE != lua_rawgetp(L, LUA_REGISTRYINDEX, object_mts)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k"), lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1), lua_rawsetp(L, LUA_REGISTRYINDEX, object_mts);
+    }
+    lua_pop(L, 1);
     lua_newtable(L), lua_rawsetp(L, LUA_REGISTRYINDEX, list_mt);
     lua_newtable(L), lua_rawsetp(L, LUA_REGISTRYINDEX, map_mt);
 
+    lua_newtable(L);
+    lua_pushcfunction(L, proxy_index), lua_setfield(L, -2, "__index");
+    lua_rawsetp(L, LUA_REGISTRYINDEX, proxy_mt);
+
+    lua_newtable(L), lua_rawsetp(L, LUA_REGISTRYINDEX, projection_mt);
+
+    luaL_Reg slice_funs[] = {
+        {"string", slice_string},
+        {"sub", slice_sub},
+        {"ptr", slice_ptr},
+        {NULL, NULL},
+    };
+    lua_newtable(L);
+    luaL_newlib(L, slice_funs), lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, slice_len), lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, slice_string), lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, slice_eq), lua_setfield(L, -2, "__eq");
+    lua_rawsetp(L, LUA_REGISTRYINDEX, slice_mt);
+
+    luaL_Reg stream_funs[] = {
+        {"feed", stream_feed},
+        {"pending", stream_pending},
+        {"reset", stream_reset},
+        {NULL, NULL},
+    };
+    lua_newtable(L);
+    luaL_newlib(L, stream_funs), lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, stream_gc), lua_setfield(L, -2, "__gc");
+    lua_rawsetp(L, LUA_REGISTRYINDEX, stream_mt);
+
+    luaL_Reg inflater_funs[] = {
+        {"unzip", inflater_unzip},
+        {"decode", inflater_decode},
+        {"limit", inflater_limit},
+        {"release", inflater_release},
+        {NULL, NULL},
+    };
+    lua_newtable(L);
+    luaL_newlib(L, inflater_funs), lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, inflater_gc), lua_setfield(L, -2, "__gc");
+    lua_rawsetp(L, LUA_REGISTRYINDEX, inflater_mt);
+
+    luaL_Reg deflater_funs[] = {
+        {"zip", deflater_zip},
+        {"encode", deflater_encode},
+        {"release", deflater_release},
+        {NULL, NULL},
+    };
+    lua_newtable(L);
+    luaL_newlib(L, deflater_funs), lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, deflater_gc), lua_setfield(L, -2, "__gc");
+    lua_rawsetp(L, LUA_REGISTRYINDEX, deflater_mt);
+
+    luaL_Reg builder_funs[] = {
+        {"struct", builder_struct},
+        {"list", builder_list},
+        {"map", builder_map},
+        {"basic", builder_basic},
+        {"raw", builder_raw},
+        {"finish", builder_finish},
+        {"reset", builder_reset},
+        {"size", builder_size},
+        {"release", builder_release},
+        {NULL, NULL},
+    };
+    lua_newtable(L);
+    luaL_newlib(L, builder_funs), lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, builder_gc), lua_setfield(L, -2, "__gc");
+    lua_rawsetp(L, LUA_REGISTRYINDEX, builder_mt);
+
     lua_rawgetp(L, LUA_REGISTRYINDEX, list_mt), lua_setfield(L, -2, "list_mt");
     lua_rawgetp(L, LUA_REGISTRYINDEX, map_mt), lua_setfield(L, -2, "map_mt");
 
+    // 库自己的userdata不能当作解码的数据
+    const void* object_mt_list[] = {slice_mt, proxy_mt, projection_mt, stream_mt, inflater_mt, deflater_mt, builder_mt};
+    for (size_t i = 0; i < sizeof(object_mt_list) / sizeof(object_mt_list[0]); ++i) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, object_mt_list[i]);
+        mark_object_mt(L, -1);
+        lua_pop(L, 1);
+    }
+
     return 1;
 }
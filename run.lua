@@ -20,7 +20,7 @@ struct TBook2 {
     2 optional long iWhen;
     3 optional TBook stBook1;
     4 optional map<int, int> mExtra1;
-    4 vector<string> vExtra2;
+    5 optional vector<string> vExtra2;
 };
 
 
@@ -39,6 +39,16 @@ struct TStudent1 {
     3 optional map<int, TBook> mBook;
     4 optional int iVersion;
 };
+
+struct TSparse {
+    20 optional int iLast;
+    3 optional string sFirst;
+    200 optional long iFar;
+};
+
+struct TBytes {
+    0 optional vector<byte> vData;
+};
 ]]
 
 local context = tars.parse(text);
@@ -50,10 +60,14 @@ local s1 = context:encodeStruct("TBook", {
     sName = "hello, world",
     iWhen = nil})
 print("测试普通结构体编码和解码", tars.toJson(context:decodeStruct("TBook", s1)))
+print("测试拒绝把上下文当作数据", pcall(context.decodeStruct, context, "TBook", context))
 
 
 local s2 = context:encodeList(tars.INT8, {1,0,0,0,0,1,2,3,4,5,6})
-print("测试数字数组的编解码", tars.toJson(context:decodeList(tars.INT8, s2)))
+print("测试字节数组的编解码", table.concat({context:decodeList(tars.INT8, s2):byte(1, -1)}, ","))
+
+local s21 = context:encodeList(tars.INT8, "\0\1binary\255")
+print("测试字节数组字符串的编解码", context:decodeList(tars.INT8, s21) == "\0\1binary\255")
 
 
 local s3 = context:encodeMap(tars.INT8, tars.STRING, {"world", "hello", "say i love you"})
@@ -99,3 +113,121 @@ local s7 = context:encodeStruct("TBook2", {
     vExtra2 = {"维生素C片", "适应症", "用于预防坏血症"},
 })
 print("测试结构体协议兼容", tars.toJson(context:decodeStruct("TBook", s7)))
+
+local s8 = context:encodeStruct("TSparse", {iLast = 20, sFirst = "3", iFar = 200})
+print("测试稀疏乱序字段", tars.toJson(context:decodeStruct("TSparse", s8)))
+
+local view = context:decodeLazy("TBook2", s7)
+print("测试延迟解码", view.sName, view.stBook1.sName, tars.toJson(view.mExtra1), view.iWhen)
+print("测试延迟解码的数字键", view[1], view[2])
+
+local proj = context:projection("TStudent", {"sId", "mBook.*.sName"})
+print("测试字段投影", tars.toJson(context:decodeStruct("TStudent", s6, proj)))
+
+local decoder = context:newDecoder("TBook", true)
+local frames = (string.pack(">I4", #s1 + 4) .. s1):rep(2)
+local decoded = {}
+for i = 1, #frames, 3 do
+    for _, obj in ipairs(decoder:feed(frames:sub(i, i + 2))) do
+        decoded[#decoded + 1] = obj
+    end
+end
+print("测试流式解码", #decoded, tars.toJson(decoded[2]), decoder:pending())
+local broken = string.pack(">I4", #s1 + 4) .. s1 .. string.pack(">I4", 6) .. "\x0f\xff"
+local list, err = context:newDecoder("TBook", true):feed(broken)
+print("测试流式解码出错", #list, err ~= nil)
+
+local batch, offsets = context:encodeMany("TBook", {{iId = 1, sName = "a"}, {iId = 2}, {sName = "c"}})
+print("测试批量编解码", #offsets, tars.toJson(context:decodeMany("TBook", batch)[3]))
+print("测试批量编码字符串数组", #context:encodeMany("TBook", {{iId = 1}, {iId = 2}}, true))
+
+local framed = context:encodeFrame("TBook", {iId = 3, sName = "帧"})
+local recv = framed .. framed .. framed:sub(1, 5)
+local consumed, spans = tars.splitFrames(recv)
+local _, objs = context:decodeFrames("TBook", recv)
+print("测试帧切分", consumed, #spans, #objs, tars.toJson(objs[2]))
+
+local req = context:encodeRequest({iVersion = 1, iRequestId = 7, sServantName = "App.Server.Obj", sFuncName = "getBook", context = {k = "v"}}, "TBook", {iId = 5, sName = "包体"}, true)
+local _, reqSpans = tars.splitFrames(req)
+local head, body, first, last = context:decodeRequest(req, "TBook", reqSpans[1], reqSpans[2])
+print("测试请求包", head.iRequestId, head.sFuncName, head.context.k, tars.toJson(body), tars.toJson(context:decodeStruct("TBook", req:sub(first, last))))
+local rsp = context:encodeResponse({iRequestId = 7, iRet = -1, sResultDesc = "失败", sBuffer = s1})
+print("测试响应包", context:decodeResponse(rsp).sResultDesc, tars.toJson(select(2, context:decodeResponse(rsp, "TBook"))))
+
+local attrs = context:encodeAttr({{"book", "TBook", {iId = 11, sName = "属性"}}, {"ret", tars.INT32, -2}})
+print("测试UniAttribute", tars.toJson(context:decodeAttr(attrs, "book", "TBook")), context:decodeAttr(attrs, "ret", tars.INT32), context:decodeAttr(attrs, "none", tars.INT32))
+
+local raw = ("\251\255\0base64"):rep(20)
+print("测试base64", tars.decodeB64(tars.encodeB64(raw)) == raw, tars.encodeB64("\251\255", true), tars.decodeB64(tars.encodeB64(raw, true), true) == raw)
+
+local b64 = context:encode("TBook", {iId = 12, sName = "base64"})
+print("测试base64结构体", b64 == tars.encodeB64(context:encodeStruct("TBook", {iId = 12, sName = "base64"})), tars.toJson(context:decode("TBook", b64)))
+
+print("测试解压器", tars.newInflater(1024):limit(), tars.defaultInflater():limit())
+
+local bigBook = {iId = 13, sName = ("压缩"):rep(10000)}
+local zipped = context:encodeZip("TBook", bigBook, 9)
+print("测试压缩编码", #zipped, context:unzipDecode("TBook", zipped).sName == bigBook.sName, tars.unzip(tars.zip("hello")))
+local zlibbed = context:encodeZip("TBook", bigBook, tars.newDeflater(1, "zlib"))
+print("测试zlib格式", tars.unzip(zlibbed) == context:encodeStruct("TBook", bigBook))
+
+local sJson = context:encodeStruct("TBook", {iId = 14, sName = "引号\"换行\n"})
+print("测试二进制转json", context:toJson("TBook", sJson), context:toJson("TBook2", s7, true))
+print("测试字节数组转json", context:toJson("TBytes", context:encodeStruct("TBytes", {vData = "\255\0ab"})))
+print("测试base64字节数组转二进制", context:decodeStruct("TBytes", context:fromJson("TBytes", '{"vData": "/wBhYg=="}')).vData == "\255\0ab")
+
+local sFromJson = context:fromJson("TBook2", '{"stBook1": {"iId": 2}, "sName": "json\\u4e2d", "iId": 1, "vExtra2": ["a"], "unknown": [1, {}]}')
+print("测试json转二进制", context:toJson("TBook2", sFromJson), context:toJson("TBook", context:fromJson("TBook", context:toJson("TBook", sJson))) == context:toJson("TBook", sJson))
+
+local idl, defines = tars.parse([[
+/* 块注释
+   struct TIgnored { 0 require int iId; }; */
+module Shop {
+    enum EColor { RED, GREEN = 5, BLUE };
+    const string NAME = "商店";
+    const int MAX = 0x10;
+    struct TItem {
+        0 require int iId = MAX;
+        1 optional EColor eColor = GREEN;
+        2 require string sName = "默认";
+        3 optional map<unsigned int, EColor> mColors;
+        4 optional vector<Shop::TItem> vChildren;
+    };
+    interface Api {
+        int get(int iId, out TItem item);
+    };
+};
+]])
+print("测试IDL解析", defines.BLUE, defines["Shop::NAME"], tars.toJson(idl:decodeStruct("Shop::TItem", idl:encodeStruct("TItem", {}))))
+
+local image = tars.saveImage(idl, defines)
+local idl2, defines2 = tars.loadImage(image)
+print("测试模式镜像", #image, defines2["Shop::NAME"], idl2:encodeStruct("TItem", {iId = 1}) == idl:encodeStruct("TItem", {iId = 1}), tars.toJson(idl2:decodeStruct("Shop::TItem", idl:encodeStruct("TItem", {}))))
+
+tars.share("shop", idl)
+local shared = tars.attach("shop")
+print("测试共享上下文", tars.attach("none"), shared:encodeStruct("TItem", {iId = 2}) == idl:encodeStruct("TItem", {iId = 2}), tars.toJson(shared:decodeStruct("Shop::TItem", idl:encodeStruct("TItem", {}))), tars.unshare("shop"), tars.unshare("shop"))
+
+local target = context:decodeStruct("TStudent", s4)
+context:decodeInto("TStudent", s6, target)
+local book = target.mBook[292]
+print("测试复用解码", target.mBook[3], rawequal(book, context:decodeInto("TStudent", s6, target).mBook[292]), tars.toJson(target))
+
+local builder = context:newBuilder()
+local built = builder:struct(nil, "TBook", {iId = 15, sName = "拼装"}):finish()
+local composed = builder:struct(0, "TBook", {iId = 16}):map(1, tars.STRING, "TBook", {k = {iId = 17}}):basic(2, tars.INT32, 7):list(3, tars.STRING, {"a", "b"}):raw(s1):size()
+print("测试追加编码", built == context:encodeStruct("TBook", {iId = 15, sName = "拼装"}), builder:list(nil, tars.STRING, {"x"}):finish() == context:encodeList(tars.STRING, {"x"}), composed, builder:size())
+
+tars.sliceStrings(8)
+local blob = context:encodeStruct("TBook", {iId = 18, sName = s1})
+local sliced = context:decodeStruct("TBook", blob)
+tars.sliceStrings(0)
+print("测试字符串切片", type(sliced.sName), #sliced.sName == #s1, sliced.sName:string() == s1, context:encodeStruct("TBook", sliced) == blob, tars.toJson(context:decodeStruct("TBook", sliced.sName)))
+
+local old = context:decodeStruct("TStudent", s6)
+local new = context:decodeStruct("TStudent", s6)
+new.iGrade, new.mBook[292].sName, new.mBook[7] = 1, "改名", {iId = 7}
+local delta = context:encodeDelta("TStudent", new, old)
+print("测试差异编码", #delta < #context:encodeStruct("TStudent", new), context:encodeDelta("TStudent", old, old) == "", context:decodeStruct("TStudent", context:applyDelta("TStudent", delta, s6)).mBook[292].sName, tars.toJson(context:applyDelta("TStudent", context:encodeDelta("TStudent", old, new), new)))
+
+print("编码缓存统计", tars.toJson(tars.arenaStats()))
@@ -4,165 +4,46 @@ local type = type
 local getmetatable = getmetatable
 local push = table.insert
 
--- 基础类型的枚举
-local __basic_types = {
-    ["bool"] = tars.BOOL,
-    ["byte"] = tars.INT8,
-    ["u_byte"] = tars.UINT8,
-    ["short"] = tars.INT16,
-    ["u_short"] = tars.UINT16,
-    ["int"] = tars.INT32,
-    ["u_int"] = tars.UINT32,
-    ["long"] = tars.INT64,
-    ["u_long"] = tars.INT64,
-    ["float"] = tars.FLOAT,
-    ["double"] = tars.DOUBLE,
-    ["string"] = tars.STRING,
-    ["map"] = tars.MAP,
-    ["list"] = tars.LIST,
-} 
-
--- 常用字典键的枚举
-local __map_keys = {
-    ["byte"] = tars.INT8,
-    ["u_byte"] = tars.UINT8,
-    ["short"] = tars.INT16,
-    ["u_short"] = tars.UINT16,
-    ["int"] = tars.INT32,
-    ["u_int"] = tars.UINT32,
-    ["long"] = tars.INT64,
-    ["u_long"] = tars.INT64,
-    ["string"] = tars.STRING,
-}
-
--- 字符串模式匹配展开
-local function str_expand(s, pattern)
-    local b = {}
-    for p in s:gmatch(pattern) do
-        push(b, p)
-    end
-    return b
-end
-
--- sTars: tars结构体声明字符串
-function tars.parse(sTars)
-    -- 忽略命名空间声明(1级大括号)
-    -- 忽略行注释，块注释排除不想写
-    local structName
-    local fields = {}
+-- sTars: tars协议文件的内容，path: 协议文件的路径，用于查找#include的文件
+-- 返回上下文和常量表，常量表包括const定义和枚举值
+local tars_parseIdl = tars.parseIdl
+function tars.parse(sTars, path)
     local mt = {
         __index = tars,
         -- 正数字 - tars.TYPE_MAX => 结构体的标识符，供C层用
         -- 标识符 => 正数字，供lua使用
     }
-    for line in sTars:gmatch("([^\r\n]+)") do
-        line = line:gsub("//.+", "")
-        if not structName then
-            -- 结构体开始
-            structName = line:match("struct%s+(%w[_%w]*)")
-            if structName then
-                if mt[structName] then
-                    error(("duplicate struct definition '%s'"):format(structName))
-                end
-                local id = tars.TYPE_MAX + #(fields)
-                -- 记录结构体的开始字段位置
-                mt[structName] = id
-                -- print("新增一个类型", structName, mt[structName])
-            end
-        else
-            -- 字段声明部分解析
-            local tag, forced, declare, default = line:match("(%d+)%s+(%w+)%s+([^=]+)=?(.*);")
-            if not tag then
-                if line:match("}") then
-                    -- 结构体结束
-                    structName = nil
-                end
-            else
-                -- 字段是否强制写
-                if forced == "require" then
-                    forced = true
-                elseif forced == "optional" then
-                    forced = false
-                else
-                    error(("invalid forced:'%s', line:'%s', %s"):format(forced, line, structName))
-                end
-                -- 字段类型和名称部分
-                declare = declare:gsub("%s+", " "):gsub("unsigned ", "u_")
-                local args = str_expand(declare, "[^<>, ]+")
-                local name = table.remove(args)
-                local type1, type2, type3 = table.unpack(args)
-                if type3 and type3 ~= "" then
-                    -- 这个是字典
-                    -- 校验键值对类型
-                    assert(type1 == "map" and __map_keys[type2])
-                    type1, type2, type3 = tars.MAP, __map_keys[type2], __basic_types[type3] or mt[type3]
-
-                    -- 校验键值对类型
-                    if not (type(type2) == "number" and type(type3) == "number") then
-                        error(("invalid map type '%s'"):format(declare))
-                    end
-                elseif type2 and type2 ~= "" then
-                    -- 这个是数组
-                    assert(type1 == "vector")
-                    type1, type2 = tars.LIST, __basic_types[type2] or mt[type2]
-                    type3 = nil
-
-                    -- 校验数组元素类型
-                    if not (type(type2) == "number") then
-                        error(("invalid vector value type '%s'"):format(declare))
-                    end
-                else
-                    -- 普通类型或者结构体
-                    type1 = __basic_types[type1] or mt[type1]
-
-                    -- 校验字段类型
-                    if type(type1) ~= "number" then
-                        error(("unknown type %s"):format(type2))
-                    end
-
-                    type2, type3 = nil, nil
-                end
-                if default and default ~= "" then
-                    if default:match("false") then
-                        default = 0
-                    elseif default:match("true") then
-                        default = 1
-                    else
-                        local s = default:match('"[^"]*"')
-                        if s then
-                            default = s
-                        else
-                            local n = tonumber(default)
-                            if not n then
-                                error(("invalid default value '%s'"):format(default))
-                            end
-                            default = n
-                        end
-                    end
-                end
-                -- print(tag, name, forced, type1, type2, type3, default)
-                -- 记录结构体字段的名称
-                mt[#fields] = name
-                push(fields, {
-                    tag = tag,
-                    name = name,
-                    forced = forced,
-                    type1 = type1,
-                    type2 = type2,
-                    type3 = type3,
-                    default = default,
-                })
-            end
-        end
-    end
-    -- 创建上下文
-    return tars.createContext(fields, mt)
+    return tars_parseIdl(sTars, mt, path)
 end
 
 -- sFile: 输入的协议文件
 function tars.open(sFile)
     local f = assert(io.open(sFile, "r"))
-    return tars.parse(f:read("*a"))
+    local sTars = f:read("*a")
+    f:close()
+    return tars.parse(sTars, sFile)
+end
+
+-- 加载tars.saveImage保存的二进制镜像，不需要重新解析协议，返回上下文和常量表
+-- 用法：tars.saveImage(context, defines)保存，tars.loadImage(data)加载
+local tars_loadImage = tars.loadImage
+function tars.loadImage(data)
+    return tars_loadImage(data, {__index = tars})
+end
+
+-- 取得进程内共享的上下文句柄，共享的上下文由tars.share(name, context)登记，没有登记时返回nil
+-- 同一个进程的所有lua虚拟机共用一份上下文，名称只在用到时放进当前虚拟机
+local tars_attach = tars.attach
+function tars.attach(name)
+    return tars_attach(name, {__index = tars})
+end
+
+-- sFile: 镜像文件，一次读入
+function tars.openImage(sFile)
+    local f = assert(io.open(sFile, "rb"))
+    local data = f:read("*a")
+    f:close()
+    return tars.loadImage(data)
 end
 
 -- 编码结构体
@@ -171,6 +52,12 @@ function tars:encodeStruct(name, obj)
     return tars_encodeStruct(self, getmetatable(self)[name], obj)
 end
 
+-- 批量编码结构体，separate为真时返回字符串数组，否则返回拼接的数据和每个结构体的起始位置
+local tars_encodeMany = tars.encodeMany
+function tars:encodeMany(name, list, separate)
+    return tars_encodeMany(self, getmetatable(self)[name], list, separate)
+end
+
 -- 编码数组
 local tars_encodeList = tars.encodeList
 function tars:encodeList(value_type, list)
@@ -191,56 +78,195 @@ function tars:encodeMap(key_type, value_type, map)
     end
 end
 
--- 解码结构体
+-- 解码的数据可以是字符串，userdata，也可以是轻量userdata加长度，如 context:decodeStruct(name, ptr, len)
+-- userdata和轻量userdata不复制，内存由调用者持有，解码期间不能释放，解码函数的数据参数都支持这三种形式
+
+-- 解码结构体，projection可选，只解码投影中的字段
 local tars_decodeStruct = tars.decodeStruct
-function tars:decodeStruct(name, data)
-    return tars_decodeStruct(self, getmetatable(self)[name], data)
+function tars:decodeStruct(name, ...)
+    return tars_decodeStruct(self, getmetatable(self)[name], ...)
+end
+
+-- 解码到已有的表里，复用嵌套的表，用于反复解码同一种消息
+local tars_decodeInto = tars.decodeInto
+function tars:decodeInto(name, ...)
+    return tars_decodeInto(self, getmetatable(self)[name], ...)
+end
+
+-- 编码两个版本之间的差异，只包含变化的字段，字典记录删除的键，数组记录变化的区间
+local tars_encodeDelta = tars.encodeDelta
+function tars:encodeDelta(name, new, old)
+    return tars_encodeDelta(self, getmetatable(self)[name], new, old)
+end
+
+-- 应用差异，target是表时原地修改，是编码后的数据时返回新的数据
+local tars_applyDelta = tars.applyDelta
+function tars:applyDelta(name, ...)
+    return tars_applyDelta(self, getmetatable(self)[name], ...)
+end
+
+-- 编译字段投影，paths是字段路径的数组，如 {"sId", "mBook.*.sName"}
+local tars_compileProjection = tars.compileProjection
+function tars:projection(name, paths)
+    return tars_compileProjection(self, getmetatable(self)[name], paths)
+end
+
+-- 批量解码encodeMany拼接的结构体
+local tars_decodeMany = tars.decodeMany
+function tars:decodeMany(name, ...)
+    return tars_decodeMany(self, getmetatable(self)[name], ...)
+end
+
+-- 延迟解码结构体，返回只在访问字段时解码的视图，视图引用着数据，所以数据只能是字符串
+local tars_decodeLazy = tars.decodeLazy
+function tars:decodeLazy(name, data)
+    return tars_decodeLazy(self, getmetatable(self)[name], data)
+end
+
+-- 创建流式解码器，framed表示每个结构体带4字节长度前缀，否则每个结构体用结构体开始和结束包裹
+local tars_newDecoder = tars.newDecoder
+function tars:newDecoder(name, framed)
+    return tars_newDecoder(self, getmetatable(self)[name], framed)
 end
 
 -- 解码数组
 local tars_decodeList = tars.decodeList
-function tars:decodeList(value_type, data)
+function tars:decodeList(value_type, ...)
     if type(value_type) == "number" then
-        return tars_decodeList(self, value_type, data)
+        return tars_decodeList(self, value_type, ...)
     else
-        return tars_decodeList(self, getmetatable(self)[value_type], data)
+        return tars_decodeList(self, getmetatable(self)[value_type], ...)
     end
 end
 
 -- 解码字典
 local tars_decodeMap = tars.decodeMap
-function tars:decodeMap(key_type, value_type, data)
+function tars:decodeMap(key_type, value_type, ...)
     if type(value_type) == "number" then
-        return tars_decodeMap(self, key_type, value_type, data)
+        return tars_decodeMap(self, key_type, value_type, ...)
     else
-        return tars_decodeMap(self, key_type, getmetatable(self)[value_type], data)
+        return tars_decodeMap(self, key_type, getmetatable(self)[value_type], ...)
     end
 end
 
--- 解码base64结构体
-function tars:decode(name, data)
-    return self:decodeStruct(name, tars.decodeB64(data))
+-- 编码带4字节长度前缀的帧
+local tars_encodeFrame = tars.encodeFrame
+function tars:encodeFrame(name, obj)
+    return tars_encodeFrame(self, getmetatable(self)[name], obj)
 end
 
--- 编码结构体成base64
-function tars:encode(name, obj)
-    return tars.encodeB64(self:encodeStruct(name, obj))
+-- 原地解码接收缓存里的帧，返回完整帧占用的字节数和结构体数组
+local tars_decodeFrames = tars.decodeFrames
+function tars:decodeFrames(name, ...)
+    return tars_decodeFrames(self, getmetatable(self)[name], ...)
+end
+
+-- 编码请求包和响应包，包体直接编码到sBuffer，framed为true时加上长度前缀
+-- 包体的结构体id，没有名称时不处理包体，名称写错时报错，不会悄悄跳过包体
+local function bodyId(self, name)
+    if name == nil then
+        return nil
+    end
+    local id = getmetatable(self)[name]
+    if id == nil then
+        error("unknown struct '" .. tostring(name) .. "'", 3)
+    end
+    return id
+end
+
+local tars_encodeRequest = tars.encodeRequest
+function tars:encodeRequest(packet, name, body, framed)
+    return tars_encodeRequest(self, packet, bodyId(self, name), body, framed)
+end
+
+local tars_encodeResponse = tars.encodeResponse
+function tars:encodeResponse(packet, name, body, framed)
+    return tars_encodeResponse(self, packet, bodyId(self, name), body, framed)
+end
+
+-- 解码请求包和响应包，返回包头，包体，包体的开始和结束位置
+-- 数据后面跟着数字时是轻量userdata的长度，包体的名称往后顺延一位
+local function decodePacket(decode, self, data, len, ...)
+    if type(data) == "userdata" and type(len) == "number" then
+        local name, first, last = ...
+        return decode(self, data, len, bodyId(self, name), first, last)
+    end
+    return decode(self, data, bodyId(self, len), ...)
+end
+
+local tars_decodeRequest = tars.decodeRequest
+function tars:decodeRequest(...)
+    return decodePacket(tars_decodeRequest, self, ...)
+end
+
+local tars_decodeResponse = tars.decodeResponse
+function tars:decodeResponse(...)
+    return decodePacket(tars_decodeResponse, self, ...)
+end
+
+-- 解码base64结构体，base64直接解码到缓存，不产生中间的字符串
+local tars_decodeStructB64 = tars.decodeStructB64
+function tars:decode(name, data, projection, url)
+    return tars_decodeStructB64(self, getmetatable(self)[name], data, projection, url)
+end
+
+-- 解压后直接解码结构体，使用虚拟机默认的解压器
+local tars_unzipDecode = tars.unzipDecode
+function tars:unzipDecode(name, ...)
+    return tars_unzipDecode(self, getmetatable(self)[name], ...)
+end
+
+-- 编码结构体的同时压缩，level可以是压缩级别，也可以是tars.newDeflater创建的压缩器
+local tars_encodeZip = tars.encodeZip
+function tars:encodeZip(name, obj, level)
+    if type(level) == "userdata" then
+        return level:encode(self, getmetatable(self)[name], obj)
+    end
+    return tars_encodeZip(self, getmetatable(self)[name], obj, level)
+end
+
+-- 编码结构体成base64，直接从编码缓存做base64编码
+local tars_encodeStructB64 = tars.encodeStructB64
+function tars:encode(name, obj, url)
+    return tars_encodeStructB64(self, getmetatable(self)[name], obj, url)
 end
 
 local list_mt = tars.list_mt
 local map_mt = tars.map_mt
 local tostring = tostring
 
+local escapes = {
+    ['"'] = '\\"', ['\\'] = '\\\\', ['\n'] = '\\n', ['\r'] = '\\r', ['\t'] = '\\t', ['\b'] = '\\b', ['\f'] = '\\f',
+}
+
+local function escape(c)
+    return escapes[c] or string.format("\\u%04x", c:byte())
+end
+
 local function addValue(buf, s)
+    if type(s) == "userdata" then
+        s = tostring(s)  -- 大字符串解码出的切片
+    end
     if type(s) == "string" then
         push(buf, '"')
-        push(buf, (s:gsub('"', '\\"')))
+        push(buf, (s:gsub('[%c"\\]', escape)))
         push(buf, '"')
     else
         push(buf, tostring(s))
     end
 end
 
+-- json的键只能是字符串
+local function addKey(buf, k)
+    if type(k) == "string" then
+        addValue(buf, k)
+    else
+        push(buf, '"')
+        push(buf, tostring(k))
+        push(buf, '"')
+    end
+end
+
 local function toJson(obj, buf)
     if getmetatable(obj) == list_mt then
         push(buf, '[')
@@ -264,7 +290,7 @@ local function toJson(obj, buf)
             else
                 b = false
             end
-            addValue(buf, k)
+            addKey(buf, k)
             push(buf, ': ')
             if type(v) == "table" then
                 toJson(v, buf)
@@ -277,14 +303,30 @@ local function toJson(obj, buf)
     return buf
 end
 
-function tars.toJson(obj)
+-- 转换成json，可以是解码后的lua表，也可以直接转换二进制流
+-- 用法：
+--  1. tars.toJson(obj)
+--  2. context:toJson("TBook", data, ordered)，不产生中间的lua表，ordered为true时按字段声明的顺序输出
+local tars_structToJson = tars.structToJson
+function tars.toJson(obj, name, ...)
+    if type(obj) == "userdata" then
+        return tars_structToJson(obj, getmetatable(obj)[name], ...)
+    end
     return table.concat(toJson(obj, {}))
 end
 
--- 解析常量定义
+-- 把json直接编码成结构体，字段可以是任意顺序，缺失的字段按默认值处理
+-- 用法：context:fromJson("TBook", json)
+local tars_fromJson = tars.fromJson
+function tars:fromJson(name, json)
+    return tars_fromJson(self, getmetatable(self)[name], json)
+end
+
+-- 解析常量定义，只逐行提取const string和const int，不解析整个协议，也不处理#include
+-- 需要枚举值和完整的常量时使用tars.open返回的常量表
 function tars.parseDefine(fileName)
     local module = {}
-    for line in assert(io.open(fileName)):lines() do
+    for line in io.lines(fileName) do
         line = line:gsub("%s+", " ")
         local name, val = line:match 'const string (%S+) ?= ?"([^"]+)"'
         if not name then